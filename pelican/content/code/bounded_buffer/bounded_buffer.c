@@ -0,0 +1,397 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <wait.h>
+#include <sys/mman.h>
+#include "buffer.h"
+
+/* Most producers of a run */
+#define MAXPRODUCERS 1024
+
+/* Largest batch */
+#define MAXBATCH 1024
+
+typedef struct
+{
+  double rate; /* Elements per second */
+  long full; /* Pushes that found the buffer full */
+  long empty; /* Pops that found the buffer empty */
+  long errors; /* Elements lost or out of order */
+  double calls; /* System calls of the buffer for each element, in all processes */
+  double mean; /* Latency from the creation of an element to its pop, ns */
+  long long p50;
+  long long p99;
+} result_t;
+
+/* Counters of the producers, in shared memory */
+typedef struct
+{
+  long full;
+  long calls;
+} shared_t;
+
+long buffer_calls;
+long buffer_timeout = 100;
+
+long long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void usage(char *argv[])
+{
+  printf("Bounded buffer shared by processes\n");
+  printf("%s [-b <buffer>] [-k <batch>] [-t <timeout>] <size> <producers> <elements>\n", argv[0]);
+  printf("%s bench [<size> [<elements>]]\n", argv[0]);
+  printf("%s batch [<producers> [<size> [<elements>]]]\n", argv[0]);
+  printf("%s wait [<size> [<elements>]]\n", argv[0]);
+  printf("\n");
+  printf("     -b <buffer> - sem (three SysV semaphores as in semaphores3.c, default), wait (the same semaphores,\n");
+  printf("                   waiting for room or elements instead of failing) or ring (lock-free ring)\n");
+  printf("     -k <batch> - Move up to this many elements at once, as many as the buffer has room or elements for (1 - %d, default 1)\n", MAXBATCH);
+  printf("     -t <timeout> - Milliseconds the wait buffer waits before failing (default %ld)\n", buffer_timeout);
+  printf("     <size> - Elements the buffer holds\n");
+  printf("     <producers> - Processes pushing elements, the parent pops them (1 - %d)\n", MAXPRODUCERS);
+  printf("     <elements> - Elements pushed by each producer\n");
+  printf("     bench - Elements per second of both buffers with 1 to 64 producers but no more than <elements>, <elements> in all (default 64 and 200000)\n");
+  printf("     batch - Elements per second and latency of the semaphores with batches of 1 to 64 elements (default 4, 64 and 200000)\n");
+  printf("     wait - Failed attempts and system calls of the sem and wait buffers with 1 to 64 producers but no more than <elements> (default 64 and 200000)\n");
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+  long long x = *(const long long *) a, y = *(const long long *) b;
+
+  return (x > y) - (x < y);
+}
+
+/* A producer creates the elements of a batch as the buffer takes those it already had */
+static void produce(buffer_t *b, int producer, int elements, int batch, shared_t *shared)
+{
+  element_t e[MAXBATCH];
+  long full = 0;
+  int j = 0, have = 0, n;
+
+  buffer_calls = 0;
+  while(j < elements || have){
+    while(have < batch && j < elements){
+      e[have].producer = producer;
+      e[have].sequence = j++;
+      e[have].stamp = now_ns();
+      have++;
+    }
+
+    n = (batch > 1 && b->push_batch != NULL) ? b->push_batch(e, have) : b->push(e);
+    if(!n){
+      full++;
+      sched_yield();
+      continue;
+    }
+    memmove(e, e + n, (have - n) * sizeof(element_t));
+    have -= n;
+  }
+
+  __atomic_add_fetch(&shared->full, full, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&shared->calls, buffer_calls, __ATOMIC_RELAXED);
+}
+
+/*
+ * A run.
+ * Forks the producers, which push their elements retrying while the buffer
+ * is full, and pops all of them in the parent, checking that the elements
+ * of each producer arrive in order. As in semaphores3.c nobody sleeps in
+ * the buffer, except in the wait buffer: a failed attempt just gives the
+ * processor to someone else. With batches, elements move up to batch at a
+ * time on both sides.
+ */
+void run(buffer_t *b, int size, int producers, int elements, int batch, result_t *r)
+{
+  element_t e[MAXBATCH];
+  shared_t *shared;
+  int *expected;
+  long long *latencies;
+  long long start, elapsed, now, sum = 0;
+  long total = (long) producers * elements, n = 0;
+  int i, k, got, status;
+
+  shared = mmap(NULL, sizeof(shared_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(shared == MAP_FAILED || (expected = calloc(producers, sizeof(int))) == NULL ||
+     (latencies = malloc(total * sizeof(long long))) == NULL){
+    perror("run");
+    exit(1);
+  }
+  shared->full = shared->calls = 0;
+  b->init(size);
+  fflush(stdout);
+
+  start = now_ns();
+  for(i = 0; i < producers; i++){
+    if(fork() == 0){
+      produce(b, i, elements, batch, shared);
+      exit(0);
+    }
+  }
+
+  buffer_calls = 0;
+  r->empty = r->errors = 0;
+  while(n < total){
+    if(batch > 1 && b->pop_batch != NULL){
+      got = b->pop_batch(e, (total - n < batch) ? total - n : batch);
+    }
+    else{
+      got = b->pop(e);
+    }
+    if(!got){
+      r->empty++;
+      sched_yield();
+      continue;
+    }
+
+    now = now_ns();
+    for(k = 0; k < got; k++){
+      if(e[k].producer < 0 || e[k].producer >= producers || e[k].sequence != expected[e[k].producer]){
+        r->errors++;
+      }
+      else{
+        expected[e[k].producer]++;
+      }
+      latencies[n++] = now - e[k].stamp;
+      sum += now - e[k].stamp;
+    }
+  }
+  elapsed = now_ns() - start;
+
+  while(wait(&status) > 0);
+  qsort(latencies, total, sizeof(long long), compare_latency);
+  r->rate = total / (elapsed / 1e9);
+  r->full = shared->full;
+  r->calls = (double) (shared->calls + buffer_calls) / total;
+  r->mean = (double) sum / total;
+  r->p50 = latencies[total / 2];
+  r->p99 = latencies[total * 99 / 100];
+
+  b->destroy();
+  munmap(shared, sizeof(shared_t));
+  free(expected);
+  free(latencies);
+}
+
+/*
+ * Benchmark.
+ * The same number of elements through both buffers, split among more and
+ * more producers, as long as each one has at least one.
+ * Returns 0 if the arguments are not valid.
+ */
+int bench(int argc, char *argv[])
+{
+  result_t sem, ring;
+  int size = 64;
+  int elements = 200000;
+  int producers;
+
+  if(argc > 0){
+    size = strtol(argv[0], NULL, 10);
+  }
+  if(argc > 1){
+    elements = strtol(argv[1], NULL, 10);
+  }
+  if(size < 1 || elements < 1){
+    return 0;
+  }
+
+  printf("Elements per second, buffer of %d elements, %d elements\n", size, elements);
+  printf("%9s %14s %14s %12s %12s %12s %12s\n", "producers", "semop el/s", "ring el/s",
+         "semop full", "ring full", "semop empty", "ring empty");
+
+  for(producers = 1; producers <= 64 && producers <= elements; producers *= 2){
+    run(&sem_buffer, size, producers, elements / producers, 1, &sem);
+    run(&ring_buffer, size, producers, elements / producers, 1, &ring);
+    if(sem.errors || ring.errors){
+      printf("Lost or out of order: %ld semop, %ld ring\n", sem.errors, ring.errors);
+    }
+
+    printf("%9d %14.0f %14.0f %12ld %12ld %12ld %12ld\n", producers, sem.rate, ring.rate,
+           sem.full, ring.full, sem.empty, ring.empty);
+  }
+
+  return 1;
+}
+
+/*
+ * Batch benchmark.
+ * The semaphore buffer moving elements one at a time, three semop() for
+ * each, then in batches of up to 2 to 64 elements, two semop() for each
+ * batch, however many elements it holds.
+ * Returns 0 if the arguments are not valid.
+ */
+int bench_batch(int argc, char *argv[])
+{
+  result_t r;
+  int producers = 4;
+  int size = 64;
+  int elements = 200000;
+  int batch;
+
+  if(argc > 0){
+    producers = strtol(argv[0], NULL, 10);
+  }
+  if(argc > 1){
+    size = strtol(argv[1], NULL, 10);
+  }
+  if(argc > 2){
+    elements = strtol(argv[2], NULL, 10);
+  }
+  if(producers < 1 || producers > MAXPRODUCERS || size < 1 || elements < producers){
+    return 0;
+  }
+
+  printf("Semaphore buffer of %d elements, %d producers, %d elements\n", size, producers, elements);
+  printf("%6s %12s %10s %10s %10s %10s %10s %10s\n", "batch", "el/s", "calls/el", "mean us", "p50 us", "p99 us", "full", "empty");
+
+  for(batch = 1; batch <= 64; batch *= 2){
+    run(&sem_buffer, size, producers, elements / producers, batch, &r);
+    if(r.errors){
+      printf("Lost or out of order: %ld\n", r.errors);
+    }
+
+    printf("%6d %12.0f %10.2f %10.1f %10.1f %10.1f %10ld %10ld\n", batch, r.rate, r.calls,
+           r.mean / 1e3, r.p50 / 1e3, r.p99 / 1e3, r.full, r.empty);
+  }
+
+  return 1;
+}
+
+/*
+ * Wait benchmark.
+ * Attempts that find the sem buffer full or empty are lost, after taking
+ * and releasing the lock for nothing; the wait buffer sleeps instead, and
+ * only fails if it times out.
+ * Returns 0 if the arguments are not valid.
+ */
+int bench_wait(int argc, char *argv[])
+{
+  result_t sem, wait;
+  int size = 64;
+  int elements = 200000;
+  int producers;
+
+  if(argc > 0){
+    size = strtol(argv[0], NULL, 10);
+  }
+  if(argc > 1){
+    elements = strtol(argv[1], NULL, 10);
+  }
+  if(size < 1 || elements < 1){
+    return 0;
+  }
+
+  printf("Buffer of %d elements, %d elements, timeout %ld ms\n", size, elements, buffer_timeout);
+  printf("%9s %12s %12s %12s %12s %10s %10s\n", "producers", "semop el/s", "wait el/s",
+         "semop failed", "wait failed", "semop c/el", "wait c/el");
+
+  for(producers = 1; producers <= 64 && producers <= elements; producers *= 2){
+    run(&sem_buffer, size, producers, elements / producers, 1, &sem);
+    run(&wait_buffer, size, producers, elements / producers, 1, &wait);
+    if(sem.errors || wait.errors){
+      printf("Lost or out of order: %ld semop, %ld wait\n", sem.errors, wait.errors);
+    }
+
+    printf("%9d %12.0f %12.0f %12ld %12ld %10.2f %10.2f\n", producers, sem.rate, wait.rate,
+           sem.full + sem.empty, wait.full + wait.empty, sem.calls, wait.calls);
+  }
+
+  return 1;
+}
+
+int main(int argc, char *argv[])
+{
+  buffer_t *b = &sem_buffer;
+  char *name = "sem";
+  result_t r;
+  int size, producers, elements, batch = 1;
+  int opt;
+
+  if(argc > 1 && !strcmp(argv[1], "bench")){
+    if(!bench(argc - 2, argv + 2)){
+      usage(argv);
+      exit(0);
+    }
+    return 0;
+  }
+  if(argc > 1 && !strcmp(argv[1], "batch")){
+    if(!bench_batch(argc - 2, argv + 2)){
+      usage(argv);
+      exit(0);
+    }
+    return 0;
+  }
+  if(argc > 1 && !strcmp(argv[1], "wait")){
+    if(!bench_wait(argc - 2, argv + 2)){
+      usage(argv);
+      exit(0);
+    }
+    return 0;
+  }
+
+  while((opt = getopt(argc, argv, "b:k:t:")) != -1){
+    switch(opt){
+    case 'b':
+      name = optarg;
+      break;
+    case 'k':
+      batch = strtol(optarg, NULL, 10);
+      break;
+    case 't':
+      buffer_timeout = strtol(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv);
+      exit(0);
+    }
+  }
+
+  if(argc - optind < 3){
+    usage(argv);
+    exit(0);
+  }
+
+  if(!strcmp(name, "ring")){
+    b = &ring_buffer;
+  }
+  else if(!strcmp(name, "wait")){
+    b = &wait_buffer;
+  }
+  else if(strcmp(name, "sem")){
+    usage(argv);
+    exit(0);
+  }
+
+  size = strtol(argv[optind], NULL, 10);
+  producers = strtol(argv[optind + 1], NULL, 10);
+  elements = strtol(argv[optind + 2], NULL, 10);
+  if(size < 1 || producers < 1 || producers > MAXPRODUCERS || elements < 1 || batch < 1 || batch > MAXBATCH || buffer_timeout < 1){
+    usage(argv);
+    exit(0);
+  }
+
+  printf("Buffer: %s, %d elements\n", name, size);
+  printf("Producers: %d, %d elements each\n", producers, elements);
+  printf("Batch: up to %d elements\n", batch);
+
+  run(b, size, producers, elements, batch, &r);
+
+  printf("Elements per second: %.0f\n", r.rate);
+  printf("System calls for each element: %.2f\n", r.calls);
+  printf("Latency (us): mean %.1f, p50 %.1f, p99 %.1f\n", r.mean / 1e3, r.p50 / 1e3, r.p99 / 1e3);
+  printf("Pushes on a full buffer: %ld\n", r.full);
+  printf("Pops on an empty buffer: %ld\n", r.empty);
+  printf("Lost or out of order: %ld\n", r.errors);
+
+  return 0;
+}
@@ -0,0 +1,50 @@
+/* Bounded buffers shared by processes */
+
+/* The buffer of semaphores3.c, this time holding the elements: producers */
+/* forked by the consumer push elements, the consumer pops them. Every */
+/* buffer is created before forking, in memory mapped as shared. */
+
+/* An element tells who wrote it and when, so that the consumer can check */
+/* that nothing is lost and that the elements of a producer keep their order */
+typedef struct
+{
+  int producer;
+  int sequence;
+  long long stamp; /* CLOCK_MONOTONIC ns of the push */
+} element_t;
+
+typedef struct
+{
+  void (*init)(int size); /* Called before forking, size elements at most */
+  int (*push)(element_t *e); /* Returns 1 if the element has been written, 0 if the buffer is full */
+  int (*pop)(element_t *e); /* Returns 1 if an element has been read, 0 if the buffer is empty */
+  void (*destroy)(void);
+  int (*push_batch)(element_t *e, int max); /* NULL to push them one by one */
+  int (*pop_batch)(element_t *e, int max); /* NULL to pop them one by one */
+} buffer_t;
+
+/* push_batch writes the first elements of e, up to max and as many as the */
+/* buffer seems to have room for, in a single claim. It returns how many it */
+/* wrote, 0 if the buffer is full. pop_batch reads likewise up to max elements */
+/* into e, as many as the buffer seems to hold, and returns 0 if it is empty */
+
+/* Three SysV semaphores as in semaphores3.c: the lock of the buffer, */
+/* the free cells and the elements */
+extern buffer_t sem_buffer;
+
+/* The same semaphores, but push and pop sleep until the buffer has room or */
+/* elements, without holding the lock, and fail only after buffer_timeout */
+extern buffer_t wait_buffer;
+
+/* A lock-free ring: each cell has a sequence number telling whether it can */
+/* be written or read at a given position, and producers and consumers claim */
+/* positions with a compare and swap, without any system call */
+extern buffer_t ring_buffer;
+
+/* System calls made by the buffer functions in the calling process */
+extern long buffer_calls;
+
+/* Milliseconds a blocking buffer waits before giving up */
+extern long buffer_timeout;
+
+long long now_ns();
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include "buffer.h"
+
+/*
+ * Lock-free ring.
+ *
+ * The bounded queue of Dmitry Vyukov. Positions grow forever and the cell
+ * of position p is p modulo the size, which is a power of two. A cell keeps
+ * a sequence number: p when it can be written at position p, p + 1 once the
+ * element of position p is in it, and p + size when it has been read, that
+ * is when it can be written again one lap later.
+ *
+ * A producer reads the tail, and if the cell there is free tries to move
+ * the tail one step with a compare and swap; the winner owns the cell, the
+ * others retry at the new tail. The consumers do the same with the head.
+ * Nobody waits for a lock, but a producer suspended between its compare and
+ * swap and the store of the sequence number keeps the consumers from going
+ * past its cell until it runs again.
+ */
+
+typedef struct
+{
+  unsigned long sequence;
+  element_t element;
+} ring_cell_t;
+
+typedef struct
+{
+  unsigned long mask;
+  unsigned long tail; /* Next position to write */
+  char pad1[64 - sizeof(unsigned long)];
+  unsigned long head; /* Next position to read */
+  char pad2[64 - sizeof(unsigned long)];
+  ring_cell_t cells[];
+} ring_t;
+
+static ring_t *ring;
+static size_t ring_size;
+
+/* The size is rounded up to a power of two */
+static void ring_init(int size)
+{
+  unsigned long cells, i;
+
+  for(cells = 1; cells < (unsigned long) size; cells *= 2);
+
+  ring_size = sizeof(ring_t) + cells * sizeof(ring_cell_t);
+  ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(ring == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+
+  ring->mask = cells - 1;
+  ring->tail = 0;
+  ring->head = 0;
+  for(i = 0; i < cells; i++){
+    ring->cells[i].sequence = i;
+  }
+}
+
+static int ring_push(element_t *e)
+{
+  ring_cell_t *cell;
+  unsigned long pos, sequence;
+  long diff;
+
+  pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+  while(1){
+    cell = &ring->cells[pos & ring->mask];
+    sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    diff = (long) (sequence - pos);
+
+    if(diff == 0){
+      /* On failure pos gets the tail moved by another producer */
+      if(__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+        break;
+      }
+    }
+    else if(diff < 0){
+      /* The cell still holds the element of the previous lap */
+      return 0;
+    }
+    else{
+      pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+    }
+  }
+
+  cell->element = *e;
+  __atomic_store_n(&cell->sequence, pos + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+static int ring_pop(element_t *e)
+{
+  ring_cell_t *cell;
+  unsigned long pos, sequence;
+  long diff;
+
+  pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+  while(1){
+    cell = &ring->cells[pos & ring->mask];
+    sequence = __atomic_load_n(&cell->sequence, __ATOMIC_ACQUIRE);
+    diff = (long) (sequence - (pos + 1));
+
+    if(diff == 0){
+      if(__atomic_compare_exchange_n(&ring->head, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)){
+        break;
+      }
+    }
+    else if(diff < 0){
+      /* Nothing written at this position yet */
+      return 0;
+    }
+    else{
+      pos = __atomic_load_n(&ring->head, __ATOMIC_RELAXED);
+    }
+  }
+
+  *e = cell->element;
+  __atomic_store_n(&cell->sequence, pos + ring->mask + 1, __ATOMIC_RELEASE);
+
+  return 1;
+}
+
+static void ring_destroy(void)
+{
+  munmap(ring, ring_size);
+}
+
+buffer_t ring_buffer = {
+  ring_init,
+  ring_push,
+  ring_pop,
+  ring_destroy,
+  NULL,
+  NULL
+};
@@ -0,0 +1,277 @@
+#define _GNU_SOURCE /* semtimedop() */
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include <sys/mman.h>
+#include "buffer.h"
+
+/*
+ * SysV semaphore buffer.
+ *
+ * The semaphores of semaphores3.c: #0 locks the buffer, #1 counts the free
+ * cells and #2 the elements. The cells and the two indexes live in shared
+ * memory and are only touched with the lock held, so the buffer makes three
+ * semop() for each element: lock, push or pop, release.
+ *
+ * A batch takes the lock and k cells (or k elements) in a single semop(),
+ * which the kernel performs as a whole or not at all, and gives back the
+ * lock with k elements (or k cells) in another: two system calls for k
+ * elements. k follows the number of elements, read without the lock: if
+ * it was stale the claim fails as a push on a full buffer would.
+ *
+ * The wait buffer never fails on a full or empty buffer: a push sleeps in
+ * semtimedop() until a cell is free and the lock is available, and takes
+ * both at once, so that nobody holds the lock while waiting and a sleeping
+ * producer does not keep the consumer out. Only a wait longer than
+ * buffer_timeout fails, and each element costs two system calls.
+ */
+
+/* glibc leaves the definition to the program */
+union semun
+{
+  int val;
+  struct semid_ds *buf;
+  unsigned short *array;
+};
+
+typedef struct
+{
+  int size;
+  int head; /* Next element to read */
+  int tail; /* Next cell to write */
+  int count; /* Elements in the buffer, changed with the lock held and read without */
+  element_t cells[];
+} sem_cells_t;
+
+static int semid;
+static sem_cells_t *cells;
+static size_t cells_size;
+
+static struct sembuf lock_res = {0, -1, 0};
+static struct sembuf rel_res = {0, 1, 0};
+static struct sembuf push[2] = {{1, -1, IPC_NOWAIT}, {2, 1, IPC_NOWAIT}};
+static struct sembuf pop[2] = {{1, 1, IPC_NOWAIT}, {2, -1, IPC_NOWAIT}};
+
+static void sem_init(int size)
+{
+  union semun arg;
+
+  if((semid = semget(IPC_PRIVATE, 3, 0666 | IPC_CREAT)) == -1){
+    perror("semget");
+    exit(1);
+  }
+
+  /* Resource controller, free space and elements */
+  arg.val = 1;
+  semctl(semid, 0, SETVAL, arg);
+  arg.val = size;
+  semctl(semid, 1, SETVAL, arg);
+  arg.val = 0;
+  semctl(semid, 2, SETVAL, arg);
+
+  cells_size = sizeof(sem_cells_t) + size * sizeof(element_t);
+  cells = mmap(NULL, cells_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(cells == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+  cells->size = size;
+  cells->head = 0;
+  cells->tail = 0;
+  cells->count = 0;
+}
+
+static void lock(void)
+{
+  buffer_calls++;
+  if(semop(semid, &lock_res, 1) == -1){
+    perror("semop:lock_res");
+    exit(1);
+  }
+}
+
+static void release(void)
+{
+  buffer_calls++;
+  semop(semid, &rel_res, 1);
+}
+
+static int sem_push(element_t *e)
+{
+  int done = 0;
+
+  lock();
+  buffer_calls++;
+  if(semop(semid, push, 2) != -1){
+    cells->cells[cells->tail] = *e;
+    cells->tail = (cells->tail + 1) % cells->size;
+    __atomic_add_fetch(&cells->count, 1, __ATOMIC_RELAXED);
+    done = 1;
+  }
+  release();
+
+  return done;
+}
+
+static int sem_pop(element_t *e)
+{
+  int done = 0;
+
+  lock();
+  buffer_calls++;
+  if(semop(semid, pop, 2) != -1){
+    *e = cells->cells[cells->head];
+    cells->head = (cells->head + 1) % cells->size;
+    __atomic_sub_fetch(&cells->count, 1, __ATOMIC_RELAXED);
+    done = 1;
+  }
+  release();
+
+  return done;
+}
+
+/* Takes the lock and n units of the semaphore sem at once, without waiting for the units */
+/* Returns 0 if there are fewer than n */
+static int claim(int sem, int n)
+{
+  struct sembuf ops[2] = {{0, -1, 0}, {sem, -n, IPC_NOWAIT}};
+
+  buffer_calls++;
+  if(semop(semid, ops, 2) == -1){
+    if(errno != EAGAIN){
+      perror("semop:claim");
+      exit(1);
+    }
+    return 0;
+  }
+
+  return 1;
+}
+
+/* Gives n units to the semaphore sem and releases the lock */
+static void complete(int sem, int n)
+{
+  struct sembuf ops[2] = {{sem, n, 0}, {0, 1, 0}};
+
+  buffer_calls++;
+  semop(semid, ops, 2);
+}
+
+/* Takes the lock and a unit of the semaphore sem, waiting up to buffer_timeout for both */
+/* Returns 0 on timeout */
+static int timed_claim(int sem)
+{
+  struct sembuf ops[2] = {{0, -1, 0}, {sem, -1, 0}};
+  struct timespec timeout = {buffer_timeout / 1000, (buffer_timeout % 1000) * 1000000};
+
+  buffer_calls++;
+  while(semtimedop(semid, ops, 2, &timeout) == -1){
+    if(errno == EAGAIN){
+      return 0;
+    }
+    if(errno != EINTR){
+      perror("semtimedop");
+      exit(1);
+    }
+    buffer_calls++;
+  }
+
+  return 1;
+}
+
+static int wait_push(element_t *e)
+{
+  if(!timed_claim(1)){
+    return 0;
+  }
+  cells->cells[cells->tail] = *e;
+  cells->tail = (cells->tail + 1) % cells->size;
+  __atomic_add_fetch(&cells->count, 1, __ATOMIC_RELAXED);
+  complete(2, 1);
+
+  return 1;
+}
+
+static int wait_pop(element_t *e)
+{
+  if(!timed_claim(2)){
+    return 0;
+  }
+  *e = cells->cells[cells->head];
+  cells->head = (cells->head + 1) % cells->size;
+  __atomic_sub_fetch(&cells->count, 1, __ATOMIC_RELAXED);
+  complete(1, 1);
+
+  return 1;
+}
+
+static int sem_push_batch(element_t *e, int max)
+{
+  int i, n;
+
+  n = cells->size - __atomic_load_n(&cells->count, __ATOMIC_RELAXED);
+  n = (n < max) ? n : max;
+  n = (n > 0) ? n : 1;
+
+  if(!claim(1, n)){
+    return 0;
+  }
+  for(i = 0; i < n; i++){
+    cells->cells[cells->tail] = e[i];
+    cells->tail = (cells->tail + 1) % cells->size;
+  }
+  __atomic_add_fetch(&cells->count, n, __ATOMIC_RELAXED);
+  complete(2, n);
+
+  return n;
+}
+
+static int sem_pop_batch(element_t *e, int max)
+{
+  int i, n;
+
+  n = __atomic_load_n(&cells->count, __ATOMIC_RELAXED);
+  n = (n < max) ? n : max;
+  n = (n > 0) ? n : 1;
+
+  if(!claim(2, n)){
+    return 0;
+  }
+  for(i = 0; i < n; i++){
+    e[i] = cells->cells[cells->head];
+    cells->head = (cells->head + 1) % cells->size;
+  }
+  __atomic_sub_fetch(&cells->count, n, __ATOMIC_RELAXED);
+  complete(1, n);
+
+  return n;
+}
+
+static void sem_destroy(void)
+{
+  semctl(semid, 0, IPC_RMID);
+  munmap(cells, cells_size);
+}
+
+buffer_t sem_buffer = {
+  sem_init,
+  sem_push,
+  sem_pop,
+  sem_destroy,
+  sem_push_batch,
+  sem_pop_batch
+};
+
+buffer_t wait_buffer = {
+  sem_init,
+  wait_push,
+  wait_pop,
+  sem_destroy,
+  NULL,
+  NULL
+};
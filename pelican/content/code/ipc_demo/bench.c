@@ -0,0 +1,1435 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <wait.h>
+#include <sys/resource.h>
+#include "layer1.h"
+#include "layer2.h"
+#include "histogram.h"
+#include "eventlog.h"
+#include "switch.h"
+#include "trace.h"
+#include "task.h"
+#include "user.h"
+#include "shm.h"
+#include "sock.h"
+#include "uring.h"
+#include "pool.h"
+#include "journal.h"
+#include "mailbox.h"
+
+/*
+ * Benchmarks for the telephone switch simulator.
+ * Each benchmark is selected by the first command line argument and
+ * prints its results as a small table on the standard output.
+ */
+
+long long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+int compare_ll(const void *a, const void *b)
+{
+  long long x = *(const long long *) a;
+  long long y = *(const long long *) b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * Latency summary.
+ * Sorts the samples and prints average, median, 99th percentile and maximum in microseconds.
+ */
+void print_latency(char *label, long long *samples, int n)
+{
+  long long sum = 0;
+  int i;
+
+  qsort(samples, n, sizeof(long long), compare_ll);
+  for(i = 0; i < n; i++){
+    sum += samples[i];
+  }
+
+  printf("%-10s avg %8.1f us   p50 %8.1f us   p99 %8.1f us   max %8.1f us\n", label,
+         sum / 1000.0 / n, samples[n / 2] / 1000.0,
+         samples[(n * 99) / 100] / 1000.0, samples[n - 1] / 1000.0);
+}
+
+/*
+ * Wake-up benchmark.
+ * A receiver waits on an idle queue, either polling the two message classes
+ * like the original switch loop or blocking in the kernel. The sender
+ * stamps each message after an idle gap and the receiver records how long
+ * it took to notice it, together with the CPU it burnt while waiting.
+ */
+void bench_wakeup_run(int event_driven, int samples, int gap_us)
+{
+  pid_t pid;
+  int qid;
+  int i;
+  int status;
+  messagebuf_t in;
+  char text[MAX_TEXT_LENGTH + 1];
+  long long *latency;
+  long long start;
+  double wall, cpu;
+  struct rusage usage;
+
+  qid = create_queue(IPC_PRIVATE);
+
+  fflush(stdout);
+  pid = fork();
+  if(pid == 0){
+    latency = malloc(samples * sizeof(long long));
+    start = now_ns();
+
+    for(i = 0; i < samples; i++){
+      if(event_driven){
+        while(!receive_message_wait(qid, 0, &in));
+      }
+      else{
+        while(!receive_message(qid, TYPE_SERVICE, &in) && !receive_message(qid, TYPE_TEXT, &in));
+      }
+
+      latency[i] = now_ns();
+      get_text(&in, text);
+      latency[i] -= strtoll(text, NULL, 10);
+    }
+
+    wall = (now_ns() - start) / 1e9;
+    getrusage(RUSAGE_SELF, &usage);
+    cpu = usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+      (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+
+    print_latency(event_driven ? "event" : "polling", latency, samples);
+    printf("%-10s CPU used while idle %5.1f%% of a core over %.2f s\n", "", 100.0 * cpu / wall, wall);
+    exit(0);
+  }
+
+  for(i = 0; i < samples; i++){
+    usleep(gap_us);
+    sprintf(text, "%lld", now_ns());
+    user_send_text_message(0, 0, text, 0, qid);
+  }
+
+  waitpid(pid, &status, 0);
+  remove_queue(qid);
+}
+
+void bench_wakeup(int argc, char *argv[])
+{
+  int samples = 200;
+  int gap_us = 5000;
+
+  if(argc > 0){
+    samples = strtol(argv[0], NULL, 10);
+  }
+  if(argc > 1){
+    gap_us = strtol(argv[1], NULL, 10);
+  }
+
+  printf("Wake-up latency, %d messages, one every %d us\n", samples, gap_us);
+  bench_wakeup_run(0, samples, gap_us);
+  bench_wakeup_run(1, samples, gap_us);
+}
+
+/*
+ * Routing benchmark.
+ * Senders push text messages to a forwarding switch as fast as they can,
+ * the switch routes each of them to one of the receivers. Senders and
+ * receivers are different processes, so no cycle of full queues can
+ * block the system.
+ */
+void bench_route_run(char *name, int senders, int messages)
+{
+  int sw, qid;
+  int *queues;
+  int i, m, n;
+  int status;
+  messagebuf_t in;
+  char text[MAX_TEXT_LENGTH + 1];
+  long long start, elapsed;
+  long calls = 0, base;
+
+  if(!strcmp(name, "shm")){
+    shm_init(2 * senders + 1, SHM_CHANNELS_PER_QUEUE);
+    set_transport(&shm_transport);
+  }
+  else if(!strcmp(name, "unix") || !strcmp(name, "uring")){
+    sock_init(2 * senders + 1);
+    set_transport(strcmp(name, "unix") ? &uring_transport : &sock_transport);
+  }
+  else{
+    set_transport(NULL);
+  }
+
+  sw = create_queue(IPC_PRIVATE);
+  queues = malloc((senders + 1) * sizeof(int));
+  fflush(stdout);
+
+  /* Receivers, numbered from 1 */
+  for(i = 1; i <= senders; i++){
+    if(fork() == 0){
+      qid = create_queue(IPC_PRIVATE);
+      user_send_qid(i, qid, sw);
+
+      while(1){
+        if(receive_message_wait(qid, 0, &in) && get_type(&in) == TYPE_SERVICE){
+          break;
+        }
+      }
+
+      remove_queue(qid);
+      exit(0);
+    }
+  }
+
+  for(n = 0; n < senders; n++){
+    if(receive_message_wait(sw, TYPE_SERVICE, &in)){
+      queues[get_sender(&in)] = get_service_data(&in);
+    }
+    else{
+      n--;
+    }
+  }
+
+  /* Senders, each needs a queue of its own to send from */
+  start = now_ns();
+  for(i = 1; i <= senders; i++){
+    if(fork() == 0){
+      qid = create_queue(IPC_PRIVATE);
+
+      for(m = 0; m < messages; m++){
+        n = (i + m) % senders + 1;
+        sprintf(text, "A message from me (%d) to you (%d)", i, n);
+        user_send_text_message(i, n, text, 0, sw);
+      }
+
+      remove_queue(qid);
+      exit(0);
+    }
+  }
+
+  /* Switch, a SysV queue takes a system call for each receive and each send */
+  base = sock_syscalls();
+  for(n = 0; n < senders * messages; n++){
+    calls += 2;
+    if(!receive_message_wait(sw, TYPE_TEXT, &in)){
+      n--;
+      continue;
+    }
+
+    switch_send_text_message(&in, queues[get_recipient(&in)]);
+  }
+  elapsed = now_ns() - start;
+  if(!strcmp(name, "unix") || !strcmp(name, "uring")){
+    calls = sock_syscalls() - base;
+  }
+
+  for(i = 1; i <= senders; i++){
+    switch_send_terminate(queues[i]);
+  }
+  flush_messages();
+  while(wait(&status) > 0);
+  remove_queue(sw);
+  free(queues);
+
+  printf("%-6s %3d senders %9d messages %12.0f routed msgs/s", name, senders,
+         senders * messages, senders * messages / (elapsed / 1e9));
+  if(strcmp(name, "shm")){
+    printf(" %8.2f switch syscalls/msg", (double) calls / (senders * messages));
+  }
+  printf("\n");
+}
+
+void bench_route(int argc, char *argv[])
+{
+  int senders = 4;
+  int messages = 50000;
+
+  if(argc > 0){
+    senders = strtol(argv[0], NULL, 10);
+  }
+  if(argc > 1){
+    messages = strtol(argv[1], NULL, 10);
+  }
+
+  printf("Routed messages per second, %d messages per sender\n", messages);
+  bench_route_run("sysv", senders, messages);
+  bench_route_run("shm", senders, messages);
+}
+
+/*
+ * io_uring benchmark.
+ * The routing benchmark through SysV queues, Unix domain sockets with a
+ * system call for each send and the same sockets driven by io_uring,
+ * counting the system calls the switch makes to route a message.
+ */
+void bench_uring(int argc, char *argv[])
+{
+  int senders = 4;
+  int messages = 50000;
+
+  if(argc > 0){
+    senders = strtol(argv[0], NULL, 10);
+  }
+  if(argc > 1){
+    messages = strtol(argv[1], NULL, 10);
+  }
+
+  printf("Routed messages per second, %d messages per sender\n", messages);
+  bench_route_run("sysv", senders, messages);
+  bench_route_run("unix", senders, messages);
+  bench_route_run("uring", senders, messages);
+}
+
+/*
+ * Wire format benchmark.
+ * Moves batches of messages through a SysV queue, sending either the used
+ * part of the message or, as the fixed format did, a 160 bytes text field
+ * whatever the text is.
+ */
+double bench_wire_run(messagebuf_t *msg, int fixed, int messages)
+{
+  int qid;
+  int i, j, length, batch;
+  messagebuf_t in;
+  long long start;
+
+  qid = create_queue(IPC_PRIVATE);
+  length = fixed ? (int) offsetof(message_t, text) + 160 : message_length(msg);
+
+  /* A batch must fit in the queue, which holds 16384 bytes by default */
+  batch = 8192 / length;
+  if(batch > 32){
+    batch = 32;
+  }
+
+  start = now_ns();
+  for(i = 0; i < messages; i += batch){
+    for(j = 0; j < batch; j++){
+      msgsnd(qid, msg, length, 0);
+    }
+    for(j = 0; j < batch; j++){
+      msgrcv(qid, &in, sizeof(message_t), 0, 0);
+    }
+  }
+
+  remove_queue(qid);
+  return messages / ((now_ns() - start) / 1e9);
+}
+
+void bench_wire(int argc, char *argv[])
+{
+  messagebuf_t msg;
+  char text[MAX_TEXT_LENGTH + 1];
+  double fixed, variable;
+  int messages = 200000;
+  int i;
+  char *label[4] = {"service", "short text", "full text", "long text"};
+
+  if(argc > 0){
+    messages = strtol(argv[0], NULL, 10);
+  }
+
+  printf("Bytes per message and SysV throughput, %d messages\n", messages);
+  printf("%-12s %12s %12s %14s %14s\n", "message", "fixed bytes", "sent bytes", "fixed msgs/s", "sent msgs/s");
+
+  for(i = 0; i < 4; i++){
+    init_message(&msg);
+    set_type(&msg, i ? TYPE_TEXT : TYPE_SERVICE);
+    set_sender(&msg, 1);
+
+    if(i == 0){
+      set_service(&msg, SERVICE_TIME);
+    }
+    else{
+      set_recipient(&msg, 2);
+      if(i == 1){
+        sprintf(text, "A message from me (%d) to you (%d)", 1, 2);
+      }
+      else{
+        /* The fixed format could not carry the long text at all */
+        memset(text, 'x', (i == 2) ? 159 : 1000);
+        text[(i == 2) ? 159 : 1000] = '\0';
+      }
+      set_text(&msg, text);
+    }
+
+    variable = bench_wire_run(&msg, 0, messages);
+    if(i < 3){
+      fixed = bench_wire_run(&msg, 1, messages);
+      printf("%-12s %12d %12d %14.0f %14.0f\n", label[i],
+             (int) offsetof(message_t, text) + 160, message_length(&msg), fixed, variable);
+    }
+    else{
+      printf("%-12s %12s %12d %14s %14.0f\n", label[i], "-", message_length(&msg), "-", variable);
+    }
+  }
+}
+
+/*
+ * Unix domain socket benchmark.
+ * Moves batches of SOCK_BATCH messages to a queue of the calling thread and
+ * reads them back: through a SysV queue, a msgsnd() and a msgrcv() for each
+ * message, and through a socket connection, a send() for each message or a
+ * sendmmsg() for the whole batch. The socket is always read with recvmmsg().
+ */
+double bench_unix_run(messagebuf_t *out, int batched, int messages)
+{
+  messagebuf_t *in;
+  long long start;
+  int qid, i, j, n;
+
+  if((in = malloc(SOCK_BATCH * sizeof(messagebuf_t))) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  qid = create_queue(IPC_PRIVATE);
+
+  start = now_ns();
+  for(i = 0; i < messages; i += SOCK_BATCH){
+    if(batched){
+      send_messages(qid, out, SOCK_BATCH);
+    }
+    else{
+      for(j = 0; j < SOCK_BATCH; j++){
+        send_message(qid, &out[j]);
+      }
+    }
+
+    for(n = 0; n < SOCK_BATCH; ){
+      n += receive_messages(qid, 0, &in[n], SOCK_BATCH - n);
+    }
+  }
+
+  remove_queue(qid);
+  free(in);
+  return messages / ((now_ns() - start) / 1e9);
+}
+
+void bench_unix(int argc, char *argv[])
+{
+  messagebuf_t *out;
+  char text[MAX_TEXT_LENGTH + 1];
+  double sysv, single, batched;
+  int messages = 200000;
+  int i, j;
+  char *label[2] = {"control", "160 B text"};
+
+  if(argc > 0){
+    messages = strtol(argv[0], NULL, 10);
+  }
+  if((out = malloc(SOCK_BATCH * sizeof(messagebuf_t))) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  sock_init(4);
+
+  printf("Messages per second through a queue, batches of %d, %d messages\n", SOCK_BATCH, messages);
+  printf("%-12s %8s %14s %14s %14s\n", "message", "bytes", "msgsnd/msgrcv", "send/recvmmsg", "sendmmsg");
+
+  memset(text, 'x', 160);
+  text[160] = '\0';
+
+  for(i = 0; i < 2; i++){
+    for(j = 0; j < SOCK_BATCH; j++){
+      if(i == 0){
+        credit_message(&out[j], 1, 2048);
+      }
+      else{
+        init_message(&out[j]);
+        set_sender(&out[j], 1);
+        set_type(&out[j], TYPE_TEXT);
+        set_recipient(&out[j], 2);
+        set_text(&out[j], text);
+      }
+    }
+
+    set_transport(NULL);
+    sysv = bench_unix_run(out, 0, messages);
+    set_transport(&sock_transport);
+    single = bench_unix_run(out, 0, messages);
+    batched = bench_unix_run(out, 1, messages);
+
+    printf("%-12s %8d %14.0f %14.0f %14.0f\n", label[i], message_length(&out[0]), sysv, single, batched);
+  }
+
+  set_transport(NULL);
+  free(out);
+}
+
+/*
+ * Message accessors benchmark.
+ * CPU time to build a text message as a user does, and to read its header
+ * and text back as the switch and the recipient do, without any queue.
+ * Then the time to build a service message with its constructor, and for a
+ * switch that logs nothing to dispatch the services users request most
+ * through its table of handlers.
+ * The results are summed so that the compiler cannot drop the loop.
+ */
+void bench_message(int argc, char *argv[])
+{
+  switch_t s;
+  messagebuf_t msg, request, services[5];
+  char text[MAX_TEXT_LENGTH + 1], out[MAX_TEXT_LENGTH + 1];
+  long long start, build, read, service, dispatch;
+  long sum = 0;
+  int messages = 10000000;
+  int i;
+
+  if(argc > 0){
+    messages = strtol(argv[0], NULL, 10);
+  }
+
+  printf("Cost of the message accessors, %d messages\n", messages);
+  sprintf(text, "A message from me (%d) to you (%d)", 12, 34);
+
+  start = now_ns();
+  for(i = 0; i < messages; i++){
+    init_message(&msg);
+    set_type(&msg, TYPE_TEXT);
+    set_sender(&msg, i);
+    set_recipient(&msg, 34);
+    set_service_data(&msg, i);
+    set_text(&msg, text);
+    sum += message_length(&msg) + msg.mtext.sender;
+  }
+  build = now_ns() - start;
+
+  start = now_ns();
+  for(i = 0; i < messages; i++){
+    set_sender(&msg, i);
+    sum += get_type(&msg) + get_sender(&msg) + get_recipient(&msg) + get_service(&msg) + get_service_data(&msg);
+    get_text(&msg, out);
+    sum += get_text_length(&msg) + out[0];
+  }
+  read = now_ns() - start;
+
+  start = now_ns();
+  for(i = 0; i < messages; i++){
+    credit_message(&msg, i, CREDIT_BATCH);
+    sum += message_length(&msg) + msg.mtext.sender;
+  }
+  service = now_ns() - start;
+
+  /* One shard, whose queue is never used as no user ever waits for credits */
+  switch_init(&s, 0, 64, 0, 1);
+  s.verbose = 0;
+  time_request_message(&request);
+  connect_message(&services[0], 1);
+  credit_message(&services[1], 1, 1);
+  join_message(&services[2], 1, 1);
+  leave_message(&services[3], 1, 1);
+  time_message(&services[4], 1, &request);
+
+  start = now_ns();
+  for(i = 0; i < messages; i++){
+    set_sender(&services[i % 5], 1 + i % 64);
+    switch_service(&s.shard[0], &services[i % 5]);
+  }
+  dispatch = now_ns() - start;
+  sum += s.shard[0].services[SERVICE_CREDIT];
+  switch_free(&s);
+
+  printf("%-24s %8.1f ns per message\n", "build a text message", (double) build / messages);
+  printf("%-24s %8.1f ns per message\n", "read a text message", (double) read / messages);
+  printf("%-24s %8.1f ns per message\n", "build a service message", (double) service / messages);
+  printf("%-24s %8.1f ns per message\n", "dispatch a service", (double) dispatch / messages);
+  printf("(checksum %ld)\n", sum);
+}
+
+/*
+ * Routing table benchmark.
+ * Looks up random recipients in routing tables of growing size, and
+ * creates the queues of that many users with the shared memory transport,
+ * whose keys are found through a hash table.
+ */
+void bench_routes(int argc, char *argv[])
+{
+  switch_t s;
+  int sizes[5] = {10, 100, 1000, 10000, 100000};
+  int lookups = 10000000;
+  int *recipients;
+  unsigned int x = 2463534242u;
+  long long start, lookup_ns, create_ns, sum = 0;
+  int i, j, n;
+
+  recipients = malloc(1024 * 1024 * sizeof(int));
+
+  printf("Route lookups and queue creation per number of users\n");
+  printf("%8s %12s %14s %16s\n", "users", "table bytes", "ns per lookup", "ns per create");
+
+  for(i = 0; i < 5; i++){
+    n = sizes[i];
+
+    switch_init(&s, 0, n, 0, 1);
+    for(j = 1; j <= n; j++){
+      s.routes[j].qid = j;
+    }
+
+    for(j = 0; j < 1024 * 1024; j++){
+      x ^= x << 13;
+      x ^= x >> 17;
+      x ^= x << 5;
+      recipients[j] = x % n + 1;
+    }
+
+    start = now_ns();
+    for(j = 0; j < lookups; j++){
+      sum += switch_lookup(&s, recipients[j & (1024 * 1024 - 1)]);
+    }
+    lookup_ns = now_ns() - start;
+    switch_free(&s);
+
+    shm_init(n + 1, SHM_CHANNELS_PER_QUEUE);
+    set_transport(&shm_transport);
+    start = now_ns();
+    for(j = 0; j <= n; j++){
+      create_queue(build_key(j));
+    }
+    create_ns = now_ns() - start;
+    set_transport(NULL);
+
+    printf("%8d %12d %14.2f %16.1f\n", n, (int) ((n + 1) * sizeof(route_t)),
+           (double) lookup_ns / lookups, (double) create_ns / (n + 1));
+  }
+
+  free(recipients);
+  if(sum == 42){
+    printf("\n");
+  }
+}
+
+/*
+ * Sharded switch benchmark.
+ * Senders use user_send_text_message to reach receivers through the
+ * switch, split in a growing number of shards. Each shard thread stops
+ * once it routed all the messages of its senders.
+ */
+static long shard_expected[MAXSHARDS];
+
+void *bench_shard(void *arg)
+{
+  shard_t *sh = arg;
+  messagebuf_t in;
+
+  bind_queue(sh->sw);
+  while(sh->routed < shard_expected[sh->id]){
+    if(receive_message_wait(sh->sw, TYPE_TEXT, &in)){
+      switch_route(sh, &in);
+    }
+  }
+
+  return NULL;
+}
+
+void bench_switch_run(char *name, int shards, int senders, int messages)
+{
+  switch_t s;
+  int sw, qid;
+  int i, m, n;
+  int status;
+  messagebuf_t in;
+  char text[MAX_TEXT_LENGTH + 1];
+  long long start, elapsed;
+
+  if(!strcmp(name, "shm")){
+    shm_init(2 * senders + shards, SHM_CHANNELS_PER_QUEUE + shards);
+    set_transport(&shm_transport);
+  }
+  else{
+    set_transport(NULL);
+  }
+
+  sw = create_queue(IPC_PRIVATE);
+  switch_init(&s, sw, 2 * senders, 0, shards);
+  s.verbose = 0;
+
+  /* The receivers do not give credits back */
+  s.flow_control = 0;
+  fflush(stdout);
+
+  /* Receivers are the users from senders + 1 to 2 * senders */
+  for(i = senders + 1; i <= 2 * senders; i++){
+    if(fork() == 0){
+      qid = create_queue(IPC_PRIVATE);
+      user_send_qid(i, qid, switch_queue(&s, i));
+
+      while(1){
+        if(receive_message_wait(qid, 0, &in) && get_type(&in) == TYPE_SERVICE){
+          break;
+        }
+      }
+
+      remove_queue(qid);
+      exit(0);
+    }
+  }
+
+  for(i = senders + 1; i <= 2 * senders; i++){
+    while(!receive_message_wait(switch_queue(&s, i), TYPE_SERVICE, &in));
+    switch_service(&s.shard[get_sender(&in) % shards], &in);
+  }
+
+  for(i = 0; i < shards; i++){
+    shard_expected[i] = 0;
+  }
+
+  for(i = 1; i <= senders; i++){
+    shard_expected[i % shards] += messages;
+
+    if(fork() == 0){
+      qid = create_queue(IPC_PRIVATE);
+      sw = switch_queue(&s, i);
+
+      for(m = 0; m < messages; m++){
+        n = senders + (i + m) % senders + 1;
+        sprintf(text, "A message from me (%d) to you (%d)", i, n);
+        user_send_text_message(i, n, text, 0, sw);
+      }
+
+      remove_queue(qid);
+      exit(0);
+    }
+  }
+
+  start = now_ns();
+  for(i = 0; i < shards; i++){
+    pthread_create(&s.shard[i].thread, NULL, bench_shard, &s.shard[i]);
+  }
+  for(i = 0; i < shards; i++){
+    pthread_join(s.shard[i].thread, NULL);
+  }
+  elapsed = now_ns() - start;
+
+  for(i = senders + 1; i <= 2 * senders; i++){
+    switch_send_terminate(switch_lookup(&s, i));
+  }
+  while(wait(&status) > 0);
+  switch_free(&s);
+  remove_queue(sw);
+
+  printf("%-6s %3d shards %3d senders %12.0f routed msgs/s\n", name, shards, senders,
+         senders * messages / (elapsed / 1e9));
+}
+
+void bench_switch(int argc, char *argv[])
+{
+  int senders = 8;
+  int messages = 20000;
+  int shards;
+
+  if(argc > 0){
+    senders = strtol(argv[0], NULL, 10);
+  }
+  if(argc > 1){
+    messages = strtol(argv[1], NULL, 10);
+  }
+
+  printf("Sharded switch, %d messages per sender\n", messages);
+  for(shards = 1; shards <= 8; shards *= 2){
+    bench_switch_run("sysv", shards, senders, messages);
+  }
+  for(shards = 1; shards <= 8; shards *= 2){
+    bench_switch_run("shm", shards, senders, messages);
+  }
+}
+
+/* Proportional set size of a process in KB, shared pages being split among their users */
+long pss_kb(pid_t pid)
+{
+  FILE *f;
+  char path[64], line[256];
+  long kb = 0;
+
+  sprintf(path, "/proc/%d/smaps_rollup", (int) pid);
+  if((f = fopen(path, "r")) == NULL){
+    return 0;
+  }
+
+  while(fgets(line, sizeof(line), f)){
+    if(!strncmp(line, "Pss:", 4)){
+      kb = strtol(line + 4, NULL, 10);
+      break;
+    }
+  }
+
+  fclose(f);
+  return kb;
+}
+
+/*
+ * Startup benchmark.
+ * Starts the users as processes or as threads and measures the time
+ * until all of them can be reached, and the memory they use at that
+ * point: until they registered their queue with the switch, or until
+ * they have been started if the switch created and registered their
+ * queues itself.
+ */
+void bench_startup_run(char *name, int threaded, int provisioned, int users_number)
+{
+  switch_t s;
+  user_t *users;
+  pid_t *pids;
+  pthread_attr_t attr;
+  messagebuf_t in;
+  int sw, i, registered = 0;
+  int status;
+  long long start, elapsed;
+  long baseline, pss;
+
+  if(!strcmp(name, "shm")){
+    shm_init(users_number + 1, SHM_CHANNELS_PER_QUEUE);
+    set_transport(&shm_transport);
+  }
+  else{
+    set_transport(NULL);
+  }
+
+  sw = create_queue(IPC_PRIVATE);
+  switch_init(&s, sw, users_number, 0, 1);
+  s.verbose = 0;
+
+  users = malloc((users_number + 1) * sizeof(user_t));
+  pids = malloc((users_number + 1) * sizeof(pid_t));
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 128 * 1024);
+  baseline = pss_kb(getpid());
+  fflush(stdout);
+
+  start = now_ns();
+  for(i = 1; i <= users_number && provisioned; i++){
+    switch_provision(&s, i, create_queue(IPC_PRIVATE), 0);
+  }
+
+  for(i = 1; i <= users_number; i++){
+    user_init(&users[i], i, users_number, 0, sw);
+    users[i].verbose = 0;
+    if(provisioned){
+      users[i].qid = switch_lookup(&s, i);
+    }
+
+    if(threaded){
+      users[i].threaded = 1;
+      if(pthread_create(&users[i].thread, &attr, user_run, &users[i])){
+        perror("pthread_create");
+        exit(1);
+      }
+    }
+    else if((pids[i] = fork()) == 0){
+      user_run(&users[i]);
+    }
+  }
+
+  while(!provisioned && registered < users_number){
+    if(receive_message_wait(sw, TYPE_SERVICE, &in)){
+      registered += (get_service(&in) == SERVICE_QID);
+      switch_service(&s.shard[0], &in);
+    }
+  }
+  elapsed = now_ns() - start;
+
+  pss = pss_kb(getpid()) - baseline;
+  if(!threaded){
+    for(i = 1; i <= users_number; i++){
+      pss += pss_kb(pids[i]);
+    }
+  }
+
+  /* Terminate everybody */
+  for(i = 1; i <= users_number; i++){
+    switch_send_terminate(switch_lookup(&s, i));
+  }
+  while(!switch_done(&s)){
+    if(receive_message_wait(sw, TYPE_SERVICE, &in)){
+      switch_service(&s.shard[0], &in);
+    }
+  }
+
+  if(threaded){
+    for(i = 1; i <= users_number; i++){
+      pthread_join(users[i].thread, NULL);
+    }
+  }
+  else{
+    while(wait(&status) > 0);
+  }
+
+  switch_free(&s);
+  remove_queue(sw);
+  free(users);
+  free(pids);
+
+  printf("%-6s %-9s %-11s %7d users %10.1f ms %10.1f MB %8.1f KB per user\n", name,
+         threaded ? "threads" : "processes", provisioned ? "provisioned" : "registered", users_number, elapsed / 1e6,
+         pss / 1024.0, (double) pss / users_number);
+}
+
+void bench_startup(int argc, char *argv[])
+{
+  int users_number = 1000;
+  char *name = "sysv";
+
+  if(argc > 0){
+    users_number = strtol(argv[0], NULL, 10);
+  }
+  if(argc > 1){
+    name = argv[1];
+  }
+
+  printf("Time until all users can be reached, and their memory (PSS)\n");
+  bench_startup_run(name, 0, 0, users_number);
+  bench_startup_run(name, 1, 0, users_number);
+  bench_startup_run(name, 0, 1, users_number);
+  bench_startup_run(name, 1, 1, users_number);
+}
+
+/*
+ * Logging benchmark.
+ * Time spent by the switch to trace a routed message, printing it as it
+ * used to on a buffered and on a line buffered stream (like a terminal),
+ * and storing it in the event log. The log is written to /dev/null and
+ * the events are logged in batches that fit in the ring, so that only the
+ * cost paid by the logging thread is measured.
+ */
+void bench_log(int argc, char *argv[])
+{
+  char *text = "A message from me (12) to you (34)";
+  struct timespec pause = {0, 3000000};
+  FILE *f;
+  long long start, elapsed;
+  int events = 200000;
+  int i, j, batch = LOG_RING_RECORDS / 2;
+  int mode;
+
+  if(argc > 0){
+    events = strtol(argv[0], NULL, 10);
+  }
+
+  printf("Cost of tracing a routed message, %d events\n", events);
+
+  for(mode = 0; mode < 2; mode++){
+    f = fopen("/dev/null", "w");
+    if(mode == 1){
+      setvbuf(f, NULL, _IOLBF, 0);
+    }
+
+    start = now_ns();
+    for(i = 0; i < events; i++){
+      fprintf(f, "%d -- S -- Routing message\n", (int) time(NULL));
+      fprintf(f, "                   Sender: %d -- Destination: %d\n", 12, 34);
+      fprintf(f, "                   Text: %s\n", text);
+    }
+    elapsed = now_ns() - start;
+    fclose(f);
+
+    printf("%-24s %8.1f ns per event\n", mode ? "printf, line buffered" : "printf, buffered",
+           (double) elapsed / events);
+  }
+
+  log_init("/dev/null", 1);
+  log_bind(0);
+
+  elapsed = 0;
+  for(i = 0; i < events; i += batch){
+    start = now_ns();
+    for(j = 0; j < batch; j++){
+      log_event(EVENT_ROUTE, 12, 34, 0, 0, text);
+    }
+    elapsed += now_ns() - start;
+
+    /* Let the writer empty the ring */
+    nanosleep(&pause, NULL);
+  }
+  log_stop();
+
+  printf("%-24s %8.1f ns per event\n", "event log", (double) elapsed / i);
+}
+
+/*
+ * Fan-out benchmark.
+ * A sender reaches every member of a group through the switch, either with
+ * a text message to each of them or with a single group message, whose text
+ * the switch stores once in the payload pool and delivers by reference. The
+ * members are threads reading their own queue, the time runs until all of
+ * them read every message.
+ */
+typedef struct
+{
+  int id;
+  int sw;
+  pthread_t thread;
+} fanout_member_t;
+
+typedef struct
+{
+  int group; /* Send group messages instead of a text message to each member */
+  int members;
+  int messages;
+  int sw;
+  char *text;
+} fanout_sender_t;
+
+static long fanout_received;
+
+void *bench_fanout_member(void *arg)
+{
+  fanout_member_t *m = arg;
+  messagebuf_t in;
+  char text[MAX_TEXT_LENGTH + 1];
+  int qid;
+
+  qid = create_queue(IPC_PRIVATE);
+  user_send_join(m->id, 1, m->sw);
+  user_send_qid(m->id, qid, m->sw);
+
+  while(1){
+    if(!receive_message_wait(qid, 0, &in)){
+      continue;
+    }
+
+    if(get_type(&in) == TYPE_SERVICE){
+      break;
+    }
+
+    if(get_type(&in) == TYPE_GROUP){
+      pool_text(get_service_data(&in), text);
+      pool_release(get_service_data(&in));
+    }
+    else{
+      get_text(&in, text);
+    }
+    __atomic_add_fetch(&fanout_received, 1, __ATOMIC_RELAXED);
+  }
+
+  remove_queue(qid);
+  return NULL;
+}
+
+void *bench_fanout_sender(void *arg)
+{
+  fanout_sender_t *f = arg;
+  int i, m;
+
+  /* The sender is user 1, the members are the users from 2 */
+  for(m = 0; m < f->messages; m++){
+    if(f->group){
+      user_send_group_message(1, 1, f->text, 0, f->sw);
+      continue;
+    }
+
+    for(i = 2; i <= f->members + 1; i++){
+      user_send_text_message(1, i, f->text, 0, f->sw);
+    }
+  }
+
+  return NULL;
+}
+
+void bench_fanout_run(switch_t *s, int group, int members, int messages, char *text)
+{
+  fanout_sender_t f;
+  pthread_t sender;
+  messagebuf_t in;
+  long long start, elapsed;
+  long expected = (long) members * messages;
+  double bytes;
+
+  f.group = group;
+  f.members = members;
+  f.messages = messages;
+  f.sw = s->sw;
+  f.text = text;
+
+  /* Bytes moved through the queues for each message */
+  init_message(&in);
+  set_text(&in, text);
+  if(group){
+    bytes = message_length(&in);
+    init_message(&in);
+    bytes += (double) members * message_length(&in);
+  }
+  else{
+    bytes = 2.0 * members * message_length(&in);
+  }
+
+  __atomic_store_n(&fanout_received, 0, __ATOMIC_RELAXED);
+
+  start = now_ns();
+  pthread_create(&sender, NULL, bench_fanout_sender, &f);
+  while(__atomic_load_n(&fanout_received, __ATOMIC_RELAXED) < expected){
+    if(!receive_next_message(s->sw, &in)){
+      sched_yield();
+    }
+    else if(get_type(&in) == TYPE_GROUP){
+      switch_multicast(&s->shard[0], &in);
+    }
+    else if(get_type(&in) == TYPE_TEXT){
+      switch_route(&s->shard[0], &in);
+    }
+  }
+  elapsed = now_ns() - start;
+  pthread_join(sender, NULL);
+
+  printf("%-7s %6d members %12.0f deliveries/s %12.0f messages/s %10.1f KB through the queues per message\n",
+         group ? "group" : "unicast", members, expected / (elapsed / 1e9), messages / (elapsed / 1e9),
+         bytes / 1024);
+}
+
+void bench_fanout_group(int members, int deliveries, char *text)
+{
+  switch_t s;
+  fanout_member_t *m;
+  pthread_attr_t attr;
+  messagebuf_t in;
+  int sw, i, j, messages;
+
+  sw = create_queue(IPC_PRIVATE);
+  switch_init(&s, sw, members + 1, 0, 1);
+  s.verbose = 0;
+
+  /* The members do not give credits back */
+  s.flow_control = 0;
+
+  m = malloc((members + 2) * sizeof(fanout_member_t));
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, 64 * 1024);
+
+  /* Every member joins the group, then sends its queue. They start in waves */
+  /* whose messages fit in the switch queue: every read wakes up all the */
+  /* senders waiting for room, and thousands of them would take minutes. */
+  for(i = 2; i <= members + 1; i++){
+    m[i].id = i;
+    m[i].sw = sw;
+    if(pthread_create(&m[i].thread, &attr, bench_fanout_member, &m[i])){
+      perror("pthread_create");
+      exit(1);
+    }
+
+    if(i % 100 == 1 || i == members + 1){
+      for(j = 0; j < 2 * ((i - 2) % 100 + 1); j++){
+        while(!receive_message_wait(sw, TYPE_SERVICE, &in));
+        switch_service(&s.shard[0], &in);
+      }
+    }
+  }
+
+  messages = deliveries / members;
+  if(messages < 1){
+    messages = 1;
+  }
+  bench_fanout_run(&s, 0, members, messages, text);
+  bench_fanout_run(&s, 1, members, messages, text);
+
+  for(i = 2; i <= members + 1; i++){
+    switch_send_terminate(switch_lookup(&s, i));
+  }
+  for(i = 2; i <= members + 1; i++){
+    pthread_join(m[i].thread, NULL);
+  }
+
+  switch_free(&s);
+  remove_queue(sw);
+  free(m);
+}
+
+void bench_fanout(int argc, char *argv[])
+{
+  int deliveries = 200000;
+  int length = 1000;
+  char text[MAX_TEXT_LENGTH + 1];
+  int members;
+
+  if(argc > 0){
+    deliveries = strtol(argv[0], NULL, 10);
+  }
+  if(argc > 1){
+    length = strtol(argv[1], NULL, 10);
+  }
+  if(length < 1 || length > MAX_TEXT_LENGTH){
+    length = MAX_TEXT_LENGTH;
+  }
+
+  memset(text, 'x', length);
+  text[length] = '\0';
+
+  set_transport(NULL);
+  pool_init(1, NULL);
+
+  printf("Fan-out to a group through the switch, %d deliveries of %d bytes of text\n", deliveries, length);
+  for(members = 10; members <= 10000; members *= 10){
+    bench_fanout_group(members, deliveries, text);
+  }
+}
+
+/*
+ * Journal benchmark.
+ * Registers users with a switch and makes them join groups, then keeps
+ * MAXDEFERRED text messages waiting for credits, with and without a
+ * journal, committed every SWITCH_BATCH messages as the shard loops do.
+ * Then rebuilds the state of a new switch from the journal.
+ */
+double bench_journal_fill(switch_t *s, char *text)
+{
+  messagebuf_t m;
+  long long start;
+  int i, n = s->users_number;
+
+  start = now_ns();
+  for(i = 1; i <= 2 * n; i++){
+    /* The queues do not exist, no message is sent to them */
+    if(i % 2){
+      qid_message(&m, (i + 1) / 2, 1000000 + i);
+    }
+    else{
+      join_message(&m, (i + 1) / 2, 1 + i % 64);
+    }
+    switch_service(&s->shard[0], &m);
+
+    if(i % SWITCH_BATCH == 0){
+      switch_commit(&s->shard[0]);
+    }
+  }
+
+  /* Nobody has credits */
+  for(i = 1; i <= n; i++){
+    s->credits[i] = 0;
+  }
+  for(i = 0; i < MAXDEFERRED; i++){
+    init_message(&m);
+    set_type(&m, TYPE_TEXT);
+    set_sender(&m, 1 + i % n);
+    set_recipient(&m, 1 + (i + 1) % n);
+    set_text(&m, text);
+    switch_route(&s->shard[0], &m);
+
+    if(i % SWITCH_BATCH == 0){
+      switch_commit(&s->shard[0]);
+    }
+  }
+  switch_commit(&s->shard[0]);
+
+  return (double) (now_ns() - start) / (2 * n + MAXDEFERRED);
+}
+
+void bench_journal_run(int users_number, char *path)
+{
+  switch_t s;
+  char text[MAX_TEXT_LENGTH + 1];
+  char name[256];
+  double plain, journaled;
+  long long start, elapsed;
+  int sw, records, i, connected = 0;
+
+  memset(text, 'x', 100);
+  text[100] = '\0';
+  sw = create_queue(IPC_PRIVATE);
+
+  switch_init(&s, sw, users_number, 0, 1);
+  s.verbose = 0;
+  plain = bench_journal_fill(&s, text);
+  switch_free(&s);
+
+  switch_init(&s, sw, users_number, 0, 1);
+  s.verbose = 0;
+  switch_journal(&s, path);
+  journaled = bench_journal_fill(&s, text);
+  switch_free(&s);
+
+  switch_init(&s, sw, users_number, 0, 1);
+  start = now_ns();
+  records = switch_recover(&s, path);
+  elapsed = now_ns() - start;
+
+  for(i = 1; i <= users_number; i++){
+    connected += (switch_lookup(&s, i) != sw);
+  }
+
+  printf("%7d users %8.0f ns per message %8.0f with the journal %8d records %8.2f ms to recover %7d users %5d waiting\n",
+         users_number, plain, journaled, records, elapsed / 1e6, connected, s.shard[0].waiting_number);
+
+  switch_free(&s);
+  remove_queue(sw);
+  snprintf(name, sizeof(name), "%s.0", path);
+  unlink(name);
+}
+
+void bench_journal(int argc, char *argv[])
+{
+  char *path = "/tmp/bench-journal";
+  int users_number;
+
+  if(argc > 0){
+    path = argv[0];
+  }
+
+  set_transport(NULL);
+  printf("Service and deferred messages processed by the switch, and recovery from its journal\n");
+  for(users_number = 1000; users_number <= 100000; users_number *= 10){
+    bench_journal_run(users_number, path);
+  }
+}
+
+/*
+ * Mailbox benchmark.
+ * Users send text messages of 100 bytes to users that have no queue yet,
+ * which the switch keeps in their mailboxes: the memory must stay within
+ * the limits whatever the number of users. Then a tenth of the users, a
+ * thousand at most, send their queue and get their mailbox at once.
+ */
+void bench_mailbox_run(int users_number, int messages)
+{
+  switch_t s;
+  messagebuf_t m;
+  char text[MAX_TEXT_LENGTH + 1];
+  int *qids;
+  int sw, i, online;
+  long n, delivered;
+  long long start, held_ns, delivery_ns;
+  unsigned int seed = 1;
+
+  memset(text, 'x', 100);
+  text[100] = '\0';
+  sw = create_queue(IPC_PRIVATE);
+
+  switch_init(&s, sw, users_number, 0, 1);
+  s.verbose = 0;
+  s.bench = 1; /* Senders of refused messages are not terminated */
+  s.mailboxes = mailbox_create(users_number);
+
+  start = now_ns();
+  for(n = 0; n < (long) messages * users_number; n++){
+    init_message(&m);
+    set_type(&m, TYPE_TEXT);
+    set_sender(&m, 1 + n % users_number);
+    set_recipient(&m, 1 + rand_r(&seed) % users_number);
+    set_text(&m, text);
+    switch_route(&s.shard[0], &m);
+  }
+  held_ns = now_ns() - start;
+
+  /* Not every user, the last one to register would start a benchmark */
+  online = users_number / 10 < 1000 ? users_number / 10 : 1000;
+  qids = malloc(online * sizeof(int));
+  for(i = 0; i < online; i++){
+    qids[i] = create_queue(IPC_PRIVATE);
+  }
+
+  delivered = s.mailboxes->delivered;
+  start = now_ns();
+  for(i = 0; i < online; i++){
+    qid_message(&m, i + 1, qids[i]);
+    switch_service(&s.shard[0], &m);
+  }
+  delivery_ns = now_ns() - start;
+  delivered = s.mailboxes->delivered - delivered;
+
+  printf("%7d users %9ld held %9ld evicted %9ld refused %6.0f ns per message %8ld KB of slabs %9.0f delivered msgs/s\n",
+         users_number, s.mailboxes->held, s.mailboxes->evicted, s.mailboxes->refused,
+         (double) held_ns / n, s.mailboxes->bytes / 1024, delivered / (delivery_ns / 1e9));
+
+  for(i = 0; i < online; i++){
+    remove_queue(qids[i]);
+  }
+  free(qids);
+  switch_free(&s);
+  remove_queue(sw);
+}
+
+void bench_mailbox(int argc, char *argv[])
+{
+  int messages = 100;
+  int users_number;
+
+  if(argc > 0){
+    messages = strtol(argv[0], NULL, 10);
+  }
+
+  set_transport(NULL);
+  printf("Mailboxes of users without a queue, %d messages sent by each user\n", messages);
+  for(users_number = 100; users_number <= 100000; users_number *= 10){
+    bench_mailbox_run(users_number, messages);
+  }
+}
+
+void usage(char *argv[])
+{
+  printf("Telephone switch benchmarks\n");
+  printf("%s <benchmark> [arguments]\n", argv[0]);
+  printf("\n");
+  printf("     wakeup [<messages> [<gap us>]] - Idle CPU and wake-up latency of the polling and event-driven loops\n");
+  printf("     route [<senders> [<messages>]] - Routed messages per second through the SysV and shared memory transports\n");
+  printf("     wire [<messages>] - Bytes moved per message and throughput of the variable length format\n");
+  printf("     unix [<messages>] - Throughput of SysV queues and Unix domain sockets, one message per call and in batches\n");
+  printf("     uring [<senders> [<messages>]] - Routed messages per second and system calls of the switch for each, through SysV queues, sockets and io_uring\n");
+  printf("     message [<messages>] - Cost of building and reading a text message with the accessors of layer1, and of building and dispatching service messages\n");
+  printf("     routes - Route lookup and queue creation cost from 10 to 100000 users\n");
+  printf("     switch [<senders> [<messages>]] - Routed messages per second of the switch split in 1 to 8 shards\n");
+  printf("     startup [<users> [sysv|shm]] - Startup time and memory of users as processes and as threads, registering themselves or provisioned by the switch\n");
+  printf("     log [<events>] - Cost of tracing an event with printf and with the event log\n");
+  printf("     fanout [<deliveries> [<text bytes>]] - Text messages and group messages to groups of 10 to 10000 members\n");
+  printf("     journal [<file>] - Cost of the journal of the switch and time to recover from it, from 1000 to 100000 users\n");
+  printf("     mailbox [<messages>] - Memory and cost of the mailboxes of users without a queue, from 100 to 100000 users\n\n");
+}
+
+int main(int argc, char *argv[])
+{
+  if(argc < 2){
+    usage(argv);
+    exit(0);
+  }
+
+  if(!strcmp(argv[1], "wakeup")){
+    bench_wakeup(argc - 2, argv + 2);
+  }
+  else if(!strcmp(argv[1], "route")){
+    bench_route(argc - 2, argv + 2);
+  }
+  else if(!strcmp(argv[1], "wire")){
+    bench_wire(argc - 2, argv + 2);
+  }
+  else if(!strcmp(argv[1], "uring")){
+    bench_uring(argc - 2, argv + 2);
+  }
+  else if(!strcmp(argv[1], "unix")){
+    bench_unix(argc - 2, argv + 2);
+  }
+  else if(!strcmp(argv[1], "message")){
+    bench_message(argc - 2, argv + 2);
+  }
+  else if(!strcmp(argv[1], "routes")){
+    bench_routes(argc - 2, argv + 2);
+  }
+  else if(!strcmp(argv[1], "switch")){
+    bench_switch(argc - 2, argv + 2);
+  }
+  else if(!strcmp(argv[1], "startup")){
+    bench_startup(argc - 2, argv + 2);
+  }
+  else if(!strcmp(argv[1], "log")){
+    bench_log(argc - 2, argv + 2);
+  }
+  else if(!strcmp(argv[1], "fanout")){
+    bench_fanout(argc - 2, argv + 2);
+  }
+  else if(!strcmp(argv[1], "journal")){
+    bench_journal(argc - 2, argv + 2);
+  }
+  else if(!strcmp(argv[1], "mailbox")){
+    bench_mailbox(argc - 2, argv + 2);
+  }
+  else{
+    usage(argv);
+    exit(1);
+  }
+
+  return 0;
+}
@@ -0,0 +1,311 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "eventlog.h"
+
+/* Single producer (the thread bound to the ring) and single consumer (the writer) */
+
+typedef struct
+{
+  _Atomic unsigned long head; /* Writer position */
+  char pad1[64 - sizeof(unsigned long)];
+  _Atomic unsigned long tail; /* Producer position */
+  long dropped; /* Events lost because the ring was full */
+  char pad2[64 - sizeof(unsigned long) - sizeof(long)];
+  event_t records[LOG_RING_RECORDS];
+} log_ring_t;
+
+/* Records written at once by the writer */
+#define LOG_BATCH 1024
+
+/* Pause of the writer when the rings are empty, in ns */
+#define LOG_IDLE 1000000
+
+static log_ring_t *rings = NULL;
+static int rings_number;
+static int fd;
+static _Atomic int stop;
+static pthread_t writer;
+
+static __thread log_ring_t *ring = NULL;
+
+static char *padding = "                                                                      ";
+
+/* Prints the event as the switch and the users used to when it happened */
+static void print_event(FILE *f, event_t *e, char *text)
+{
+  int t = e->time / 1000000000LL;
+
+  switch(e->event){
+  case EVENT_CONNECT:
+    fprintf(f, "%d -- S -- Service: connection\n", t);
+    fprintf(f, "                   User: %d\n", e->user);
+    break;
+
+  case EVENT_DISCONNECT:
+    fprintf(f, "%d -- S -- Service: disconnection\n", t);
+    fprintf(f, "                   User: %d\n", e->user);
+    break;
+
+  case EVENT_QID:
+    fprintf(f, "%d -- S -- Service: queue\n", t);
+    fprintf(f, "                   User: %d\n", e->user);
+    fprintf(f, "                   Qid: %d\n", e->data[0]);
+    break;
+
+  case EVENT_TIMING:
+    fprintf(f, "%d -- S -- Service: timing\n", t);
+    fprintf(f, "                   User: %d\n", e->user);
+    fprintf(f, "                   Timing: %d\n", e->data[0]);
+    break;
+
+  case EVENT_ROUTE:
+    fprintf(f, "%d -- S -- Routing message\n", t);
+    fprintf(f, "                   Sender: %d -- Destination: %d\n", e->user, e->data[0]);
+    fprintf(f, "                   Text: %s\n", text);
+    break;
+
+  case EVENT_UNREACHABLE:
+    fprintf(f, "%d -- S -- Unreachable destination\n", t);
+    fprintf(f, "                   Sender: %d -- Destination: %d\n", e->user, e->data[0]);
+    fprintf(f, "                   Text: %s\n", text);
+    fprintf(f, "                   Threshold: %d/%d\n", e->data[1], e->data[2]);
+    break;
+
+  case EVENT_MAXFAILS:
+    fprintf(f, "%d -- S -- User %d reached max unreachable destinations\n", t, e->user);
+    break;
+
+  case EVENT_TERMINATE:
+    fprintf(f, "%d -- S -- User %d chosen for termination\n", t, e->user);
+    break;
+
+  case EVENT_TIME:
+    fprintf(f, "%d -- S -- User %d chosen for timing...\n", t, e->user);
+    break;
+
+  case EVENT_OLD_MESSAGES:
+    fprintf(f, "%s%d -- U %02d -- Discarding %d old messages\n", padding, t, e->user, e->data[0]);
+    break;
+
+  case EVENT_RECEIVED:
+    fprintf(f, "%s%d -- U %02d -- Message received\n", padding, t, e->user);
+    fprintf(f, "%s                      Sender: %d\n", padding, e->data[0]);
+    fprintf(f, "%s                      Text: %s\n", padding, text);
+    break;
+
+  case EVENT_TERMINATION:
+    fprintf(f, "%s%d -- U %02d -- Termination\n", padding, t, e->user);
+    break;
+
+  case EVENT_TIMING_ANSWER:
+    fprintf(f, "%s%d -- U %02d -- Timing\n", padding, t, e->user);
+    break;
+
+  case EVENT_SEND:
+    fprintf(f, "%s%d -- U %02d -- Message to user %d\n", padding, t, e->user, e->data[0]);
+    break;
+
+  case EVENT_JOIN:
+    fprintf(f, "%d -- S -- Service: join\n", t);
+    fprintf(f, "                   User: %d -- Group: %d\n", e->user, e->data[0]);
+    break;
+
+  case EVENT_LEAVE:
+    fprintf(f, "%d -- S -- Service: leave\n", t);
+    fprintf(f, "                   User: %d -- Group: %d\n", e->user, e->data[0]);
+    break;
+
+  case EVENT_MULTICAST:
+    fprintf(f, "%d -- S -- Routing group message\n", t);
+    fprintf(f, "                   Sender: %d -- Group: %d -- Members: %d\n", e->user, e->data[0], e->data[1]);
+    fprintf(f, "                   Text: %s\n", text);
+    break;
+
+  case EVENT_SEND_GROUP:
+    fprintf(f, "%s%d -- U %02d -- Message to group %d\n", padding, t, e->user, e->data[0]);
+    break;
+
+  case EVENT_HELD:
+    fprintf(f, "%d -- S -- Holding message for an offline user\n", t);
+    fprintf(f, "                   Sender: %d -- Destination: %d\n", e->user, e->data[0]);
+    fprintf(f, "                   Text: %s\n", text);
+    break;
+
+  case EVENT_MAILBOX:
+    fprintf(f, "%d -- S -- Delivering mailbox\n", t);
+    fprintf(f, "                   User: %d -- Messages: %d\n", e->user, e->data[0]);
+    break;
+  }
+}
+
+void log_print_event(FILE *f, event_t *e)
+{
+  char text[LOG_TEXT_LENGTH + 1];
+
+  memcpy(text, e->text, LOG_TEXT_LENGTH);
+  text[LOG_TEXT_LENGTH] = '\0';
+  print_event(f, e, text);
+}
+
+/* Copies the records of every ring to the file, returns how many */
+static long log_flush(void)
+{
+  static event_t batch[LOG_BATCH];
+  unsigned long head, tail;
+  long written = 0;
+  int r, n = 0;
+
+  for(r = 0; r < rings_number; r++){
+    head = atomic_load_explicit(&rings[r].head, memory_order_relaxed);
+    tail = atomic_load_explicit(&rings[r].tail, memory_order_acquire);
+
+    while(head != tail){
+      batch[n++] = rings[r].records[head % LOG_RING_RECORDS];
+      head++;
+
+      if(n == LOG_BATCH){
+        if(write(fd, batch, n * sizeof(event_t)) == -1){
+          perror("write");
+        }
+        written += n;
+        n = 0;
+      }
+    }
+
+    atomic_store_explicit(&rings[r].head, head, memory_order_release);
+  }
+
+  if(n){
+    if(write(fd, batch, n * sizeof(event_t)) == -1){
+      perror("write");
+    }
+    written += n;
+  }
+
+  return written;
+}
+
+static void *log_writer(void *arg)
+{
+  struct timespec idle = {0, LOG_IDLE};
+
+  while(!atomic_load(&stop)){
+    if(!log_flush()){
+      nanosleep(&idle, NULL);
+    }
+  }
+
+  /* The producers are done, write what they left */
+  log_flush();
+
+  return NULL;
+}
+
+void log_init(char *path, int rings_count)
+{
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if(fd == -1){
+    perror("open");
+    exit(1);
+  }
+
+  /* Only the pages of the rings actually used are allocated */
+  rings = mmap(NULL, rings_count * sizeof(log_ring_t), PROT_READ | PROT_WRITE,
+               MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(rings == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+  rings_number = rings_count;
+
+  atomic_store(&stop, 0);
+  if(pthread_create(&writer, NULL, log_writer, NULL)){
+    perror("pthread_create");
+    exit(1);
+  }
+}
+
+void log_bind(int r)
+{
+  if(rings != NULL && r >= 0 && r < rings_number){
+    ring = &rings[r];
+  }
+}
+
+void log_event(int event, int user, int a, int b, int c, char *text)
+{
+  struct timespec ts;
+  event_t *e, now;
+  unsigned long tail = 0;
+  int n;
+
+  if(ring == NULL){
+    e = &now;
+  }
+  else{
+    tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    if(tail - atomic_load_explicit(&ring->head, memory_order_acquire) == LOG_RING_RECORDS){
+      ring->dropped++;
+      return;
+    }
+    e = &ring->records[tail % LOG_RING_RECORDS];
+  }
+
+  /* The log only shows seconds: the coarse clock is enough and costs a fraction of the precise one */
+  clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+  e->time = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+  e->event = event;
+  e->user = user;
+  e->data[0] = a;
+  e->data[1] = b;
+  e->data[2] = c;
+
+  /* Without a ring the event is printed right away, with the whole text */
+  if(ring == NULL){
+    print_event(stdout, e, text ? text : "");
+    return;
+  }
+
+  /* Like set_text, longer texts are truncated */
+  n = 0;
+  if(text != NULL){
+    n = strnlen(text, LOG_TEXT_LENGTH);
+    memcpy(e->text, text, n);
+  }
+  if(n < LOG_TEXT_LENGTH){
+    e->text[n] = '\0';
+  }
+
+  atomic_store_explicit(&ring->tail, tail + 1, memory_order_release);
+}
+
+void log_stop(void)
+{
+  long dropped = 0;
+  int r;
+
+  if(rings == NULL){
+    return;
+  }
+
+  atomic_store(&stop, 1);
+  pthread_join(writer, NULL);
+  close(fd);
+
+  for(r = 0; r < rings_number; r++){
+    dropped += rings[r].dropped;
+  }
+  if(dropped){
+    fprintf(stderr, "log: %ld events dropped, the rings were full\n", dropped);
+  }
+
+  munmap(rings, rings_number * sizeof(log_ring_t));
+  rings = NULL;
+}
@@ -0,0 +1,74 @@
+/* Event log */
+
+/* Events are not printed when they happen: each thread stores them in fixed size */
+/* records in a ring of its own, in memory shared by all the processes, and a thread */
+/* of the switch process writes them to the log file in the background. */
+/* Without a log file, events are printed on the standard output right away. */
+
+/* Records in each ring, 128 KB */
+#define LOG_RING_RECORDS 1024
+
+/* Longest text kept in a record, a record takes 128 bytes */
+/* The longest text of the simulator, "A message from me (N) to my group (G)" */
+/* with two ids of 11 characters, is 57 characters long */
+#define LOG_TEXT_LENGTH 100
+
+/* Switch events */
+
+#define EVENT_CONNECT 1
+#define EVENT_DISCONNECT 2
+#define EVENT_QID 3
+#define EVENT_TIMING 4
+#define EVENT_ROUTE 5
+#define EVENT_UNREACHABLE 6
+#define EVENT_MAXFAILS 7
+#define EVENT_TERMINATE 8
+#define EVENT_TIME 9
+
+/* User events */
+
+#define EVENT_OLD_MESSAGES 10
+#define EVENT_RECEIVED 12
+#define EVENT_TERMINATION 13
+#define EVENT_TIMING_ANSWER 14
+#define EVENT_SEND 15
+
+/* Group events, of the switch and then of the users */
+
+#define EVENT_JOIN 16
+#define EVENT_LEAVE 17
+#define EVENT_MULTICAST 18
+#define EVENT_SEND_GROUP 19
+
+/* Mailbox events of the switch */
+
+#define EVENT_HELD 20
+#define EVENT_MAILBOX 21
+
+typedef struct
+{
+  long long time; /* CLOCK_REALTIME_COARSE in ns, a few ms of resolution */
+  int event;
+  int user; /* The user that logged the event, or the one it is about for the switch */
+  int data[3]; /* Depends on the event */
+  char text[LOG_TEXT_LENGTH]; /* Not terminated when it fills the field */
+} event_t;
+
+_Static_assert(sizeof(event_t) == 128, "event_t: records are 128 bytes");
+
+/* This function creates the log file and maps the rings of rings threads */
+/* It must be called before forking the processes that log, the writer runs in the caller */
+void log_init(char *path, int rings);
+
+/* This function makes the calling thread log in the given ring */
+/* Every thread logging at the same time must have a ring of its own */
+void log_bind(int ring);
+
+/* This function logs an event, never waiting: it is dropped if the ring is full */
+void log_event(int event, int user, int a, int b, int c, char *text);
+
+/* This function writes the last events, stops the writer and closes the file */
+void log_stop(void);
+
+/* This function prints an event the way it would have been printed when it happened */
+void log_print_event(FILE *f, event_t *e);
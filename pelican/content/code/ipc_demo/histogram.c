@@ -0,0 +1,123 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "histogram.h"
+
+void histogram_init(histogram_t *h)
+{
+  memset(h, 0, sizeof(histogram_t));
+}
+
+/* The power of two of a value picks the group of buckets, the bits after the first one the bucket */
+static int bucket_of(long long value)
+{
+  int shift;
+
+  if(value < (1LL << HISTOGRAM_BITS)){
+    return value < 0 ? 0 : value;
+  }
+  if(value >= (1LL << HISTOGRAM_RANGE)){
+    return HISTOGRAM_BUCKETS - 1;
+  }
+
+  shift = 63 - __builtin_clzll(value) - (HISTOGRAM_BITS - 1);
+  return (shift << (HISTOGRAM_BITS - 1)) + (value >> shift);
+}
+
+/* Highest value counted in a bucket */
+static long long bucket_top(int bucket)
+{
+  int shift;
+
+  if(bucket < (1 << HISTOGRAM_BITS)){
+    return bucket;
+  }
+
+  shift = (bucket >> (HISTOGRAM_BITS - 1)) - 1;
+  return (((long long) (bucket & ((1 << (HISTOGRAM_BITS - 1)) - 1)) + (1 << (HISTOGRAM_BITS - 1)) + 1) << shift) - 1;
+}
+
+void histogram_add(histogram_t *h, long long value)
+{
+  h->counts[bucket_of(value)]++;
+  h->count++;
+  h->sum += value;
+  if(value > h->max){
+    h->max = value;
+  }
+}
+
+void histogram_merge(histogram_t *dst, histogram_t *src)
+{
+  long long max;
+  int i;
+
+  if(src->count == 0){
+    return;
+  }
+
+  for(i = 0; i < HISTOGRAM_BUCKETS; i++){
+    if(src->counts[i]){
+      __atomic_add_fetch(&dst->counts[i], src->counts[i], __ATOMIC_RELAXED);
+    }
+  }
+  __atomic_add_fetch(&dst->count, src->count, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&dst->sum, src->sum, __ATOMIC_RELAXED);
+
+  max = __atomic_load_n(&dst->max, __ATOMIC_RELAXED);
+  while(src->max > max && !__atomic_compare_exchange_n(&dst->max, &max, src->max, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+long long histogram_percentile(histogram_t *h, double percentage)
+{
+  long target, seen = 0;
+  int i;
+
+  target = (long) (h->count * percentage / 100.0 + 0.5);
+  if(target < 1){
+    target = 1;
+  }
+
+  for(i = 0; i < HISTOGRAM_BUCKETS; i++){
+    seen += h->counts[i];
+    if(seen >= target){
+      return bucket_top(i) < h->max ? bucket_top(i) : h->max;
+    }
+  }
+
+  return h->max;
+}
+
+histogram_t *histogram_shared(int n)
+{
+  histogram_t *h;
+  int i;
+
+  h = mmap(NULL, n * sizeof(histogram_t), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(h == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+
+  for(i = 0; i < n; i++){
+    histogram_init(&h[i]);
+  }
+
+  return h;
+}
+
+void histogram_print(char *name, histogram_t *h)
+{
+  if(h->count == 0){
+    printf("%-16s %10d\n", name, 0);
+    return;
+  }
+
+  printf("%-16s %10ld %10.1f %10.1f %10.1f %10.1f %10.1f\n", name, h->count,
+         h->sum / (double) h->count / 1e3,
+         histogram_percentile(h, 50) / 1e3,
+         histogram_percentile(h, 99) / 1e3,
+         histogram_percentile(h, 99.9) / 1e3,
+         h->max / 1e3);
+}
@@ -0,0 +1,36 @@
+/* Latency histograms */
+
+/* Values are kept with a relative error below 1/2^(HISTOGRAM_BITS - 1), like HdrHistogram: */
+/* values under 2^HISTOGRAM_BITS get a bucket each, then every power of two */
+/* is split in 2^(HISTOGRAM_BITS - 1) buckets of the same width */
+#define HISTOGRAM_BITS 6
+
+/* Values from 2^HISTOGRAM_RANGE ns (about a minute) are counted in the last bucket */
+#define HISTOGRAM_RANGE 36
+
+#define HISTOGRAM_BUCKETS ((HISTOGRAM_RANGE - HISTOGRAM_BITS + 2) << (HISTOGRAM_BITS - 1))
+
+typedef struct
+{
+  unsigned int counts[HISTOGRAM_BUCKETS];
+  long count;
+  long long sum;
+  long long max;
+} histogram_t;
+
+void histogram_init(histogram_t *h);
+void histogram_add(histogram_t *h, long long value);
+
+/* This function adds the counts of src to dst */
+/* dst may be shared with other threads or processes that merge at the same time */
+void histogram_merge(histogram_t *dst, histogram_t *src);
+
+/* This function returns the value below which are the given percentage of the samples */
+/* i.e. the highest value of their bucket, or the maximum if it is lower */
+long long histogram_percentile(histogram_t *h, double percentage);
+
+/* This function allocates n histograms in memory shared with the processes forked later */
+histogram_t *histogram_shared(int n);
+
+/* This function prints count, mean, p50, p99, p99.9 and max on a line, in microseconds */
+void histogram_print(char *name, histogram_t *h);
@@ -0,0 +1,157 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "journal.h"
+
+/* Records follow the header */
+#define JOURNAL_START ((long) sizeof(journal_header_t))
+
+static long record_size(int length)
+{
+  return (sizeof(journal_record_t) + length + 7) & ~7L;
+}
+
+static void journal_map(journal_t *j, int prot)
+{
+  j->map = mmap(NULL, j->size, prot, MAP_SHARED, j->fd, 0);
+  if(j->map == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+}
+
+/*
+ * New journal.
+ * Written next to the journal it replaces, whose records stay valid until
+ * the new one is complete: a switch dying meanwhile finds the old one.
+ */
+void journal_create(journal_t *j, char *path, int users_number, int shards, int qid)
+{
+  journal_header_t *h;
+  char tmp[sizeof(j->path) + 8];
+
+  snprintf(j->path, sizeof(j->path), "%s", path);
+  snprintf(tmp, sizeof(tmp), "%s.new", path);
+
+  j->fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if(j->fd == -1){
+    perror("open");
+    exit(1);
+  }
+
+  /* Blocks are only allocated as records are written */
+  j->size = JOURNAL_SIZE;
+  if(ftruncate(j->fd, j->size) == -1){
+    perror("ftruncate");
+    exit(1);
+  }
+  journal_map(j, PROT_READ | PROT_WRITE);
+
+  h = journal_header(j);
+  h->magic = JOURNAL_MAGIC;
+  h->users_number = users_number;
+  h->shards = shards;
+  h->qid = qid;
+  h->tail = 0;
+  j->tail = 0;
+}
+
+void journal_install(journal_t *j)
+{
+  char tmp[sizeof(j->path) + 8];
+
+  snprintf(tmp, sizeof(tmp), "%s.new", j->path);
+  if(rename(tmp, j->path) == -1){
+    perror("rename");
+    exit(1);
+  }
+}
+
+int journal_open(journal_t *j, char *path)
+{
+  struct stat st;
+
+  snprintf(j->path, sizeof(j->path), "%s", path);
+  if((j->fd = open(path, O_RDONLY)) == -1){
+    return -1;
+  }
+
+  if(fstat(j->fd, &st) == -1 || st.st_size < JOURNAL_START){
+    close(j->fd);
+    return -1;
+  }
+  j->size = st.st_size;
+  journal_map(j, PROT_READ);
+
+  if(journal_header(j)->magic != JOURNAL_MAGIC || journal_header(j)->tail > j->size - JOURNAL_START){
+    journal_close(j);
+    return -1;
+  }
+  j->tail = journal_header(j)->tail;
+
+  return 0;
+}
+
+journal_header_t *journal_header(journal_t *j)
+{
+  return (journal_header_t *) j->map;
+}
+
+int journal_append(journal_t *j, int type, int user, int data, void *payload, int length)
+{
+  journal_record_t *r;
+  long size = record_size(length);
+
+  if(JOURNAL_START + j->tail + size > j->size){
+    return 0;
+  }
+
+  r = (journal_record_t *) (j->map + JOURNAL_START + j->tail);
+  r->type = type;
+  r->length = length;
+  r->user = user;
+  r->data = data;
+  if(length){
+    memcpy(r->payload, payload, length);
+  }
+  j->tail += size;
+
+  return 1;
+}
+
+/* The records are written before the tail that makes them valid */
+void journal_commit(journal_t *j)
+{
+  journal_header_t *h = journal_header(j);
+
+  if(h->tail != j->tail){
+    __atomic_store_n(&h->tail, j->tail, __ATOMIC_RELEASE);
+  }
+}
+
+journal_record_t *journal_next(journal_t *j, long *pos)
+{
+  journal_record_t *r;
+
+  if(*pos + (long) sizeof(journal_record_t) > j->tail){
+    return NULL;
+  }
+
+  r = (journal_record_t *) (j->map + JOURNAL_START + *pos);
+  if(r->length < 0 || *pos + record_size(r->length) > j->tail){
+    return NULL;
+  }
+  *pos += record_size(r->length);
+
+  return r;
+}
+
+void journal_close(journal_t *j)
+{
+  munmap(j->map, j->size);
+  close(j->fd);
+}
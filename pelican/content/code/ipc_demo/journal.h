@@ -0,0 +1,82 @@
+/* Journal of the switch */
+
+/* Each shard appends to a file of its own the changes to the state that only */
+/* lives in its memory: the routes and groups of its users, the users being timed */
+/* and the text messages waiting for credits. Messages already forwarded are in */
+/* the queues of the users, which outlive the switch. The file is mapped in memory, */
+/* so a record is in the page cache as soon as it is written and survives the */
+/* death of the switch process. Records become valid when the shard commits them, */
+/* once for every batch of messages it processed. */
+
+/* Bytes of the file of each shard, allocated as they are written */
+/* A full journal is replaced by a new one holding only the current state */
+#define JOURNAL_SIZE (16 * 1024 * 1024)
+
+#define JOURNAL_MAGIC 0x4a4e4c31
+
+/* Record types */
+
+#define JOURNAL_QID 1 /* The user registered its queue, data */
+#define JOURNAL_GONE 2 /* The route of the user has been removed */
+#define JOURNAL_DISCONNECT 3 /* data users of the shard disconnected */
+#define JOURNAL_JOIN 4 /* The user joined group data */
+#define JOURNAL_LEAVE 5 /* The user left group data */
+#define JOURNAL_TIMING 6 /* The user is being timed, the request has been sent at time data */
+#define JOURNAL_TIMED 7 /* The user answered the timing request */
+#define JOURNAL_WAITING 8 /* Text message number data to the user waits for credits, the payload is the message */
+#define JOURNAL_RESOLVED 9 /* Text message number data has been sent or dropped */
+
+typedef struct
+{
+  int magic;
+  int users_number;
+  int shards;
+  int qid; /* Queue of the shard, where its users keep sending while it is down */
+  long tail; /* Bytes of committed records after the header */
+} journal_header_t;
+
+/* Records are aligned on 8 bytes */
+
+typedef struct
+{
+  int type;
+  int length; /* Bytes of the payload */
+  int user;
+  int data;
+  char payload[];
+} journal_record_t;
+
+typedef struct journal_s
+{
+  int fd;
+  char path[256];
+  char *map;
+  long size;
+  long tail; /* End of the records written, committed or not */
+} journal_t;
+
+/* This function creates an empty journal, which replaces the one at path */
+/* only once journal_install is called */
+void journal_create(journal_t *j, char *path, int users_number, int shards, int qid);
+
+/* This function puts a new journal in place of the previous one, atomically */
+void journal_install(journal_t *j);
+
+/* This function maps the journal at path to read it */
+/* Returns -1 if there is none or it is not a journal */
+int journal_open(journal_t *j, char *path);
+
+journal_header_t *journal_header(journal_t *j);
+
+/* This function appends a record, which is lost unless journal_commit is called later */
+/* Returns 0 if the journal is full */
+int journal_append(journal_t *j, int type, int user, int data, void *payload, int length);
+
+/* This function makes the records appended so far valid */
+void journal_commit(journal_t *j);
+
+/* This function returns the committed record at *pos, and moves *pos to the next one */
+/* *pos starts at 0, NULL is returned after the last record */
+journal_record_t *journal_next(journal_t *j, long *pos);
+
+void journal_close(journal_t *j);
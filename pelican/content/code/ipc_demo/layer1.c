@@ -1,63 +1,28 @@
 #include "layer1.h"
 #include "errno.h"
+#include <time.h>
 
-void set_type(messagebuf_t * buf, int type){
-  buf->mtype = type;
-}
-
-int get_sender(messagebuf_t *buf){
-  return buf->mtext.sender;
-}
-
-void set_sender(messagebuf_t *buf, int sender){
-  buf->mtext.sender = sender;
-}
-
-void set_recipient(messagebuf_t *buf, int recipient){
-  buf->mtext.recipient = recipient;
-}
-
-int get_recipient(messagebuf_t *buf){
-  return buf->mtext.recipient;
-}
-
-void set_text(messagebuf_t *buf, char *text){
-  strcpy(buf->mtext.text, text);
-}
-
-void get_text(messagebuf_t *buf, char *text){
-  strcpy(text, buf->mtext.text);
-}
-
-int get_service(messagebuf_t *buf){
-  return buf->mtext.service;
-}
-
-void set_service(messagebuf_t *buf, int service){
-  buf->mtext.service = service;
-}
-
-void set_service_data(messagebuf_t *buf, int service_data){
-  buf->mtext.service_data = service_data;
-}
-
-int get_service_data(messagebuf_t *buf){
-  return buf->mtext.service_data;
-}
+/* The selected transport, NULL for SysV message queues */
+static transport_t *transport = NULL;
 
-void init_message(messagebuf_t *buf){
-  buf->mtext.sender = -1;
-  buf->mtext.recipient = -1;
-  strcpy(buf->mtext.text, "");
-  buf->mtext.service = -1;
-  buf->mtext.service_data = -1;
+void set_transport(transport_t *t){
+  transport = t;
 }
 
 /* This function creates a unique SysV IPC key */
-/* from a character passed as a parameter */
-key_t build_key(char c){
+/* from a number passed as a parameter */
+/* ftok only uses 8 bits of its second argument, so the number is mixed */
+/* into the low bits of the key instead: different numbers give different keys */
+key_t build_key(int id){
+  static key_t base = -1;
   key_t key;
-  key = ftok(".", c);
+
+  /* ftok stats the directory, do it only once */
+  if(base == -1){
+    base = ftok(".", 'S');
+  }
+
+  key = base ^ id;
   return key;
 }
 
@@ -65,6 +30,10 @@ key_t build_key(char c){
 /* The returned int is the identifier of the queue */
 int create_queue(key_t key){
   int qid;
+
+  if(transport != NULL){
+    return transport->create_queue(key);
+  }
   
   if((qid = msgget(key, IPC_CREAT | 0660)) == -1){
     perror("msgget");
@@ -74,8 +43,40 @@ int create_queue(key_t key){
   return qid;
 }
 
+/* This function creates an empty SysV message queue identified by an IPC key */
+/* A queue left with the same key by a previous run is removed first, whatever it holds, */
+/* and *stale gets the number of messages thrown away with it */
+int create_fresh_queue(key_t key, int *stale){
+  struct msqid_ds info;
+  int qid;
+
+  *stale = 0;
+  if(transport != NULL){
+    return transport->create_queue(key);
+  }
+
+  while((qid = msgget(key, IPC_CREAT | IPC_EXCL | 0660)) == -1){
+    if(errno != EEXIST){
+      perror("msgget");
+      exit(1);
+    }
+
+    /* Someone may remove it meanwhile, then try again */
+    if((qid = msgget(key, 0)) != -1 && msgctl(qid, IPC_STAT, &info) != -1){
+      *stale += info.msg_qnum;
+      msgctl(qid, IPC_RMID, 0);
+    }
+  }
+
+  return qid;
+}
+
 /*  This function removes the queue from the kernel address space */
 int remove_queue(int qid){
+  if(transport != NULL){
+    return transport->remove_queue(qid);
+  }
+
   if(msgctl(qid, IPC_RMID, 0) == -1)
   {
     perror("msgctl");
@@ -85,12 +86,20 @@ int remove_queue(int qid){
 }
 
 /* This function sends a message to the queue identified by qid. */
-/* Remember the length of a message excludes the field mtype */
+/* Only the first message_length() bytes after the field mtype are sent */
+/* Returns -1 if the queue has been removed */
 int send_message(int qid, messagebuf_t *qbuf){
   int result, lenght;
-  lenght = sizeof(messagebuf_t) - sizeof(long);
+  lenght = message_length(qbuf);
+
+  if(transport != NULL){
+    return transport->send_message(qid, qbuf);
+  }
   
   if ((result = msgsnd(qid, qbuf, lenght, 0)) == -1){
+    if(errno == EIDRM || errno == EINVAL){
+      return -1;
+    }
     perror("msgsnd");
     exit(1);
   }
@@ -98,13 +107,84 @@ int send_message(int qid, messagebuf_t *qbuf){
   return result;
 }
 
+/* This function works like send_message but never waits */
+/* Returns 1 if the message has been queued, 0 if the queue is full, -1 if it has been removed */
+int try_send_message(int qid, messagebuf_t *qbuf){
+  int lenght;
+  lenght = message_length(qbuf);
+
+  if(transport != NULL){
+    return transport->try_send_message(qid, qbuf);
+  }
+
+  if(msgsnd(qid, qbuf, lenght, IPC_NOWAIT) == -1){
+    if(errno == EAGAIN){
+      return 0;
+    }
+    else if(errno == EIDRM || errno == EINVAL){
+      return -1;
+    }
+    else{
+      perror("msgsnd");
+      exit(1);
+    }
+  }
+
+  return 1;
+}
+
+/* This function sends n messages to the queue qid, in a single call if the transport can */
+/* SysV queues take one message per msgsnd */
+int send_messages(int qid, messagebuf_t *qbufs, int n){
+  int i;
+
+  if(transport != NULL && transport->send_messages != NULL){
+    return transport->send_messages(qid, qbufs, n);
+  }
+
+  for(i = 0; i < n; i++){
+    if(send_message(qid, &qbufs[i]) == -1){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/* This function hands over the messages the transport kept back, SysV queues keep none */
+void flush_messages(void){
+  if(transport != NULL && transport->flush_messages != NULL){
+    transport->flush_messages();
+  }
+}
+
+/* This function makes the length of the text agree with the result of msgrcv */
+/* A short or corrupt message cannot claim more text than was received */
+/* Returns 0 if not even the header arrived, result otherwise */
+static int check_length(messagebuf_t *qbuf, int result){
+  int length = result - (int) offsetof(message_t, text);
+
+  if(length < 0){
+    return 0;
+  }
+  if(qbuf->mtext.length < 0 || qbuf->mtext.length > length){
+    qbuf->mtext.length = length;
+  }
+
+  return result;
+}
+
 /* This function reads a message from the queue qid filtering the field mtype */
 /* i.e. gets from the queue the first message with of given type */
 int receive_message(int qid, long type, messagebuf_t *qbuf){
   int result, length;
   length = sizeof(messagebuf_t) - sizeof(long);
+
+  if(transport != NULL){
+    return transport->receive_message(qid, type, qbuf);
+  }
   
-  if((result = msgrcv(qid, (struct msgbuf *)qbuf, length, type, IPC_NOWAIT)) == -1){
+  if((result = msgrcv(qid, qbuf, length, type, IPC_NOWAIT)) == -1){
     if(errno == ENOMSG){
       return 0;
     }
@@ -114,5 +194,68 @@ int receive_message(int qid, long type, messagebuf_t *qbuf){
     }
   }
   
-  return result;
+  return check_length(qbuf, result);
+}
+
+/* This function works like receive_message but blocks until a matching message arrives */
+/* A type of 0 returns the first message in the queue whatever its type, in arrival order */
+int receive_message_wait(int qid, long type, messagebuf_t *qbuf){
+  int result, length;
+  length = sizeof(messagebuf_t) - sizeof(long);
+
+  if(transport != NULL){
+    return transport->receive_message_wait(qid, type, qbuf);
+  }
+
+  if((result = msgrcv(qid, qbuf, length, type, 0)) == -1){
+    if(errno == EINTR){
+      return 0;
+    }
+    else{
+      perror("msgrcv");
+      exit(1);
+    }
+  }
+
+  return check_length(qbuf, result);
+}
+
+/* This function reads up to max messages like receive_message, stopping when none is left */
+/* Returns the number of messages read into qbufs */
+int receive_messages(int qid, long type, messagebuf_t *qbufs, int max){
+  int n;
+
+  for(n = 0; n < max; n++){
+    if(!receive_message(qid, type, &qbufs[n])){
+      break;
+    }
+  }
+
+  return n;
+}
+
+/* This function declares the calling thread as the owner of the queue qid */
+/* SysV queues do not care which thread reads them */
+void bind_queue(int qid){
+  if(transport != NULL){
+    transport->bind_queue(qid);
+  }
+}
+
+/* This function reads how many messages and bytes are waiting in the queue qid */
+/* Returns -1 if the queue does not exist (anymore) */
+int queue_stat(int qid, int *messages, int *bytes){
+  struct msqid_ds info;
+
+  if(transport != NULL){
+    return transport->queue_stat(qid, messages, bytes);
+  }
+
+  if(msgctl(qid, IPC_STAT, &info) == -1){
+    return -1;
+  }
+
+  *messages = info.msg_qnum;
+  *bytes = info.msg_cbytes;
+  return 0;
 }
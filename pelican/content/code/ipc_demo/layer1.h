@@ -1,17 +1,35 @@
 #include <stdio.h>
 #include <stdlib.h>
-#include <linux/ipc.h>
-#include <linux/msg.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/msg.h>
 #include <errno.h>
 #include <string.h>
+#include <stddef.h>
+#include <time.h>
+
+/* Longest text a message can carry */
+#define MAX_TEXT_LENGTH 4096
+
+/* Monotonic times in ns stamped on a text message along its way */
+
+#define STAMP_SEND 0 /* The sender hands it to its switch */
+#define STAMP_SWITCH_IN 1 /* The switch receives it */
+#define STAMP_SWITCH_OUT 2 /* The switch forwards it */
+#define STAMP_RECEIVE 3 /* The recipient receives it */
+#define STAMPS 4
+
+/* Only the header and the used part of the text travel between queues */
 
 typedef struct
 {
  int sender;
  int recipient;
- char text[160];
  int service;
  int service_data;
+ int length; /* Bytes of text actually used, without the terminator */
+ long long stamps[STAMPS];
+ char text[MAX_TEXT_LENGTH];
 } message_t;
 
 typedef struct
@@ -20,35 +38,223 @@ typedef struct
  message_t mtext;
 } messagebuf_t;
 
-void set_sender(messagebuf_t *buf, int sender);
-void set_recipient(messagebuf_t *buf, int recipient);
-void set_text(messagebuf_t *buf, char *text);
-void set_service(messagebuf_t *buf, int service);
-void set_service_data(messagebuf_t *buf, int data);
+/* The layout of the header is the format of the messages on the wire, in the journal */
+/* and in the mailboxes: the compiler checks it never changes by accident */
+_Static_assert(offsetof(message_t, sender) == 0, "message_t: sender moved");
+_Static_assert(offsetof(message_t, recipient) == 4, "message_t: recipient moved");
+_Static_assert(offsetof(message_t, service) == 8, "message_t: service moved");
+_Static_assert(offsetof(message_t, service_data) == 12, "message_t: service_data moved");
+_Static_assert(offsetof(message_t, length) == 16, "message_t: length moved");
+_Static_assert(offsetof(message_t, stamps) == 24, "message_t: stamps moved");
+_Static_assert(offsetof(message_t, text) == 56, "message_t: text moved");
+_Static_assert(offsetof(messagebuf_t, mtext) == sizeof(long), "messagebuf_t: not the layout of msgsnd");
+
+/* The accessors are defined here, so that every message built or read */
+/* by the switch and the users costs a few stores and loads, not a call each */
+
+static inline void set_type(messagebuf_t *buf, int type)
+{
+  buf->mtype = type;
+}
+
+static inline void set_sender(messagebuf_t *buf, int sender)
+{
+  buf->mtext.sender = sender;
+}
+
+static inline void set_recipient(messagebuf_t *buf, int recipient)
+{
+  buf->mtext.recipient = recipient;
+}
+
+/* Payloads longer than MAX_TEXT_LENGTH are truncated */
+static inline void set_payload(messagebuf_t *buf, char *data, int length)
+{
+  if(length > MAX_TEXT_LENGTH){
+    length = MAX_TEXT_LENGTH;
+  }
+  memcpy(buf->mtext.text, data, length);
+  buf->mtext.length = length;
+}
+
+static inline void set_text(messagebuf_t *buf, char *text)
+{
+  set_payload(buf, text, strnlen(text, MAX_TEXT_LENGTH));
+}
+
+static inline void set_service(messagebuf_t *buf, int service)
+{
+  buf->mtext.service = service;
+}
+
+static inline void set_service_data(messagebuf_t *buf, int data)
+{
+  buf->mtext.service_data = data;
+}
+
+static inline int get_type(messagebuf_t *buf)
+{
+  return buf->mtype;
+}
+
+static inline int get_sender(messagebuf_t *buf)
+{
+  return buf->mtext.sender;
+}
+
+static inline int get_recipient(messagebuf_t *buf)
+{
+  return buf->mtext.recipient;
+}
+
+/* The buffer must hold get_text_length() + 1 bytes */
+static inline void get_text(messagebuf_t *buf, char *text)
+{
+  memcpy(text, buf->mtext.text, buf->mtext.length);
+  text[buf->mtext.length] = '\0';
+}
+
+/* Copies at most max bytes of the payload, returns the number copied */
+static inline int get_payload(messagebuf_t *buf, char *data, int max)
+{
+  int length = buf->mtext.length;
+
+  if(length > max){
+    length = max;
+  }
+  if(length < 0){
+    length = 0;
+  }
+  memcpy(data, buf->mtext.text, length);
+  return length;
+}
+
+static inline int get_text_length(messagebuf_t *buf)
+{
+  return buf->mtext.length;
+}
+
+static inline int get_service(messagebuf_t *buf)
+{
+  return buf->mtext.service;
+}
+
+static inline int get_service_data(messagebuf_t *buf)
+{
+  return buf->mtext.service_data;
+}
 
-int get_sender(messagebuf_t *buf);
-int get_recipient(messagebuf_t *buf);
-void get_text(messagebuf_t *buf, char *text);
-int get_service(messagebuf_t *buf);
-int get_service_data(messagebuf_t *buf);
+/* This function stores the current monotonic time in ns in the stamp */
+static inline void set_stamp(messagebuf_t *buf, int stamp)
+{
+  struct timespec ts;
 
-void init_message(messagebuf_t *buf);
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  buf->mtext.stamps[stamp] = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static inline long long get_stamp(messagebuf_t *buf, int stamp)
+{
+  return buf->mtext.stamps[stamp];
+}
+
+static inline void copy_stamps(messagebuf_t *dst, messagebuf_t *src)
+{
+  memcpy(dst->mtext.stamps, src->mtext.stamps, sizeof(dst->mtext.stamps));
+}
+
+/* Only the header is initialized, the text travels up to its length */
+static inline void init_message(messagebuf_t *buf)
+{
+  buf->mtext.sender = -1;
+  buf->mtext.recipient = -1;
+  buf->mtext.service = -1;
+  buf->mtext.service_data = -1;
+  buf->mtext.length = 0;
+  memset(buf->mtext.stamps, 0, sizeof(buf->mtext.stamps));
+}
+
+/* This function returns the number of bytes of the message that travel */
+/* i.e. the header and the used part of the text, the field mtype excluded */
+static inline int message_length(messagebuf_t *buf)
+{
+  return offsetof(message_t, text) + buf->mtext.length;
+}
+
+/* A transport moves messages between queues */
+/* The queue functions below use SysV message queues unless another transport is selected */
+
+typedef struct
+{
+  int (*create_queue)(key_t key);
+  int (*remove_queue)(int qid);
+  int (*send_message)(int qid, messagebuf_t *qbuf);
+  int (*try_send_message)(int qid, messagebuf_t *qbuf);
+  int (*receive_message)(int qid, long type, messagebuf_t *qbuf);
+  int (*receive_message_wait)(int qid, long type, messagebuf_t *qbuf);
+  void (*bind_queue)(int qid);
+  int (*queue_stat)(int qid, int *messages, int *bytes);
+  int (*send_messages)(int qid, messagebuf_t *qbufs, int n); /* NULL to send them one by one */
+  void (*flush_messages)(void); /* NULL if every message leaves when it is sent */
+} transport_t;
+
+/* This function selects the transport, NULL being SysV message queues */
+/* It must be called before any queue is created */
+void set_transport(transport_t *t);
 
 /* This function creates a unique SysV IPC key */
-/* from a letter passed as a parameter */
-key_t build_key(char c);
+/* from a number passed as a parameter, different numbers giving different keys */
+key_t build_key(int id);
 
 /* This function creates a SysV message queue identified by an IPC key */
 /* The returned int is the identifier of the queue */
 int create_queue(key_t key);
 
+/* This function works like create_queue but the queue is always a new, empty one */
+/* A queue left with the same key by a previous run is removed instead of being drained */
+/* *stale gets the number of messages it held, other transports start empty anyway */
+int create_fresh_queue(key_t key, int *stale);
+
 /*  This function removes the queue from the kernel address space */
 int remove_queue(int qid);
 
 /* This function sends a message to the queue identified by qid. */
-/* Remember the length of a message excludes the field mtype */
+/* Only the first message_length() bytes after the field mtype are sent */
+/* Returns -1 if the queue has been removed, which is not an error: its owner may just have gone */
 int send_message(int qid, messagebuf_t *qbuf);
 
+/* This function works like send_message but never waits for room in the queue */
+/* Returns 1 if the message has been queued, 0 if the queue is full, -1 if it has been removed */
+int try_send_message(int qid, messagebuf_t *qbuf);
+
+/* This function sends n messages to the queue qid like send_message, in a single call */
+/* if the transport can, and waits for room for all of them */
+/* Returns -1 if the queue has been removed, 0 otherwise */
+int send_messages(int qid, messagebuf_t *qbufs, int n);
+
+/* This function hands over the messages sent by the calling thread that the transport kept back */
+/* A transport may keep them until the thread receives, so a thread that goes on with anything */
+/* else, sleeping or waiting for another process, must call it first */
+void flush_messages(void);
+
 /* This function reads a message from the queue qid filtering the field mtype */
 /* i.e. gets from the queue the first message with the filed mtype set to the vaule of type */
+/* A negative type gets the first message with the lowest mtype up to its absolute value */
 int receive_message(int qid, long type, messagebuf_t *qbuf);
+
+/* This function works like receive_message but blocks until a matching message arrives */
+/* A type of 0 returns the first message in the queue whatever its type, in arrival order */
+/* Returns 0 if the wait has been interrupted by a signal */
+int receive_message_wait(int qid, long type, messagebuf_t *qbuf);
+
+/* This function reads up to max messages like receive_message, stopping when none is left */
+/* Returns the number of messages read into qbufs */
+int receive_messages(int qid, long type, messagebuf_t *qbufs, int max);
+
+/* This function declares the calling thread as the owner of the queue qid */
+/* A thread that did not create the queue it receives from must call it first */
+void bind_queue(int qid);
+
+/* This function reads how many messages and bytes are waiting in the queue qid */
+/* Returns -1 if the queue does not exist (anymore) */
+int queue_stat(int qid, int *messages, int *bytes);
@@ -11,12 +11,22 @@ int init_queue(int num)
   key_t key;
   int qid;
     
-  key = build_key((char) num);
+  key = build_key(num);
   qid = create_queue(key);
 
   return qid;
 }
 
+/*
+ * Fresh queue.
+ * Same as init_queue, but whatever a previous run left in the queue
+ * is thrown away at once instead of being read message by message.
+ */
+int init_fresh_queue(int num, int *stale)
+{
+  return create_fresh_queue(build_key(num), stale);
+}
+
 /*
  * Queue deletion.
  * This function removes a queue.
@@ -26,6 +36,37 @@ void close_queue(int qid)
   remove_queue(qid);
 }
 
+/*
+ * Next message.
+ * This function reads the next message of any type in a single call, service messages
+ * first: the lowest type is taken, so a service message never waits behind text messages.
+ * Returns 0 if the queue is empty.
+ */
+int receive_next_message(int qid, messagebuf_t *in)
+{
+  return receive_message(qid, -TYPE_GROUP, in);
+}
+
+/*
+ * Next message, waiting.
+ * This function works like receive_next_message but blocks until a message arrives.
+ * Returns 0 if the wait has been interrupted by a signal.
+ */
+int receive_next_message_wait(int qid, messagebuf_t *in)
+{
+  return receive_message_wait(qid, -TYPE_GROUP, in);
+}
+
+/*
+ * Next messages.
+ * This function reads up to max messages like receive_next_message.
+ * Returns the number of messages read.
+ */
+int receive_next_messages(int qid, messagebuf_t *in, int max)
+{
+  return receive_messages(qid, -TYPE_GROUP, in, max);
+}
+
 /*
  * Connect message (user).
  * This function sends a message to the switch notifying that the user connected to the system.
@@ -33,11 +74,8 @@ void close_queue(int qid)
 void user_send_connect(int sender, int sw)
 {
   messagebuf_t message;
-  
-  init_message(&message);
-  set_type(&message, TYPE_SERVICE);
-  set_sender(&message, sender);
-  set_service(&message, SERVICE_CONNECT);
+
+  connect_message(&message, sender);
   send_message(sw, &message);
 }
 
@@ -48,44 +86,47 @@ void user_send_connect(int sender, int sw)
 void user_send_qid(int sender, int qid, int sw)
 {
   messagebuf_t message;
-  
-  init_message(&message);
-  set_type(&message, TYPE_SERVICE);
-  set_sender(&message, sender);
-  set_service(&message, SERVICE_QID);
-  set_service_data(&message, qid);
+
+  qid_message(&message, sender, qid);
   send_message(sw, &message);
 }
 
 /*
  * Text message (user).
  * This function sends a text message to another user.
+ * The message also gives back credits to the switch, so that they seldom need a message of their own.
  */
-void user_send_text_message(int sender, int recipient, char *text, int sw)
+void user_send_text_message(int sender, int recipient, char *text, int credits, int sw)
 {
   messagebuf_t message;
 
-  init_message(&message);
-  set_type(&message, TYPE_TEXT);
-  set_sender(&message, sender);
-  set_recipient(&message, recipient);
-  set_text(&message, text);
+  text_message(&message, sender, recipient, text, credits);
   send_message(sw, &message);
 }
 
+/*
+ * Text message (user), without waiting.
+ * This function works like user_send_text_message but gives up if the switch queue is full.
+ * Returns 1 if the message has been sent.
+ */
+int user_try_send_text_message(int sender, int recipient, char *text, int credits, int sw)
+{
+  messagebuf_t message;
+
+  text_message(&message, sender, recipient, text, credits);
+  return try_send_message(sw, &message);
+}
+
 /*
  * Time message (user).
- * This function sends a message to the switch containing the current time.
+ * This function answers a time request of the switch with the current time.
+ * The stamps of the request travel back, so that the switch can measure the round trip.
  */
-void user_send_time(int sender, int sw)
+void user_send_time(int sender, messagebuf_t *request, int sw)
 {
   messagebuf_t message;
-  
-  init_message(&message);
-  set_type(&message, TYPE_SERVICE);
-  set_sender(&message, sender);
-  set_service(&message, SERVICE_TIME);
-  set_service_data(&message, (int) time(NULL));
+
+  time_message(&message, sender, request);
   send_message(sw, &message);
 }
 
@@ -97,27 +138,120 @@ void user_send_disconnect(int sender, int pid, int sw)
 {
   messagebuf_t message;
 
-  init_message(&message);
-  set_type(&message, TYPE_SERVICE);
-  set_sender(&message, sender);
-  set_service(&message, SERVICE_DISCONNECT);
-  set_service_data(&message, pid);
+  disconnect_message(&message, sender, pid);
+  send_message(sw, &message);
+}
+
+/*
+ * Done message (user).
+ * This function notifies the switch that the user stopped sending text messages.
+ */
+void user_send_done(int sender, int sw)
+{
+  messagebuf_t message;
+
+  done_message(&message, sender);
+  send_message(sw, &message);
+}
+
+/*
+ * Report message (user).
+ * This function sends the benchmark counters of the user to the switch.
+ */
+void user_send_report(int sender, report_t *report, int sw)
+{
+  messagebuf_t message;
+
+  report_message(&message, sender, report);
+  send_message(sw, &message);
+}
+
+/*
+ * Credit message (user).
+ * This function gives back to the switch the room freed in the user queue by the text messages read.
+ */
+void user_send_credit(int sender, int bytes, int sw)
+{
+  messagebuf_t message;
+
+  credit_message(&message, sender, bytes);
+  send_message(sw, &message);
+}
+
+/*
+ * Join message (user).
+ * This function asks the switch to add the user to a group.
+ */
+void user_send_join(int sender, int group, int sw)
+{
+  messagebuf_t message;
+
+  join_message(&message, sender, group);
+  send_message(sw, &message);
+}
+
+/*
+ * Leave message (user).
+ * This function asks the switch to remove the user from a group.
+ */
+void user_send_leave(int sender, int group, int sw)
+{
+  messagebuf_t message;
+
+  leave_message(&message, sender, group);
   send_message(sw, &message);
 }
 
+/*
+ * Group message (user).
+ * This function sends a text message to every other member of a group.
+ * The group travels in the service field, the message also gives back credits like a text message.
+ */
+void user_send_group_message(int sender, int group, char *text, int credits, int sw)
+{
+  messagebuf_t message;
+
+  group_message(&message, sender, group, text, credits);
+  send_message(sw, &message);
+}
+
+/*
+ * Group message (user), without waiting.
+ * This function works like user_send_group_message but gives up if the switch queue is full.
+ * Returns 1 if the message has been sent.
+ */
+int user_try_send_group_message(int sender, int group, char *text, int credits, int sw)
+{
+  messagebuf_t message;
+
+  group_message(&message, sender, group, text, credits);
+  return try_send_message(sw, &message);
+}
+
 /*
  * Text message (switch).
- * This function sends a text message to a user.
+ * This function forwards a text message received from a user to another user.
+ * Returns -1 if the user queue has been removed.
+ */
+int switch_send_text_message(messagebuf_t *in, int user)
+{
+  messagebuf_t message;
+
+  forwarded_text_message(&message, in);
+  return send_message(user, &message);
+}
+
+/*
+ * Text message (switch), without waiting.
+ * This function works like switch_send_text_message but gives up if the user queue is full.
+ * Returns 1 if the message has been sent, 0 if the queue is full, -1 if it has been removed.
  */
-void switch_send_text_message(int sender, char *text, int user)
+int switch_try_send_text_message(messagebuf_t *in, int user)
 {
   messagebuf_t message;
 
-  init_message(&message);
-  set_type(&message, TYPE_TEXT);
-  set_sender(&message, sender);
-  set_text(&message, text);
-  send_message(user, &message);
+  forwarded_text_message(&message, in);
+  return try_send_message(user, &message);
 }
 
 /*
@@ -127,10 +261,8 @@ void switch_send_text_message(int sender, char *text, int user)
 void switch_send_terminate(int qid)
 {
   messagebuf_t message;
-  
-  init_message(&message);
-  set_type(&message, TYPE_SERVICE);
-  set_service(&message, SERVICE_TERMINATE);
+
+  terminate_message(&message);
   send_message(qid, &message);
 }
 
@@ -140,10 +272,83 @@ void switch_send_terminate(int qid)
 void switch_send_time(int qid)
 {
   messagebuf_t message;
-  
-  init_message(&message);
-  set_type(&message, TYPE_SERVICE);
-  set_service(&message, SERVICE_TIME);
+
+  time_request_message(&message);
   send_message(qid, &message);
 }
 
+/*
+ * Time request message (switch), without waiting.
+ * This function works like switch_send_time but gives up if the user queue is full.
+ * Returns 1 if the message has been sent.
+ */
+int switch_try_send_time(int qid)
+{
+  messagebuf_t message;
+
+  time_request_message(&message);
+  return try_send_message(qid, &message);
+}
+
+/*
+ * Start signal (switch).
+ * This function tells a user that every user is connected and the benchmark begins.
+ */
+void switch_send_start(int qid)
+{
+  messagebuf_t message;
+
+  start_message(&message);
+  send_message(qid, &message);
+}
+
+/*
+ * Wake-up signal (switch), without waiting.
+ * This function tells a shard of the switch that some user gave credits back,
+ * as it may keep text messages waiting for them. It comes from no user.
+ * Returns 1 if the message has been sent.
+ */
+int switch_try_send_wakeup(int qid)
+{
+  messagebuf_t message;
+
+  wakeup_message(&message);
+  return try_send_message(qid, &message);
+}
+
+/*
+ * Group reference (switch).
+ * This function builds the message delivering to the members a group message
+ * whose text has been stored in a slot of the payload pool. It carries no text.
+ */
+void switch_group_reference(messagebuf_t *ref, messagebuf_t *in, int slot)
+{
+  init_message(ref);
+  set_type(ref, TYPE_GROUP);
+  set_sender(ref, get_sender(in));
+  set_service(ref, get_service(in));
+  set_service_data(ref, slot);
+  copy_stamps(ref, in);
+}
+
+/*
+ * Group reference message (switch).
+ * This function sends a group reference to a member.
+ * Returns -1 if the member queue has been removed.
+ */
+int switch_send_group_reference(messagebuf_t *ref, int user)
+{
+  set_stamp(ref, STAMP_SWITCH_OUT);
+  return send_message(user, ref);
+}
+
+/*
+ * Group reference message (switch), without waiting.
+ * This function works like switch_send_group_reference but gives up if the member queue is full.
+ * Returns 1 if the message has been sent, 0 if the queue is full, -1 if it has been removed.
+ */
+int switch_try_send_group_reference(messagebuf_t *ref, int user)
+{
+  set_stamp(ref, STAMP_SWITCH_OUT);
+  return try_send_message(user, ref);
+}
@@ -4,6 +4,7 @@
 
 #define TYPE_SERVICE   1
 #define TYPE_TEXT   2
+#define TYPE_GROUP   3
 
 /* Define the service types */
 
@@ -13,16 +14,197 @@
 #define SERVICE_DISCONNECT 4
 #define SERVICE_QID 5
 #define SERVICE_UNREACHABLE_DESTINATION 6
+#define SERVICE_START 7
+#define SERVICE_DONE 8
+#define SERVICE_REPORT 9
+#define SERVICE_CREDIT 10
+#define SERVICE_JOIN 11
+#define SERVICE_LEAVE 12
 
-int init_queue();
+/* Service codes are smaller than this */
+#define SERVICES 16
+
+/* Flow control */
+/* The switch forwards text messages to a user only while it has credits, i.e. bytes */
+/* of room in its queue; the user gives them back as it reads the messages, with its */
+/* next text message or, once it read a batch without sending anything, with a service */
+/* message. The rest of the queue is left to the service messages. The window leaves */
+/* room for a message of any length until a batch is given back. */
+
+#define CREDIT_WINDOW 15360 /* Credits of a user, a SysV queue but 1 KiB */
+#define CREDIT_BATCH 2048 /* Bytes a user reads before giving them back on their own */
+
+/* Groups */
+/* A group message goes to every member of a group but its sender. The switch */
+/* stores its text once in the payload pool and sends each member a reference */
+/* to it, a message of type TYPE_GROUP carrying the group and the slot of the text. */
+/* The members of group 0 are all the users, groups 1 to MAXGROUPS - 1 must be joined. */
+
+#define GROUP_ALL 0
+#define MAXGROUPS 256
+
+/* Counters a user sends to the switch at the end of a benchmark */
+
+typedef struct
+{
+  long sent; /* Text messages accepted by the switch queue */
+  long rejected; /* Text messages not sent because the switch queue was full */
+  long received; /* Text messages received */
+  long late; /* Text messages sent more than one period after their scheduled time */
+} report_t;
+
+/* Service messages */
+/* Each service has its own constructor, which builds the whole message through */
+/* the accessors of layer1: the header fields a service does not use stay -1, */
+/* the bytes are those the send functions below always put on the queues. */
+
+static inline void service_message(messagebuf_t *buf, int sender, int service, int data)
+{
+  init_message(buf);
+  set_type(buf, TYPE_SERVICE);
+  set_sender(buf, sender);
+  set_service(buf, service);
+  set_service_data(buf, data);
+}
+
+static inline void connect_message(messagebuf_t *buf, int sender)
+{
+  service_message(buf, sender, SERVICE_CONNECT, -1);
+}
+
+static inline void disconnect_message(messagebuf_t *buf, int sender, int pid)
+{
+  service_message(buf, sender, SERVICE_DISCONNECT, pid);
+}
+
+static inline void qid_message(messagebuf_t *buf, int sender, int qid)
+{
+  service_message(buf, sender, SERVICE_QID, qid);
+}
+
+/* The answer to a time request carries back the stamps of the request */
+static inline void time_message(messagebuf_t *buf, int sender, messagebuf_t *request)
+{
+  service_message(buf, sender, SERVICE_TIME, (int) time(NULL));
+  copy_stamps(buf, request);
+}
+
+static inline void done_message(messagebuf_t *buf, int sender)
+{
+  service_message(buf, sender, SERVICE_DONE, -1);
+}
+
+static inline void report_message(messagebuf_t *buf, int sender, report_t *report)
+{
+  service_message(buf, sender, SERVICE_REPORT, -1);
+  set_payload(buf, (char *) report, sizeof(report_t));
+}
+
+static inline void credit_message(messagebuf_t *buf, int sender, int bytes)
+{
+  service_message(buf, sender, SERVICE_CREDIT, bytes);
+}
+
+static inline void join_message(messagebuf_t *buf, int sender, int group)
+{
+  service_message(buf, sender, SERVICE_JOIN, group);
+}
+
+static inline void leave_message(messagebuf_t *buf, int sender, int group)
+{
+  service_message(buf, sender, SERVICE_LEAVE, group);
+}
+
+/* The switch sends the following ones, from no user */
+
+static inline void terminate_message(messagebuf_t *buf)
+{
+  service_message(buf, -1, SERVICE_TERMINATE, -1);
+}
+
+static inline void time_request_message(messagebuf_t *buf)
+{
+  service_message(buf, -1, SERVICE_TIME, -1);
+  set_stamp(buf, STAMP_SWITCH_OUT);
+}
+
+static inline void start_message(messagebuf_t *buf)
+{
+  service_message(buf, -1, SERVICE_START, -1);
+}
+
+/* Credits given back by no user only wake a shard up */
+static inline void wakeup_message(messagebuf_t *buf)
+{
+  service_message(buf, -1, SERVICE_CREDIT, -1);
+}
+
+/* Text messages */
+/* A user's text and group messages give credits back in service_data, and the */
+/* group of a group message travels in the service field */
+
+static inline void text_message(messagebuf_t *buf, int sender, int recipient, char *text, int credits)
+{
+  init_message(buf);
+  set_type(buf, TYPE_TEXT);
+  set_sender(buf, sender);
+  set_recipient(buf, recipient);
+  set_service_data(buf, credits);
+  set_text(buf, text);
+  set_stamp(buf, STAMP_SEND);
+}
+
+static inline void group_message(messagebuf_t *buf, int sender, int group, char *text, int credits)
+{
+  init_message(buf);
+  set_type(buf, TYPE_GROUP);
+  set_sender(buf, sender);
+  set_service(buf, group);
+  set_service_data(buf, credits);
+  set_text(buf, text);
+  set_stamp(buf, STAMP_SEND);
+}
+
+/* The switch forwards the sender, the text and the stamps of a user's text message */
+static inline void forwarded_text_message(messagebuf_t *buf, messagebuf_t *in)
+{
+  init_message(buf);
+  set_type(buf, TYPE_TEXT);
+  set_sender(buf, get_sender(in));
+  set_payload(buf, in->mtext.text, get_text_length(in));
+  copy_stamps(buf, in);
+  set_stamp(buf, STAMP_SWITCH_OUT);
+}
+
+int init_queue(int num);
+int init_fresh_queue(int num, int *stale);
 void close_queue(int qid);
 
+int receive_next_message(int qid, messagebuf_t *in);
+int receive_next_message_wait(int qid, messagebuf_t *in);
+int receive_next_messages(int qid, messagebuf_t *in, int max);
+
 void user_send_connect(int sender, int sw);
 void user_send_qid(int sender, int qid, int sw);
-void user_send_text_message(int sender, int recipient, char *text, int sw);
-void user_send_time(int sender, int sw);
+void user_send_text_message(int sender, int recipient, char *text, int credits, int sw);
+int user_try_send_text_message(int sender, int recipient, char *text, int credits, int sw);
+void user_send_time(int sender, messagebuf_t *request, int sw);
 void user_send_disconnect(int sender, int pid, int sw);
+void user_send_done(int sender, int sw);
+void user_send_report(int sender, report_t *report, int sw);
+void user_send_credit(int sender, int bytes, int sw);
+void user_send_join(int sender, int group, int sw);
+void user_send_leave(int sender, int group, int sw);
+void user_send_group_message(int sender, int group, char *text, int credits, int sw);
+int user_try_send_group_message(int sender, int group, char *text, int credits, int sw);
 
-void switch_send_text_message(int sender, char *text, int user);
+int switch_send_text_message(messagebuf_t *in, int user);
+int switch_try_send_text_message(messagebuf_t *in, int user);
 void switch_send_terminate(int qid);
 void switch_send_time(int qid);
+int switch_try_send_time(int qid);
+void switch_send_start(int qid);
+int switch_try_send_wakeup(int qid);
+void switch_group_reference(messagebuf_t *ref, messagebuf_t *in, int slot);
+int switch_send_group_reference(messagebuf_t *ref, int user);
+int switch_try_send_group_reference(messagebuf_t *ref, int user);
@@ -0,0 +1,71 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include "eventlog.h"
+
+/*
+ * Event log decoder.
+ * Prints the events of a log written by ipc_demo -l as the simulator
+ * prints them without a log. The writer takes the events ring by ring,
+ * so they are sorted by time first.
+ */
+
+typedef struct
+{
+  event_t event;
+  long position; /* Keeps the order of events logged at the same time */
+} entry_t;
+
+static int compare_entries(const void *a, const void *b)
+{
+  const entry_t *x = a, *y = b;
+
+  if(x->event.time != y->event.time){
+    return x->event.time < y->event.time ? -1 : 1;
+  }
+  return x->position < y->position ? -1 : (x->position > y->position);
+}
+
+int main(int argc, char *argv[])
+{
+  FILE *f;
+  entry_t *entries = NULL;
+  long n = 0, size = 0, i;
+
+  if(argc != 2){
+    printf("Event log decoder\n");
+    printf("%s <file>\n", argv[0]);
+    exit(0);
+  }
+
+  if((f = fopen(argv[1], "r")) == NULL){
+    perror("fopen");
+    exit(1);
+  }
+
+  while(1){
+    if(n == size){
+      size = size ? 2 * size : 4096;
+      entries = realloc(entries, size * sizeof(entry_t));
+      if(entries == NULL){
+        perror("realloc");
+        exit(1);
+      }
+    }
+
+    if(fread(&entries[n].event, sizeof(event_t), 1, f) != 1){
+      break;
+    }
+    entries[n].position = n;
+    n++;
+  }
+  fclose(f);
+
+  qsort(entries, n, sizeof(entry_t), compare_entries);
+
+  for(i = 0; i < n; i++){
+    log_print_event(stdout, &entries[i].event);
+  }
+
+  free(entries);
+  exit(0);
+}
@@ -0,0 +1,175 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <pthread.h>
+#include "layer1.h"
+#include "layer2.h"
+#include "mailbox.h"
+
+/* Bytes of the blocks of each class: short texts, medium ones and the longest */
+static int class_sizes[MAILBOX_CLASSES] = {
+  256, 1024, (offsetof(mail_t, message.mtext.text) + MAX_TEXT_LENGTH + 7) & ~7
+};
+
+mailboxes_t *mailbox_create(int users_number)
+{
+  mailboxes_t *m;
+
+  if((m = calloc(1, sizeof(mailboxes_t))) == NULL ||
+     (m->boxes = calloc(users_number + 1, sizeof(mailbox_t))) == NULL ||
+     (m->slabs = malloc((MAILBOX_POOL_BYTES / MAILBOX_SLAB) * sizeof(char *))) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+
+  pthread_mutex_init(&m->lock, NULL);
+  m->users_number = users_number;
+
+  return m;
+}
+
+void mailbox_destroy(mailboxes_t *m)
+{
+  int i;
+
+  for(i = 0; i < m->slabs_number; i++){
+    free(m->slabs[i]);
+  }
+  free(m->slabs);
+  free(m->boxes);
+  pthread_mutex_destroy(&m->lock);
+  free(m);
+}
+
+/* Carves a new slab in blocks of the class, returns 0 if the pool is full */
+static int grow(mailboxes_t *m, int c)
+{
+  char *slab;
+  mail_t *mail;
+  int i, blocks = MAILBOX_SLAB / class_sizes[c];
+
+  if(m->bytes + MAILBOX_SLAB > MAILBOX_POOL_BYTES){
+    return 0;
+  }
+
+  if((slab = malloc(MAILBOX_SLAB)) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  m->slabs[m->slabs_number++] = slab;
+  m->bytes += MAILBOX_SLAB;
+
+  for(i = 0; i < blocks; i++){
+    mail = (mail_t *) (slab + i * class_sizes[c]);
+    mail->size_class = c;
+    mail->size = class_sizes[c];
+    mail->next = m->free[c];
+    m->free[c] = mail;
+  }
+
+  return 1;
+}
+
+/* The caller holds the lock */
+static mail_t *block(mailboxes_t *m, int length)
+{
+  mail_t *mail;
+  int c;
+
+  for(c = 0; c < MAILBOX_CLASSES - 1 && class_sizes[c] < length; c++);
+
+  if(m->free[c] == NULL && !grow(m, c)){
+    return NULL;
+  }
+
+  mail = m->free[c];
+  m->free[c] = mail->next;
+  return mail;
+}
+
+static void unblock(mailboxes_t *m, mail_t *mail)
+{
+  mail->next = m->free[mail->size_class];
+  m->free[mail->size_class] = mail;
+}
+
+int mailbox_put(mailboxes_t *m, int user, messagebuf_t *in)
+{
+  mailbox_t *box = &m->boxes[user];
+  mail_t *mail, *old;
+  int bytes = offsetof(messagebuf_t, mtext) + message_length(in);
+
+  pthread_mutex_lock(&m->lock);
+
+  if((mail = block(m, offsetof(mail_t, message) + bytes)) == NULL){
+    m->refused++;
+    pthread_mutex_unlock(&m->lock);
+    return 0;
+  }
+
+  /* Make room, the oldest messages first */
+  while(box->first != NULL && box->bytes + mail->size > MAILBOX_USER_BYTES){
+    old = box->first;
+    box->first = old->next;
+    box->bytes -= old->size;
+    box->messages--;
+    unblock(m, old);
+    m->evicted++;
+  }
+  if(box->first == NULL){
+    box->last = NULL;
+  }
+
+  memcpy(&mail->message, in, bytes);
+  mail->next = NULL;
+  if(box->last != NULL){
+    box->last->next = mail;
+  }
+  else{
+    box->first = mail;
+  }
+  box->last = mail;
+  box->bytes += mail->size;
+  box->messages++;
+  m->held++;
+
+  pthread_mutex_unlock(&m->lock);
+  return 1;
+}
+
+mail_t *mailbox_take(mailboxes_t *m, int user)
+{
+  mailbox_t *box = &m->boxes[user];
+  mail_t *mail;
+
+  pthread_mutex_lock(&m->lock);
+
+  mail = box->first;
+  m->delivered += box->messages;
+  box->first = box->last = NULL;
+  box->bytes = 0;
+  box->messages = 0;
+
+  pthread_mutex_unlock(&m->lock);
+  return mail;
+}
+
+void mailbox_release(mailboxes_t *m, mail_t *mail)
+{
+  mail_t *next;
+
+  pthread_mutex_lock(&m->lock);
+
+  for(; mail != NULL; mail = next){
+    next = mail->next;
+    unblock(m, mail);
+  }
+
+  pthread_mutex_unlock(&m->lock);
+}
+
+int mailbox_count(mailboxes_t *m, int user)
+{
+  return __atomic_load_n(&m->boxes[user].messages, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,74 @@
+/* Offline mailboxes */
+
+/* A text message to a user without a queue, not registered yet or gone for a */
+/* while, is kept in the mailbox of the user instead of being dropped, and the */
+/* mailbox is delivered at once when the user sends its queue. Messages are kept */
+/* in blocks of a few sizes, carved from slabs and recycled through free lists, */
+/* so that holding a message costs no call to malloc. */
+
+/* Bytes of blocks a user can hold, the mailbox fits in a full window of credits */
+#define MAILBOX_USER_BYTES CREDIT_WINDOW
+
+/* Bytes of slabs of all the mailboxes together */
+#define MAILBOX_POOL_BYTES (64 * 1024 * 1024)
+
+/* Bytes of each slab */
+#define MAILBOX_SLAB (64 * 1024)
+
+/* Sizes of the blocks, the last one holds the longest message */
+#define MAILBOX_CLASSES 3
+
+/* A kept message, allocated in the smallest block that holds it */
+
+typedef struct mail_s
+{
+  struct mail_s *next;
+  int size_class;
+  int size; /* Bytes of the block */
+  messagebuf_t message;
+} mail_t;
+
+typedef struct
+{
+  mail_t *first; /* Oldest message */
+  mail_t *last;
+  int bytes; /* Bytes of the blocks held */
+  int messages;
+} mailbox_t;
+
+/* Mailboxes of all the users, shared by the shards */
+
+typedef struct mailboxes_s
+{
+  pthread_mutex_t lock;
+  mailbox_t *boxes; /* Users are numbered from 1 */
+  int users_number;
+
+  mail_t *free[MAILBOX_CLASSES]; /* Free blocks of each size */
+  char **slabs;
+  int slabs_number;
+  long bytes; /* Bytes of the slabs allocated */
+
+  long held; /* Messages kept */
+  long delivered; /* Messages handed back to be forwarded */
+  long evicted; /* Messages thrown away to make room in a full mailbox, the oldest first */
+  long refused; /* Messages not kept because every slab was in use */
+} mailboxes_t;
+
+mailboxes_t *mailbox_create(int users_number);
+void mailbox_destroy(mailboxes_t *m);
+
+/* This function keeps a copy of a text message in the mailbox of the user */
+/* The oldest messages are evicted if the mailbox is full */
+/* Returns 0 if there is no room for it */
+int mailbox_put(mailboxes_t *m, int user, messagebuf_t *in);
+
+/* This function empties the mailbox of the user and returns its messages, oldest first */
+/* They must be given back with mailbox_release once forwarded */
+mail_t *mailbox_take(mailboxes_t *m, int user);
+
+/* This function gives back the blocks of a list of messages */
+void mailbox_release(mailboxes_t *m, mail_t *mail);
+
+/* This function returns the number of messages in the mailbox of the user */
+int mailbox_count(mailboxes_t *m, int user);
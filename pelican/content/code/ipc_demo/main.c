@@ -1,83 +1,195 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
-#include <linux/ipc.h>
-#include <linux/msg.h>
 #include <time.h>
 #include <signal.h>
 #include <wait.h>
+#include <sys/resource.h>
 #include "layer1.h"
 #include "layer2.h"
-
-#define MINCHILDS 1
-#define MAXCHILDS 15
-
-#define MAXFAILS 10
-
-int random_number(int max)
-{
-  double r,x;
-  r = (double) random();
-  x = r * (double) max / RAND_MAX;
-  return((int) x);
-}
+#include "histogram.h"
+#include "eventlog.h"
+#include "switch.h"
+#include "metrics.h"
+#include "trace.h"
+#include "task.h"
+#include "user.h"
+#include "shm.h"
+#include "sock.h"
+#include "uring.h"
+#include "pool.h"
+#include "mailbox.h"
+
+/* Users running as threads only need a small stack */
+#define USER_STACK_SIZE (128 * 1024)
 
 void usage(char *argv[])
 {
   printf("Telephone switch simulator\n");
-  printf("%s <number of users> <service probability> <text message probability>\n", argv[0]);
+  printf("%s [-e] [-t <transport>] [-s <shards>] [-T] [-b <seconds> [-r <rate>]] [-z <us>] [-n] [-g <groups>] [-M] [-p] [-S <seed>] [-l <file>] [-m <file>] [-j <file> [-R]] [-c <file>] [-P <file> [-x <speed>]] <number of users> <service probability> <text message probability>\n", argv[0]);
   printf("\n");
-  printf("     <number of users> - Number of users alive in the system (%d - %d)\n", MINCHILDS, MAXCHILDS);
+  printf("     -e - Event-driven switch: block until a message arrives instead of polling the queue\n");
+  printf("     -t <transport> - How messages travel: sysv (SysV message queues, default), shm (shared memory rings),\n");
+  printf("                      unix (Unix domain sockets, a connection for each sender),\n");
+  printf("                      uring (the same sockets, sending and waiting through an io_uring ring for each thread)\n");
+  printf("                      or tasks (queues in memory, the users are tasks of a scheduler thread for each core)\n");
+  printf("     -s <shards> - Split the users among this many switch threads (1 - %d, default 1)\n", MAXSHARDS);
+  printf("     -T - Run the users as threads of a single process instead of forking a process for each\n");
+  printf("     -b <seconds> - Benchmark: users send text messages without pauses for this long, then the switch reports its throughput\n");
+  printf("     -r <rate> - Text messages per second sent by all the users together in a benchmark (default 0, as fast as possible)\n");
+  printf("     -z <us> - Slow user: in a benchmark, user 1 waits this long after every text message it reads\n");
+  printf("     -n - No flow control: the switch waits for room in the queue of a user instead of keeping the message\n");
+  printf("     -g <groups> - Spread the users among this many groups (1 - %d), one text message in ten goes to the group of the sender\n", MAXGROUPS - 1);
+  printf("     -M - Offline mailboxes: keep the text messages to users without a queue and deliver them when the user sends its queue\n");
+  printf("     -p - Provision: the switch creates a new private queue for every user and registers it before starting the users\n");
+  printf("     -S <seed> - Seed of the random number generators, so that a run can be repeated (default: the current time)\n");
+  printf("     -l <file> - Write the events to this binary log in the background instead of printing them, logdump decodes it\n");
+  printf("     -m <file> - Write the counters of the switch and the depth of the queues to this file every second and on SIGUSR1\n");
+  printf("     -j <file> - Keep a journal of the state of the switch in the files <file>.<shard>, and the texts of the group messages in <file>.pool\n");
+  printf("     -R - Recover: rebuild the state of a switch that died from its journal, its users keep running (SysV queues and processes only)\n");
+  printf("     -c <file> - Capture the text and group messages the switch receives in this trace\n");
+  printf("     -P <file> - Play back a trace: a benchmark where the users send the messages of the trace again (same number of users)\n");
+  printf("     -x <speed> - Pace of the play back, 1 as recorded (default), 2 twice as fast, 0 as fast as possible\n");
+  printf("     <number of users> - Number of users alive in the system (%d - %d, up to %d as tasks)\n", MINCHILDS, MAXCHILDS, MAXTASKS);
   printf("     <service probability> - The probability that the switch requires a service from the user (0-100)\n");
   printf("     <text message probability> - The probability the a user sends a message to another user (0-100)\n\n");
 }
 
 int main(int argc, char *argv[])
 {
-  pid_t pid;
+  pid_t pid = -1; /* The last user forked, waited for at the end */
   int i;
 
   int users_number;
   int service_probability;
   int text_message_probability;
 
+  int event_driven = 0;
+  char *transport = "sysv";
+  int shards = 1;
+  int opt;
+
+  int threaded = 0;
+  int tasks;
+
+  double bench_seconds = 0;
+  double rate = 0;
+  int delay = 0;
+  int flow_control = 1;
+  int groups = 0;
+  int mailboxes = 0;
+  int provision = 0;
+  int stale;
+  long seed = -1;
+  char *log_file = NULL;
+  char *metrics_file = NULL;
+  char *journal_file = NULL;
+  char pool_file[256];
+  int recover = 0;
+  char *capture_file = NULL;
+  char *replay_file = NULL;
+  double speed = 1;
+  trace_header_t header;
+  trace_record_t *trace = NULL;
+  long played;
+  int benchmark;
+  int records, connected, waiting;
+  long long start = 0, boot;
+  long resumes;
+  struct rusage rusage;
+  struct timespec ts;
+
   int status;
-  int deadproc = 0; /* A counter of the already terminated user processes */
-  int qid;
   int sw; /* Qid of the switch */
-  int dest; /* Destination of the message */
-  int olddest; /* Destination of the previous message */
-
-  int queues[MAXCHILDS + 1]; /* Queue identifiers - 0 is the qid of the switch */
-
-  int msg_sender;
-  int msg_recipient;
-  char msg_text[160];
-  int msg_service;
-  int msg_service_data;
 
-  int t;
-  int timing[MAXCHILDS + 1][2];
+  switch_t state;
+  user_t *users;
+  histogram_t *latency; /* Hops of the text messages, filled by the users */
+  pthread_attr_t attr;
 
-  int unreachable_destinations[MAXCHILDS + 1];
-
-  char *padding = "                                                                      ";
-  char text[160];
-
-  messagebuf_t msg, in;
+  /* Time to the first routed message */
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  boot = ts.tv_sec * 1000000000LL + ts.tv_nsec;
 
   /* Command line argument parsing */
-  if(argc != 4){
+  while((opt = getopt(argc, argv, "et:s:Tb:r:z:ng:MpS:l:m:j:Rc:P:x:")) != -1){
+    switch(opt){
+    case 'e':
+      event_driven = 1;
+      break;
+    case 't':
+      transport = optarg;
+      break;
+    case 's':
+      shards = strtol(optarg, NULL, 10);
+      break;
+    case 'T':
+      threaded = 1;
+      break;
+    case 'b':
+      bench_seconds = strtod(optarg, NULL);
+      break;
+    case 'r':
+      rate = strtod(optarg, NULL);
+      break;
+    case 'z':
+      delay = strtol(optarg, NULL, 10);
+      break;
+    case 'n':
+      flow_control = 0;
+      break;
+    case 'g':
+      groups = strtol(optarg, NULL, 10);
+      break;
+    case 'M':
+      mailboxes = 1;
+      break;
+    case 'p':
+      provision = 1;
+      break;
+    case 'S':
+      seed = strtol(optarg, NULL, 10);
+      break;
+    case 'l':
+      log_file = optarg;
+      break;
+    case 'm':
+      metrics_file = optarg;
+      break;
+    case 'j':
+      journal_file = optarg;
+      break;
+    case 'R':
+      recover = 1;
+      break;
+    case 'c':
+      capture_file = optarg;
+      break;
+    case 'P':
+      replay_file = optarg;
+      break;
+    case 'x':
+      speed = strtod(optarg, NULL);
+      break;
+    default:
+      usage(argv);
+      exit(0);
+    }
+  }
+
+  if(argc - optind != 3){
     usage(argv);
     exit(0);
   }
 
-  users_number = strtol(argv[1], NULL, 10);  
-  service_probability = strtol(argv[2], NULL, 10);
-  text_message_probability = strtol(argv[3], NULL, 10);
+  users_number = strtol(argv[optind], NULL, 10);
+  service_probability = strtol(argv[optind + 1], NULL, 10);
+  text_message_probability = strtol(argv[optind + 2], NULL, 10);
   
 
-  if((users_number < MINCHILDS) || (users_number > MAXCHILDS)){
+  /* Tasks cost a few hundred bytes, not a process or a thread */
+  tasks = !strcmp(transport, "tasks");
+  if((users_number < MINCHILDS) || (users_number > (tasks ? MAXTASKS : MAXCHILDS))){
     usage(argv);
     exit(1);
   }
@@ -92,244 +204,344 @@ int main(int argc, char *argv[])
     exit(0);
   }
 
+  if((shards < 1) || (shards > MAXSHARDS)){
+    usage(argv);
+    exit(0);
+  }
+
+  if((bench_seconds < 0) || (rate < 0) || (delay < 0) || (speed < 0)){
+    usage(argv);
+    exit(0);
+  }
+
+  if((groups < 0) || (groups >= MAXGROUPS)){
+    usage(argv);
+    exit(0);
+  }
+
+  /* A trace is played back as a benchmark, by the users and groups that recorded it */
+  if(replay_file != NULL){
+    if((trace = trace_load(replay_file, &header)) == NULL){
+      fprintf(stderr, "%s: not a trace\n", replay_file);
+      exit(1);
+    }
+    if(header.users_number != users_number){
+      fprintf(stderr, "%s: trace of %d users\n", replay_file, header.users_number);
+      exit(1);
+    }
+    groups = header.groups;
+  }
+  benchmark = bench_seconds > 0 || replay_file != NULL;
+
+  /* The users of the switch that died must still be there */
+  if(recover && (journal_file == NULL || strcmp(transport, "sysv") || threaded || benchmark || provision)){
+    usage(argv);
+    exit(0);
+  }
+
+  /* Tasks run the usual random users, a whole scheduler thread logs in a single ring */
+  if(tasks && (threaded || benchmark || log_file != NULL)){
+    usage(argv);
+    exit(0);
+  }
+
+  if(!strcmp(transport, "shm")){
+    /* One queue for each shard of the switch and one for each user */
+    shm_init(users_number + shards, SHM_CHANNELS_PER_QUEUE + 2 * shards);
+    set_transport(&shm_transport);
+  }
+  else if(!strcmp(transport, "unix") || !strcmp(transport, "uring")){
+    /* One queue for each shard of the switch and one for each user */
+    sock_init(users_number + shards);
+    set_transport(strcmp(transport, "unix") ? &uring_transport : &sock_transport);
+  }
+  else if(tasks){
+    /* Tasks cannot register, the switch creates their queues, and it must leave the cores to the schedulers */
+    task_init(users_number + shards);
+    set_transport(&task_transport);
+    provision = 1;
+    event_driven = 1;
+  }
+  else if(strcmp(transport, "sysv")){
+    usage(argv);
+    exit(0);
+  }
+
   printf("Number of users: %d\n", users_number);
   printf("Probability of a service request: %d%%\n", service_probability);
   printf("Probability of a text message: %d%%\n", text_message_probability);
+  printf("Switch loop: %s\n", event_driven ? "event-driven" : "polling");
+  printf("Transport: %s\n", transport);
+  printf("Switch shards: %d\n", shards);
+  if(tasks){
+    printf("Users: tasks, %d schedulers\n", task_schedulers());
+  }
+  else{
+    printf("Users: %s\n", threaded ? "threads" : "processes");
+  }
+  printf("Flow control: %s\n", flow_control ? "credits" : "none");
+  if(groups > 0){
+    printf("Groups: %d\n", groups);
+  }
+  if(provision){
+    printf("Queues: private, created and registered by the switch\n");
+  }
+  if(mailboxes){
+    printf("Offline mailboxes: %d KB for each user, %d MB in all\n", MAILBOX_USER_BYTES / 1024, MAILBOX_POOL_BYTES / (1024 * 1024));
+  }
+  if(log_file != NULL){
+    printf("Event log: %s\n", log_file);
+  }
+  if(metrics_file != NULL){
+    printf("Metrics: %s (kill -USR1 %d for a snapshot now)\n", metrics_file, (int) getpid());
+  }
+  if(journal_file != NULL){
+    printf("Journal: %s%s\n", journal_file, recover ? ", recovering" : "");
+  }
+  if(capture_file != NULL){
+    printf("Capture: %s\n", capture_file);
+  }
+  if(replay_file != NULL){
+    printf("Play back: %s, %ld messages, ", replay_file, header.records);
+    if(speed > 0){
+      printf("%g times the recorded pace\n", speed);
+    }
+    else{
+      printf("as fast as possible\n");
+    }
+  }
+  if(bench_seconds > 0){
+    printf("Benchmark: %g s, ", bench_seconds);
+    if(rate > 0){
+      printf("%g msgs/s\n", rate);
+    }
+    else{
+      printf("as fast as possible\n");
+    }
+    if(delay > 0){
+      printf("Slow user: 1, %d us per message\n", delay);
+    }
+  }
   printf("\n");
 
   /* Initialize the random number generator */
-  srandom(time(NULL));
+  if(seed < 0){
+    seed = time(NULL);
+  }
+  srandom(seed);
 
   /* Switch queue initialization */
-  sw = init_queue(255);
-  
-  /* Read the last messages we have in the queue */
-  while(receive_message(sw, TYPE_TEXT, &in)){
-    printf("%d -- S -- Receiving old text messages\n", (int) time(NULL), i);
+  /* A recovering switch routes the messages in it: they have been sent while it was down */
+  /* Otherwise they are left by a previous run, and thrown away with its queue */
+  if(recover){
+    sw = init_queue(0);
   }
-
-  /* Read the last messages we have in the queue */
-  while(receive_message(sw, TYPE_SERVICE, &in)){
-    printf("%d -- S -- Receiving old service messge\n", (int) time(NULL), i);
+  else{
+    sw = init_fresh_queue(0, &stale);
+    if(stale){
+      printf("%d -- S -- Discarding %d old messages\n", (int) time(NULL), stale);
+    }
   }
 
   /* All queues are "uninitialized" (set equal to switch queue) */
-  for(i = 0; i <= users_number; i++){
-    queues[i] = sw;
-    unreachable_destinations[i] = 0;
+  switch_init(&state, sw, users_number, service_probability, shards);
+  state.flow_control = flow_control;
+  if(mailboxes){
+    state.mailboxes = mailbox_create(users_number);
   }
 
-  /* Create users */
-  for(i = 1; i <= users_number; i++){
-    pid = fork();
+  /* The queues cannot collide with those of another run, and the users need not register */
+  /* The journal starts with their routes */
+  for(i = 1; i <= users_number && provision; i++){
+    switch_provision(&state, i, create_queue(IPC_PRIVATE), groups ? 1 + i % groups : 0);
+  }
 
-    if (pid == 0){
-      srandom(time(NULL) + 1000*i);
-
-      /* Initialize queue  */
-      qid = init_queue(i);
-      
-      /* Read the last messages we have in the queue */
-      while(receive_message(qid, TYPE_TEXT, &in)){
-	printf("%s%d -- U %02d -- Receiving old text messages\n", padding, (int) time(NULL), i);
-      }
+  if(recover){
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    start = ts.tv_sec * 1000000000LL + ts.tv_nsec;
 
-      /* Read the last messages we have in the queue */
-      while(receive_message(qid, TYPE_SERVICE, &in)){
-	printf("%s%d -- U %02d -- Receiving old service messge\n", padding, (int) time(NULL), i);
-      }
+    if((records = switch_recover(&state, journal_file)) == -1){
+      fprintf(stderr, "%s: no journal to recover from\n", journal_file);
+      exit(1);
+    }
 
-      /* Let the switch know we are alive */
-      user_send_connect(i, sw);
-      
-      /* Let the switch know how to reach us */
-      user_send_qid(i, qid, sw);
-      
-      /* Enter the main loop */
-      while(1){
-	sleep(rand()%MAX_SLEEP);
-
-    	/* Check if the switch requested a service */
-    	if(receive_message(qid, TYPE_SERVICE, &in)){
-    	  msg_service = get_service(&in);
-
-    	  switch(msg_service){
-
-    	  case SERVICE_TERMINATE:
-    	    /* Send an acknowledgement to the switch */
-    	    user_send_disconnect(i, getpid(), sw);
-	    
-    	    /* Read the last messages we have in the queue */
-    	    while(receive_message(qid, TYPE_TEXT, &in)){
-    	      msg_sender = get_sender(&in);
-    	      get_text(&in, msg_text);
-    	      printf("%s%d -- U %02d -- Message received\n", padding, (int) time(NULL), i);
-	      printf("%s                      Sender: %d\n", padding, msg_sender);
-	      printf("%s                      Text: %s\n", padding, msg_text);
-    	    }
-	    
-    	    /* Remove the queue */
-    	    close_queue(qid);
-    	    printf("%s%d -- U %02d -- Termination\n", padding, (int) time(NULL), i);
-    	    exit(0);
-    	    break;
-
-    	  case SERVICE_TIME:
-    	    user_send_time(i, sw);
-    	    printf("%s%d -- U %02d -- Timing\n", padding, (int) time(NULL), i);
-    	    break;
-
-	  }
-    	}
-
-    	/* Send a message */
-    	if(random_number(100) < text_message_probability){
-    	  dest = random_number(users_number + 1);
-
-    	  /* Do not send a message to the switch, to yourself and to the previous recipient */
-    	  while((dest == 0) || (dest == i) || (dest == olddest)){
-    	    dest = random_number(users_number + 1);
-    	  }
-    	  olddest = dest;
-
-    	  printf("%s%d -- U %02d -- Message to user %d\n", padding, (int) time(NULL), i, dest);
-	  sprintf(text, "A message from me (%d) to you (%d)", i, dest);
-    	  user_send_text_message(i, dest, text, sw);
-    	}
-	
-    	/* Check the incoming box for simple messages */
-    	if(receive_message(qid, TYPE_TEXT, &in)){
-    	  msg_sender = get_sender(&in);
-    	  get_text(&in, msg_text);
-	  printf("%s%d -- U %02d -- Message received\n", padding, (int) time(NULL), i);
-	  printf("%s                      Sender: %d\n", padding, msg_sender);
-	  printf("%s                      Text: %s\n", padding, msg_text);
-    	}
-      }
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    printf("Recovered %d journal records in %.3f ms\n", records, (ts.tv_sec * 1000000000LL + ts.tv_nsec - start) / 1e6);
+
+    for(i = 1, connected = 0; i <= users_number; i++){
+      connected += (switch_lookup(&state, i) != sw);
+    }
+    for(i = 0, waiting = 0; i < shards; i++){
+      waiting += state.shard[i].waiting_number;
     }
+    printf("Users: %d connected, %d disconnected, %d text messages waiting for credits\n\n", connected,
+           state.deadproc, waiting);
   }
-  
-  /* Switch (parent process) */ 
-  while(1){
-    /* Check if some user is answering to service messages */
-    if(receive_message(sw, TYPE_SERVICE, &in)){
-      msg_service = get_service(&in);
-      msg_sender = get_sender(&in);
-
-      switch(msg_service){
-      case SERVICE_CONNECT:
-	/* A new user has connected */
-	printf("%d -- S -- Service: connection\n", (int) time(NULL));
-	printf("                   User: %d\n", msg_sender);
-	break;
-
-      case SERVICE_DISCONNECT:
-	/* The user is terminating */
-	printf("%d -- S -- Service: disconnection\n", (int) time(NULL));
-	printf("                   User: %d\n", msg_sender);
-
-	deadproc++;
-	break;
-
-      case SERVICE_QID:
-	/* The user is sending us its queue id */
-	msg_service_data = get_service_data(&in);
-	printf("%d -- S -- Service: queue\n", (int) time(NULL));
-	printf("                   User: %d\n", msg_sender);
-	printf("                   Qid: %d\n", msg_service_data);
-	queues[msg_sender] = msg_service_data;
-	break;
-
-      case SERVICE_TIME:
-	msg_service_data = get_service_data(&in);
-
-	/* Timing informations */
-	timing[msg_sender][1] = msg_service_data - timing[msg_sender][1];
-
-	printf("%d -- S -- Service: timing\n", (int) time(NULL));
-	printf("                   User: %d\n", msg_sender);
-	printf("                   Timing: %d\n", timing[msg_sender][1]);
-
-	/* The user is no more blocked by a timing operation */
-	timing[msg_sender][0] = 0;
-	break;
-      }
+  if(capture_file != NULL){
+    state.trace = trace_create(capture_file, users_number, groups, shards);
+  }
+  if(benchmark){
+    /* A benchmark only logs the events if asked to */
+    state.bench = 1;
+    state.boot = boot;
+    state.verbose = (log_file != NULL);
+  }
+  if(tasks){
+    state.verbose = 0;
+  }
+
+  /* Before any other thread, so that they leave SIGUSR1 to it */
+  if(metrics_file != NULL){
+    metrics_start(&state, metrics_file);
+  }
+
+  /* The texts of the group messages, stored by the shards */
+  /* With a journal they are kept in a file, for the next switch if this one dies */
+  if(journal_file != NULL){
+    snprintf(pool_file, sizeof(pool_file), "%s.pool", journal_file);
+    if(!recover){
+      unlink(pool_file);
     }
+    pool_init(shards, pool_file);
+    switch_journal(&state, journal_file);
+  }
+  else{
+    pool_init(shards, NULL);
+  }
 
-    /* Check if some user has connected */
-    if(receive_message(sw, TYPE_TEXT, &in)){
-
-      msg_recipient = get_recipient(&in);
-      msg_sender = get_sender(&in);
-      get_text(&in, msg_text);
-      
-      /* If the destination is connected */
-      if(queues[msg_recipient] != sw){
-	/* Send the message (forward it) */
-	switch_send_text_message(msg_sender, msg_text, queues[msg_recipient]);
-	
-	printf("%d -- S -- Routing message\n", (int) time(NULL));
-	printf("                   Sender: %d -- Destination: %d\n", msg_sender, msg_recipient);
-	printf("                   Text: %s\n", msg_text);
-      }
-      else{
-	unreachable_destinations[msg_sender] += 1;
-
-	if (unreachable_destinations[msg_sender] > MAXFAILS) {
-	  continue;
-	}
-
-	printf("%d -- S -- Unreachable destination\n", (int) time(NULL));
-	printf("                   Sender: %d -- Destination: %d\n", msg_sender, msg_recipient);
-	printf("                   Text: %s\n", msg_text);
-	printf("                   Threshold: %d/%d\n", unreachable_destinations[msg_sender], MAXFAILS);
-
-	if (unreachable_destinations[msg_sender] == MAXFAILS) {
-	  printf("%d -- S -- User %d reached max unreachable destinations\n", (int) time(NULL), msg_sender);
-
-	  switch_send_terminate(queues[msg_sender]);
-	  
-	  /* Remove its queue from the list */
-	  queues[msg_sender] = sw;
-	}
-      }
-      
-      /* Randomly request a service to the sender of the last message */
-      if((random_number(100)  < service_probability) && (queues[msg_sender] != sw)){
-	if (random_number(100) < 40){
-	  /* The user must terminate */
-	  printf("%d -- S -- User %d chosen for termination\n", (int) time(NULL), msg_sender);
-
-	  switch_send_terminate(queues[msg_sender]);
-
-	  /* Remove its queue from the list */
-	  queues[msg_sender] = sw;
-	}
-	else {
-	  /* Check if we are already timing that user */
-	  if(!timing[msg_sender][0]){
-	    timing[msg_sender][0] = 1;
-	    timing[msg_sender][1] = (int) time(NULL);
-	    printf("%d -- S -- User %d chosen for timing...\n", timing[msg_sender][1], msg_sender);
-	    switch_send_time(queues[msg_sender]);
-	  }
-	}
+  /* One ring for each user and each shard */
+  if(log_file != NULL){
+    log_init(log_file, users_number + shards);
+  }
+
+  /* Create users */
+  users = malloc((users_number + 1) * sizeof(user_t));
+  latency = histogram_shared(HOPS);
+  pthread_attr_init(&attr);
+  pthread_attr_setstacksize(&attr, USER_STACK_SIZE);
+
+  /* The users of the switch that died keep running */
+  played = 0;
+  for(i = 1; i <= users_number && !recover; i++){
+    /* Talk to the shard of the switch serving the user */
+    user_init(&users[i], i, users_number, text_message_probability, switch_queue(&state, i));
+    users[i].seed = seed + 1000*i;
+    users[i].latency = latency;
+    users[i].flow_control = flow_control;
+    users[i].group = groups ? 1 + i % groups : 0;
+    if(provision){
+      users[i].qid = switch_lookup(&state, i);
+    }
+
+    /* The messages of the user come one after the other in the trace */
+    if(trace != NULL){
+      for(; played < header.records && trace[played].sender < i; played++);
+      users[i].trace = &trace[played];
+      for(users[i].trace_number = 0; played < header.records && trace[played].sender == i; played++){
+        users[i].trace_number++;
       }
+      users[i].speed = speed;
     }
-    else{
-      if(deadproc == users_number){
-	/* All childs have been terminated, just wait for the last to complete its jobs */
-	waitpid(pid, &status, 0);
-
-	/* Remove the switch queue */
-	remove_queue(sw);
-
-	printf("\n");
-	printf("No more active users. Switch turns off.\n");
-	
-	/* Terminate the program */
-	exit(0);
+
+    if(benchmark){
+      users[i].verbose = (log_file != NULL);
+      users[i].duration = bench_seconds * 1e9;
+      users[i].period = (rate > 0) ? users_number * 1e9 / rate : 0;
+      users[i].delay = (i == 1) ? delay : 0;
+    }
+
+    /* A million users printing their events would only measure the terminal */
+    if(tasks){
+      users[i].verbose = 0;
+      user_spawn(&users[i], i);
+      continue;
+    }
+
+    if(threaded){
+      users[i].threaded = 1;
+      if(pthread_create(&users[i].thread, &attr, user_run, &users[i])){
+        perror("pthread_create");
+        exit(1);
       }
+      continue;
+    }
+
+    fflush(stdout);
+    pid = fork();
+
+    if (pid == 0){
+      user_run(&users[i]);
     }
   }
+  
+  if(tasks){
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    start = ts.tv_sec * 1000000000LL + ts.tv_nsec;
+    task_start(user_tasks_stop);
+  }
+
+  /* Users that did not register are started once they all run */
+  if(provision && state.bench){
+    switch_start(&state);
+  }
+
+  /* Switch (parent process) */
+  if(event_driven){
+    switch_run_event(&state);
+  }
+  else{
+    switch_run_polling(&state);
+  }
+
+  /* All childs have been terminated, just wait for the last to complete its jobs */
+  if(tasks){
+    resumes = task_wait();
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    getrusage(RUSAGE_SELF, &rusage);
+
+    printf("\n");
+    printf("Tasks: %ld resumes in %.3f s, %.0f per second\n", resumes, (ts.tv_sec * 1000000000LL + ts.tv_nsec - start) / 1e9,
+           resumes * 1e9 / (ts.tv_sec * 1000000000LL + ts.tv_nsec - start));
+    printf("Memory: %ld MB resident at the peak, %ld bytes for each user (%d in user_t)\n", rusage.ru_maxrss / 1024,
+           rusage.ru_maxrss * 1024 / users_number, (int) sizeof(user_t));
+  }
+  else if(threaded){
+    for(i = 1; i <= users_number; i++){
+      pthread_join(users[i].thread, NULL);
+    }
+  }
+  else if(!recover){
+    waitpid(pid, &status, 0);
+  }
+  free(users);
+  free(trace);
+
+  if(state.bench){
+    printf("\n");
+    switch_print_report(&state);
+  }
+  else if(mailboxes){
+    printf("\n");
+    switch_print_mailboxes(&state);
+  }
+
+  printf("\n");
+  printf("%-16s %10s %10s %10s %10s %10s %10s\n", "Latency (us)", "count", "mean", "p50", "p99", "p99.9", "max");
+  for(i = 0; i < HOPS; i++){
+    histogram_print(hop_names[i], &latency[i]);
+  }
+  switch_print_latency(&state);
+
+  log_stop();
+  metrics_stop();
+
+  /* Remove the switch queue */
+  remove_queue(sw);
+  switch_free(&state);
+
+  printf("\n");
+  printf("No more active users. Switch turns off.\n");
+
+  /* Terminate the program */
+  exit(0);
 }
@@ -0,0 +1,194 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <time.h>
+#include "layer1.h"
+#include "layer2.h"
+#include "histogram.h"
+#include "switch.h"
+#include "metrics.h"
+#include "pool.h"
+#include "mailbox.h"
+
+static switch_t *state;
+static char *snapshot_path;
+static pthread_t thread;
+static _Atomic int stop;
+
+static char *service_names[SERVICES] = {
+  NULL, "terminate", "time", "connect", "disconnect", "qid", "unreachable destination",
+  "start", "done", "report", "credit", "join", "leave"
+};
+
+static long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* The shards change the counters while we read them */
+static long counter(long *c)
+{
+  return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+/*
+ * Snapshot.
+ * Written to a temporary file renamed over the previous snapshot, so that
+ * a reader never sees half of it.
+ */
+static void metrics_write(long long start, long long *last_time, long *last_routed)
+{
+  switch_t *s = state;
+  route_stats_t *u, total;
+  char tmp[4096];
+  FILE *f;
+  long long now;
+  long services, multicasts = 0;
+  int i, j, qid, messages, bytes, connected = 0;
+
+  snprintf(tmp, sizeof(tmp), "%s.tmp", snapshot_path);
+  if((f = fopen(tmp, "w")) == NULL){
+    perror("fopen");
+    return;
+  }
+
+  memset(&total, 0, sizeof(total));
+  for(i = 1; i <= s->users_number; i++){
+    u = &s->stats[i];
+    total.routed += counter(&u->routed);
+    total.dropped += counter(&u->dropped);
+    total.deferred += counter(&u->deferred);
+    total.unreachable += counter(&u->unreachable);
+    total.held += counter(&u->held);
+    total.terminations += counter(&u->terminations);
+    total.timings += counter(&u->timings);
+    connected += (switch_lookup(s, i) != s->sw);
+  }
+  now = now_ns();
+  fprintf(f, "Time: %d\n", (int) time(NULL));
+  fprintf(f, "Uptime: %.1f s\n", (now - start) / 1e9);
+  fprintf(f, "Users: %d connected, %d disconnected of %d\n", connected,
+          __atomic_load_n(&s->deadproc, __ATOMIC_RELAXED), s->users_number);
+  fprintf(f, "Routed: %ld (%.0f msgs/s)\n", total.routed,
+          (total.routed - *last_routed) / ((now - *last_time) / 1e9));
+  fprintf(f, "Dropped: %ld\n", total.dropped);
+  fprintf(f, "Waited for credits: %ld\n", total.deferred);
+  fprintf(f, "Unreachable: %ld\n", total.unreachable);
+  if(s->mailboxes != NULL){
+    pthread_mutex_lock(&s->mailboxes->lock);
+    fprintf(f, "Held in mailboxes: %ld, delivered %ld, evicted %ld, refused %ld, %ld KB of slabs\n",
+            total.held, s->mailboxes->delivered, s->mailboxes->evicted, s->mailboxes->refused,
+            s->mailboxes->bytes / 1024);
+    pthread_mutex_unlock(&s->mailboxes->lock);
+  }
+  fprintf(f, "Terminations: %ld\n", total.terminations);
+  fprintf(f, "Timings: %ld\n", total.timings);
+  for(i = 0; i < s->shards; i++){
+    multicasts += counter(&s->shard[i].multicasts);
+  }
+  fprintf(f, "Group messages: %ld, %d texts in the pool\n", multicasts, pool_used());
+  *last_time = now;
+  *last_routed = total.routed;
+
+  fprintf(f, "\nService messages received\n");
+  for(j = 1; j < SERVICES; j++){
+    if(service_names[j] == NULL){
+      continue;
+    }
+    services = 0;
+    for(i = 0; i < s->shards; i++){
+      services += counter(&s->shard[i].services[j]);
+    }
+    fprintf(f, "%-24s %ld\n", service_names[j], services);
+  }
+  services = 0;
+  for(i = 0; i < s->shards; i++){
+    services += counter(&s->shard[i].bad_services);
+  }
+  fprintf(f, "%-24s %ld\n", "invalid", services);
+
+  fprintf(f, "\n%-6s %10s %10s %10s\n", "shard", "qid", "messages", "bytes");
+  for(i = 0; i < s->shards; i++){
+    if(queue_stat(s->shard[i].sw, &messages, &bytes) == -1){
+      messages = bytes = -1;
+    }
+    fprintf(f, "%-6d %10d %10d %10d\n", i, s->shard[i].sw, messages, bytes);
+  }
+
+  /* Queues of users that are gone read -1 */
+  fprintf(f, "\n%-6s %10s %10s %10s %10s %10s %10s %12s %10s %10s %10s %10s %10s\n", "user", "qid", "routed", "dropped",
+          "waited", "unreachable", "held", "terminations", "timings", "credits", "mailbox", "messages", "bytes");
+  for(i = 1; i <= s->users_number; i++){
+    u = &s->stats[i];
+    qid = switch_lookup(s, i);
+    if(qid == s->sw || queue_stat(qid, &messages, &bytes) == -1){
+      qid = messages = bytes = -1;
+    }
+    fprintf(f, "%-6d %10d %10ld %10ld %10ld %10ld %10ld %12ld %10ld %10d %10d %10d %10d\n", i, qid, counter(&u->routed),
+            counter(&u->dropped), counter(&u->deferred), counter(&u->unreachable), counter(&u->held),
+            counter(&u->terminations), counter(&u->timings), __atomic_load_n(&s->credits[i], __ATOMIC_RELAXED),
+            s->mailboxes != NULL ? mailbox_count(s->mailboxes, i) : 0, messages, bytes);
+  }
+
+  fclose(f);
+  if(rename(tmp, snapshot_path) == -1){
+    perror("rename");
+  }
+}
+
+/* Waits a period or SIGUSR1, whichever comes first, then writes a snapshot */
+static void *metrics_run(void *arg)
+{
+  struct timespec period = {METRICS_PERIOD, 0};
+  sigset_t set;
+  long long start, last_time;
+  long last_routed = 0;
+
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+
+  start = last_time = now_ns();
+  while(!atomic_load(&stop)){
+    sigtimedwait(&set, NULL, &period);
+    metrics_write(start, &last_time, &last_routed);
+  }
+
+  return NULL;
+}
+
+void metrics_start(switch_t *s, char *path)
+{
+  sigset_t set;
+
+  state = s;
+  snapshot_path = path;
+  atomic_store(&stop, 0);
+
+  /* Only the metrics thread takes SIGUSR1, the threads created later inherit the mask */
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+
+  if(pthread_create(&thread, NULL, metrics_run, NULL)){
+    perror("pthread_create");
+    exit(1);
+  }
+}
+
+void metrics_stop(void)
+{
+  if(state == NULL){
+    return;
+  }
+
+  atomic_store(&stop, 1);
+  pthread_kill(thread, SIGUSR1);
+  pthread_join(thread, NULL);
+  state = NULL;
+}
@@ -0,0 +1,15 @@
+/* Metrics of the switch */
+
+/* A thread of the switch writes a snapshot of its counters and of the depth */
+/* of every queue to a file, every METRICS_PERIOD seconds and when the process */
+/* receives SIGUSR1. The counters are plain integers owned by the shards, the */
+/* thread only reads them, so routing pays nothing for it. */
+
+#define METRICS_PERIOD 1
+
+/* This function starts the thread writing the snapshots to the file path */
+/* It must be called before any other thread of the switch process is created */
+void metrics_start(switch_t *s, char *path);
+
+/* This function writes a last snapshot and stops the thread */
+void metrics_stop(void);
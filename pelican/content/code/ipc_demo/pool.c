@@ -0,0 +1,101 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "layer1.h"
+#include "pool.h"
+
+typedef struct
+{
+  _Atomic int refs; /* Readers that did not release the text yet, 0 if the slot is free */
+  int length;
+  char text[MAX_TEXT_LENGTH];
+} pool_slot_t;
+
+static pool_slot_t *slots;
+static int owners_number;
+
+/* Where each owner starts looking for a free slot, private to the switch process */
+static int *cursor;
+
+void pool_init(int owners, char *path)
+{
+  size_t size = owners * POOL_SLOTS * sizeof(pool_slot_t);
+  int fd = -1;
+
+  owners_number = owners;
+
+  if(path != NULL){
+    fd = open(path, O_RDWR | O_CREAT, 0644);
+    if(fd == -1 || ftruncate(fd, size) == -1){
+      perror(path);
+      exit(1);
+    }
+    slots = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+  }
+  else{
+    slots = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  }
+  if(slots == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+
+  cursor = calloc(owners, sizeof(int));
+  if(cursor == NULL){
+    perror("malloc");
+    exit(1);
+  }
+}
+
+/* Slots freed by the readers are found again going round the slots of the owner */
+int pool_store(int owner, char *text, int length, int refs)
+{
+  pool_slot_t *slot;
+  int i, s;
+
+  for(i = 0; i < POOL_SLOTS; i++){
+    s = owner * POOL_SLOTS + (cursor[owner] + i) % POOL_SLOTS;
+    slot = &slots[s];
+
+    if(atomic_load_explicit(&slot->refs, memory_order_acquire) == 0){
+      slot->length = length;
+      memcpy(slot->text, text, length);
+      atomic_store_explicit(&slot->refs, refs, memory_order_release);
+
+      cursor[owner] = (cursor[owner] + i + 1) % POOL_SLOTS;
+      return s;
+    }
+  }
+
+  return -1;
+}
+
+int pool_text(int slot, char *text)
+{
+  pool_slot_t *p = &slots[slot];
+
+  memcpy(text, p->text, p->length);
+  text[p->length] = '\0';
+  return p->length;
+}
+
+void pool_release(int slot)
+{
+  atomic_fetch_sub_explicit(&slots[slot].refs, 1, memory_order_acq_rel);
+}
+
+int pool_used(void)
+{
+  int s, used = 0;
+
+  for(s = 0; s < owners_number * POOL_SLOTS; s++){
+    used += (atomic_load_explicit(&slots[s].refs, memory_order_relaxed) != 0);
+  }
+
+  return used;
+}
@@ -0,0 +1,29 @@
+/* Payload pool */
+
+/* The text of a group message is stored once, in a slot of memory shared by all */
+/* the processes, and the members read it there. A slot counts the members that */
+/* did not read it yet and the last one frees it. Each shard of the switch stores */
+/* texts in slots of its own, so that storing needs no lock. */
+
+/* Slots of each shard, 4 KB each */
+#define POOL_SLOTS 256
+
+/* This function maps the slots of owners shards */
+/* It must be called before forking the processes that read the texts */
+/* With a path the slots are kept in that file, so that a switch restarted from */
+/* its journal maps again the texts the users did not read yet */
+void pool_init(int owners, char *path);
+
+/* This function copies a text in a free slot of the owner, for refs readers */
+/* Returns the slot, or -1 if every slot of the owner is in use */
+int pool_store(int owner, char *text, int length, int refs);
+
+/* This function copies the text of a slot in text, terminating it */
+/* Returns the length of the text */
+int pool_text(int slot, char *text);
+
+/* This function drops a reference to the text of a slot, freeing it with the last one */
+void pool_release(int slot);
+
+/* This function tells how many slots are in use */
+int pool_used(void);
@@ -0,0 +1,647 @@
+#include <stdatomic.h>
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "layer1.h"
+#include "layer2.h"
+#include "shm.h"
+
+/*
+ * Shared memory transport.
+ *
+ * The memory is mapped before forking, so every process sees the same
+ * queues and rings. A ring (channel) carries messages of one type from one
+ * queue to another; its producer only moves the tail and its consumer only
+ * moves the head. The channels entering a queue are kept in a list, which
+ * finds the channel of a sender and the messages of the queue.
+ *
+ * The owner of the queue does not scan that list when receiving: a producer
+ * that puts a message in a channel not marked ready marks it and pushes it
+ * on the ready stack of the queue. The owner moves the stack into a list of
+ * the ready channels of each type and serves them round robin; a channel
+ * found empty leaves the lists and is unmarked, and its producer pushes it
+ * again with its next message. A receive costs the same with a thousand
+ * idle users as with one.
+ *
+ * Each queue has a doorbell counter that producers increment after every
+ * message, so that a receiver with nothing to do can sleep on it with a
+ * futex. A producer that finds its ring full sleeps in the same way on a
+ * counter of the channel, which the consumer increments once it made room.
+ */
+
+/* Message types a queue keeps apart, from TYPE_SERVICE to TYPE_GROUP */
+#define SHM_TYPES TYPE_GROUP
+
+typedef struct
+{
+  _Atomic unsigned long head; /* Consumer position */
+  char pad1[64 - sizeof(unsigned long)];
+  _Atomic unsigned long tail; /* Producer position */
+  char pad2[64 - sizeof(unsigned long)];
+  int src;
+  int dst;
+  long type;
+  int next; /* Next channel entering the same queue, -1 at the end */
+  _Atomic int ready; /* In the ready stack or in a ready list of the queue */
+  int next_ready; /* Next channel in the same stack or list, -1 at the end */
+  _Atomic unsigned int room; /* Incremented by the consumer for a producer waiting for room */
+  _Atomic int waiting; /* Set by the producer about to sleep on room, cleared by the consumer that wakes it */
+  char data[SHM_RING_SIZE];
+} shm_channel_t;
+
+typedef struct
+{
+  _Atomic int used;
+  key_t key;
+  _Atomic int channels; /* First channel entering the queue, -1 if none */
+  _Atomic int ready; /* Stack of the channels marked ready since the owner last looked, -1 if none */
+  int first[SHM_TYPES]; /* Ready channels of each type, only seen by the owner */
+  int last[SHM_TYPES];
+  int cursor; /* Type served first when a receive takes any type */
+  _Atomic unsigned int doorbell;
+  _Atomic int waiters; /* Set by a receiver about to sleep, cleared by the sender that wakes it */
+} shm_queue_t;
+
+typedef struct
+{
+  int max_queues;
+  int max_channels;
+  int index_size;
+  _Atomic int next_queue;
+  _Atomic int next_channel;
+} shm_header_t;
+
+static shm_header_t *header;
+static shm_queue_t *queues;
+static _Atomic int *keys; /* Hash table from keys to queues, holding qid + 1, 0 if empty */
+static shm_channel_t *channels;
+
+/* The queue owned by the calling thread and the channels it already used */
+
+#define SHM_CACHE_SIZE 256
+
+typedef struct
+{
+  int dst;
+  long type;
+  int channel;
+} shm_cache_t;
+
+static __thread int self = -1;
+static __thread pid_t self_pid = 0;
+static __thread shm_cache_t cache[SHM_CACHE_SIZE];
+
+void shm_init(int max_queues, int channels_per_queue)
+{
+  size_t size;
+  int max_channels;
+  int index_size;
+
+  /* The index is never more than half full */
+  max_channels = max_queues * channels_per_queue;
+  for(index_size = 1; index_size < 2 * max_queues; index_size *= 2);
+
+  size = sizeof(shm_header_t) + max_queues * sizeof(shm_queue_t) +
+    index_size * sizeof(int) + 64 + max_channels * sizeof(shm_channel_t);
+
+  header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+  if(header == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+
+  header->max_queues = max_queues;
+  header->max_channels = max_channels;
+  header->index_size = index_size;
+  header->next_queue = 0;
+  header->next_channel = 0;
+
+  /* Channels start on a cache line boundary */
+  queues = (shm_queue_t *) (header + 1);
+  keys = (_Atomic int *) (queues + max_queues);
+  channels = (shm_channel_t *) (((unsigned long) (keys + index_size) + 63) & ~63UL);
+
+  self = -1;
+}
+
+void shm_bind_queue(int qid)
+{
+  int i;
+
+  self = qid;
+  self_pid = getpid();
+
+  for(i = 0; i < SHM_CACHE_SIZE; i++){
+    cache[i].channel = -1;
+  }
+}
+
+static long futex(_Atomic unsigned int *addr, int op, unsigned int val)
+{
+  return syscall(SYS_futex, addr, op, val, NULL, NULL, 0);
+}
+
+static void check_queue(int qid)
+{
+  if(qid < 0 || qid >= header->next_queue || !queues[qid].used){
+    fprintf(stderr, "shm: invalid queue %d\n", qid);
+    exit(1);
+  }
+}
+
+static unsigned int hash_key(key_t key)
+{
+  return ((unsigned int) key * 2654435761u) & (header->index_size - 1);
+}
+
+static int find_key(key_t key)
+{
+  unsigned int h;
+  int entry;
+
+  for(h = hash_key(key); (entry = atomic_load(&keys[h])); h = (h + 1) & (header->index_size - 1)){
+    if(queues[entry - 1].used && queues[entry - 1].key == key){
+      return entry - 1;
+    }
+  }
+
+  return -1;
+}
+
+static void insert_key(key_t key, int qid)
+{
+  unsigned int h;
+  int empty;
+
+  for(h = hash_key(key); ; h = (h + 1) & (header->index_size - 1)){
+    empty = 0;
+    if(atomic_compare_exchange_strong(&keys[h], &empty, qid + 1)){
+      return;
+    }
+  }
+}
+
+/* Queues are never reused, so a stale qid cannot reach a new owner */
+static int shm_create_queue(key_t key)
+{
+  int qid;
+  shm_queue_t *q;
+  int t;
+
+  if(key != IPC_PRIVATE && (qid = find_key(key)) >= 0){
+    return qid;
+  }
+
+  qid = atomic_fetch_add(&header->next_queue, 1);
+  if(qid >= header->max_queues){
+    fprintf(stderr, "shm: too many queues\n");
+    exit(1);
+  }
+
+  q = &queues[qid];
+  q->key = key;
+  q->channels = -1;
+  q->ready = -1;
+  for(t = 0; t < SHM_TYPES; t++){
+    q->first[t] = q->last[t] = -1;
+  }
+  q->cursor = 0;
+  q->doorbell = 0;
+  q->waiters = 0;
+  atomic_store(&q->used, 1);
+
+  if(key != IPC_PRIVATE){
+    insert_key(key, qid);
+  }
+
+  /* The first queue created by a process or a thread is its own */
+  if(self < 0 || self_pid != getpid()){
+    shm_bind_queue(qid);
+  }
+
+  return qid;
+}
+
+/* Producers waiting for room find the queue gone */
+static int shm_remove_queue(int qid)
+{
+  int c;
+
+  check_queue(qid);
+  atomic_store(&queues[qid].used, 0);
+
+  for(c = atomic_load(&queues[qid].channels); c >= 0; c = channels[c].next){
+    if(atomic_exchange(&channels[c].waiting, 0)){
+      atomic_fetch_add(&channels[c].room, 1);
+      futex(&channels[c].room, FUTEX_WAKE, 1);
+    }
+  }
+
+  return 0;
+}
+
+/* Finds the channel from the calling thread to the queue, creating it the first time */
+static int get_channel(int dst, long type)
+{
+  shm_cache_t *entry;
+  shm_channel_t *ch;
+  int c;
+
+  entry = &cache[(dst * 31 + type) & (SHM_CACHE_SIZE - 1)];
+  if(entry->channel >= 0 && entry->dst == dst && entry->type == type){
+    return entry->channel;
+  }
+
+  for(c = queues[dst].channels; c >= 0; c = channels[c].next){
+    if(channels[c].src == self && channels[c].type == type){
+      break;
+    }
+  }
+
+  if(c < 0){
+    c = atomic_fetch_add(&header->next_channel, 1);
+    if(c >= header->max_channels){
+      fprintf(stderr, "shm: too many channels\n");
+      exit(1);
+    }
+
+    ch = &channels[c];
+    ch->head = 0;
+    ch->tail = 0;
+    ch->src = self;
+    ch->dst = dst;
+    ch->type = type;
+    ch->ready = 0;
+    ch->next_ready = -1;
+    ch->room = 0;
+    ch->waiting = 0;
+
+    /* Publish the channel to the consumer */
+    ch->next = atomic_load(&queues[dst].channels);
+    while(!atomic_compare_exchange_weak(&queues[dst].channels, &ch->next, c));
+  }
+
+  entry->dst = dst;
+  entry->type = type;
+  entry->channel = c;
+
+  return c;
+}
+
+static void ring_write(shm_channel_t *ch, unsigned long pos, void *src, int len)
+{
+  unsigned long offset = pos & (SHM_RING_SIZE - 1);
+  int first = len;
+
+  if(offset + len > SHM_RING_SIZE){
+    first = SHM_RING_SIZE - offset;
+  }
+
+  memcpy(ch->data + offset, src, first);
+  memcpy(ch->data, (char *) src + first, len - first);
+}
+
+static void ring_read(shm_channel_t *ch, unsigned long pos, void *dst, int len)
+{
+  unsigned long offset = pos & (SHM_RING_SIZE - 1);
+  int first = len;
+
+  if(offset + len > SHM_RING_SIZE){
+    first = SHM_RING_SIZE - offset;
+  }
+
+  memcpy(dst, ch->data + offset, first);
+  memcpy((char *) dst + first, ch->data, len - first);
+}
+
+/* Records are a length followed by the message, aligned to 8 bytes */
+/* Sizes are unsigned long, as the positions in the rings they are compared with */
+static unsigned long record_size(unsigned int len)
+{
+  return (sizeof(unsigned int) + len + 7) & ~7UL;
+}
+
+/* Free bytes of the ring, as the producer sees them */
+static unsigned long ring_room(shm_channel_t *ch, unsigned long tail)
+{
+  return SHM_RING_SIZE - (tail - atomic_load(&ch->head));
+}
+
+/*
+ * Waiting for room.
+ * The producer announces itself before looking at the head again, and the
+ * consumer moves the head before looking for it, so that one of them always
+ * sees the other. The removal of the queue wakes it up as well.
+ */
+static void wait_room(shm_queue_t *q, shm_channel_t *ch, unsigned long tail, unsigned long size)
+{
+  unsigned int room;
+
+  atomic_store(&ch->waiting, 1);
+  room = atomic_load(&ch->room);
+  if(ring_room(ch, tail) < size && atomic_load(&q->used)){
+    futex(&ch->room, FUTEX_WAIT, room);
+  }
+}
+
+/* The first message since the owner found the channel empty makes it ready again */
+static void mark_ready(shm_queue_t *q, int c)
+{
+  shm_channel_t *ch = &channels[c];
+
+  if(!atomic_exchange(&ch->ready, 1)){
+    ch->next_ready = atomic_load(&q->ready);
+    while(!atomic_compare_exchange_weak(&q->ready, &ch->next_ready, c));
+  }
+}
+
+/* Like msgsnd, the sender waits while the ring is full unless nowait is set */
+/* and gets -1 if the queue is removed */
+static int ring_push(int qid, messagebuf_t *qbuf, int nowait)
+{
+  shm_channel_t *ch;
+  shm_queue_t *q;
+  unsigned long tail, size;
+  unsigned int len;
+  int c;
+
+  if(qid >= 0 && qid < header->next_queue && !atomic_load(&queues[qid].used)){
+    return -1;
+  }
+  check_queue(qid);
+  if(self < 0){
+    fprintf(stderr, "shm: the sender does not own a queue\n");
+    exit(1);
+  }
+
+  if(qbuf->mtype < 1 || qbuf->mtype > SHM_TYPES){
+    fprintf(stderr, "shm: invalid message type %ld\n", qbuf->mtype);
+    exit(1);
+  }
+
+  len = message_length(qbuf);
+  size = record_size(len);
+
+  q = &queues[qid];
+  c = get_channel(qid, qbuf->mtype);
+  ch = &channels[c];
+  tail = atomic_load_explicit(&ch->tail, memory_order_relaxed);
+
+  while(ring_room(ch, tail) < size){
+    if(nowait){
+      return 0;
+    }
+    if(!atomic_load(&q->used)){
+      return -1;
+    }
+    wait_room(q, ch, tail, size);
+  }
+
+  ring_write(ch, tail, &len, sizeof(len));
+  ring_write(ch, tail + sizeof(len), &qbuf->mtext, len);
+  atomic_store_explicit(&ch->tail, tail + size, memory_order_release);
+
+  /* The channel is ready before the doorbell rings, so that the owner it wakes finds it */
+  atomic_thread_fence(memory_order_seq_cst);
+  mark_ready(q, c);
+
+  /* Ring the doorbell, waking the owner only if it sleeps: a single system call */
+  /* wakes it, however many messages arrive before it runs */
+  atomic_fetch_add(&q->doorbell, 1);
+  if(atomic_load(&q->waiters) && atomic_exchange(&q->waiters, 0)){
+    futex(&q->doorbell, FUTEX_WAKE, INT_MAX);
+  }
+
+  return 1;
+}
+
+static int shm_send_message(int qid, messagebuf_t *qbuf)
+{
+  return ring_push(qid, qbuf, 0) == -1 ? -1 : 0;
+}
+
+static int shm_try_send_message(int qid, messagebuf_t *qbuf)
+{
+  return ring_push(qid, qbuf, 1);
+}
+
+static int ring_pop(shm_channel_t *ch, messagebuf_t *qbuf)
+{
+  unsigned long head;
+  unsigned int len;
+
+  head = atomic_load_explicit(&ch->head, memory_order_relaxed);
+  if(head == atomic_load_explicit(&ch->tail, memory_order_acquire)){
+    return 0;
+  }
+
+  ring_read(ch, head, &len, sizeof(len));
+  ring_read(ch, head + sizeof(len), &qbuf->mtext, len);
+  qbuf->mtype = ch->type;
+  head += record_size(len);
+  atomic_store(&ch->head, head);
+
+  /* Wake the producer if it waits for room, once there is room for a batch of messages */
+  if(atomic_load(&ch->waiting) && SHM_RING_SIZE - (atomic_load(&ch->tail) - head) >= SHM_RING_SIZE / 2 &&
+     atomic_exchange(&ch->waiting, 0)){
+    atomic_fetch_add(&ch->room, 1);
+    futex(&ch->room, FUTEX_WAKE, 1);
+  }
+
+  return len;
+}
+
+/* Adds a channel at the end of the ready list of its type */
+static void append_ready(shm_queue_t *q, int c)
+{
+  int t = channels[c].type - 1;
+
+  channels[c].next_ready = -1;
+  if(q->last[t] >= 0){
+    channels[q->last[t]].next_ready = c;
+  }
+  else{
+    q->first[t] = c;
+  }
+  q->last[t] = c;
+}
+
+/* Moves the channels pushed by the producers into the ready lists, in the order they were pushed */
+static void collect_ready(shm_queue_t *q)
+{
+  int c, next, reversed = -1;
+
+  if(atomic_load_explicit(&q->ready, memory_order_relaxed) < 0){
+    return;
+  }
+
+  for(c = atomic_exchange(&q->ready, -1); c >= 0; c = next){
+    next = channels[c].next_ready;
+    channels[c].next_ready = reversed;
+    reversed = c;
+  }
+  for(c = reversed; c >= 0; c = next){
+    next = channels[c].next_ready;
+    append_ready(q, c);
+  }
+}
+
+/*
+ * Serves the ready channels of a type round robin: a channel goes back at
+ * the end of the list after each message. One found empty is unmarked
+ * before the producer is looked at again, as the producer marks it before
+ * looking at the mark, so that a message cannot be left in a channel
+ * that is not ready.
+ */
+static int receive_type(shm_queue_t *q, long type, messagebuf_t *qbuf)
+{
+  shm_channel_t *ch;
+  int t = type - 1, c, len;
+
+  while((c = q->first[t]) >= 0){
+    ch = &channels[c];
+    q->first[t] = ch->next_ready;
+    if(q->first[t] < 0){
+      q->last[t] = -1;
+    }
+
+    if((len = ring_pop(ch, qbuf))){
+      append_ready(q, c);
+      return len;
+    }
+
+    atomic_store(&ch->ready, 0);
+    atomic_thread_fence(memory_order_seq_cst);
+    if(atomic_load(&ch->tail) != atomic_load_explicit(&ch->head, memory_order_relaxed) &&
+       !atomic_exchange(&ch->ready, 1)){
+      append_ready(q, c);
+    }
+  }
+
+  return 0;
+}
+
+/* A negative type asks for the lowest type up to its absolute value, as msgrcv does */
+/* Type 0 takes any type, starting from a different one each time so that none starves */
+static int receive_ready(shm_queue_t *q, long type, messagebuf_t *qbuf)
+{
+  long t;
+  int i, len;
+
+  if(type > 0){
+    return (type <= SHM_TYPES) ? receive_type(q, type, qbuf) : 0;
+  }
+
+  if(type == 0){
+    for(i = 0; i < SHM_TYPES; i++){
+      t = (q->cursor + i) % SHM_TYPES + 1;
+      if((len = receive_type(q, t, qbuf))){
+        q->cursor = t % SHM_TYPES;
+        return len;
+      }
+    }
+    return 0;
+  }
+
+  for(t = 1; t <= -type && t <= SHM_TYPES; t++){
+    if((len = receive_type(q, t, qbuf))){
+      return len;
+    }
+  }
+
+  return 0;
+}
+
+/* Channels marked meanwhile by their producers are looked at once more */
+static int shm_receive_message(int qid, long type, messagebuf_t *qbuf)
+{
+  shm_queue_t *q;
+  int len;
+
+  check_queue(qid);
+  q = &queues[qid];
+
+  collect_ready(q);
+  if((len = receive_ready(q, type, qbuf)) || atomic_load(&q->ready) < 0){
+    return len;
+  }
+
+  collect_ready(q);
+  return receive_ready(q, type, qbuf);
+}
+
+static int shm_receive_message_wait(int qid, long type, messagebuf_t *qbuf)
+{
+  shm_queue_t *q;
+  unsigned int doorbell;
+  int len;
+
+  check_queue(qid);
+  q = &queues[qid];
+
+  while(1){
+    if((len = shm_receive_message(qid, type, qbuf))){
+      return len;
+    }
+
+    /* Announce the wait before checking again, so a sender cannot miss us */
+    atomic_store(&q->waiters, 1);
+    doorbell = atomic_load(&q->doorbell);
+
+    /* Only the owner receives, nobody else can be sleeping */
+    if((len = shm_receive_message(qid, type, qbuf))){
+      atomic_store(&q->waiters, 0);
+      return len;
+    }
+
+    if(futex(&q->doorbell, FUTEX_WAIT, doorbell) == -1 && errno == EINTR){
+      return 0;
+    }
+  }
+}
+
+/* Only the owner moves the heads, the counts are a snapshot */
+static int shm_queue_stat(int qid, int *messages, int *bytes)
+{
+  unsigned long head, tail;
+  unsigned int len;
+  int c;
+
+  if(qid < 0 || qid >= header->next_queue || !queues[qid].used){
+    return -1;
+  }
+
+  *messages = 0;
+  *bytes = 0;
+  for(c = atomic_load(&queues[qid].channels); c >= 0; c = channels[c].next){
+    head = atomic_load_explicit(&channels[c].head, memory_order_acquire);
+    tail = atomic_load_explicit(&channels[c].tail, memory_order_acquire);
+
+    /* The records may be consumed while we read them, stop at the first that looks wrong */
+    for(; head != tail; head += record_size(len)){
+      ring_read(&channels[c], head, &len, sizeof(len));
+      if(len > sizeof(messagebuf_t) || record_size(len) > tail - head){
+        break;
+      }
+      *messages += 1;
+      *bytes += len;
+    }
+  }
+
+  return 0;
+}
+
+transport_t shm_transport = {
+  shm_create_queue,
+  shm_remove_queue,
+  shm_send_message,
+  shm_try_send_message,
+  shm_receive_message,
+  shm_receive_message_wait,
+  shm_bind_queue,
+  shm_queue_stat,
+  NULL,
+  NULL
+};
@@ -0,0 +1,23 @@
+/* Shared memory transport */
+
+/* Every pair of queues talking to each other gets one ring per message type. */
+/* Each ring has a single producer and a single consumer, so no lock is needed. */
+
+/* Size in bytes of each ring, the same as the default capacity of a SysV queue */
+#define SHM_RING_SIZE 16384
+
+/* Rings allocated for each queue, enough for a user talking with the switch */
+/* A switch split in shards needs two more for each shard, as any of them may forward */
+/* text and group messages to any user */
+#define SHM_CHANNELS_PER_QUEUE 4
+
+extern transport_t shm_transport;
+
+/* This function maps the shared memory used by the transport */
+/* for max_queues queues and channels_per_queue rings on average for each of them */
+/* It must be called before forking the processes that use it */
+void shm_init(int max_queues, int channels_per_queue);
+
+/* This function declares the calling thread as the owner of the queue */
+/* Messages sent by the thread come from this queue */
+void shm_bind_queue(int qid);
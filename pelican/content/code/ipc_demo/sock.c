@@ -0,0 +1,659 @@
+#define _GNU_SOURCE /* sendmmsg, recvmmsg and accept4 */
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include "layer1.h"
+#include "layer2.h"
+#include "sock.h"
+#include "uring.h"
+
+/*
+ * Unix domain socket transport.
+ *
+ * The table of the queues is mapped before forking, so every process can
+ * find the queue of a key and knows whether a queue still exists. The
+ * sockets themselves belong to the process that created the queue: it
+ * listens on the address of the queue, accepts the connections of the
+ * senders and waits for all of them with an epoll instance.
+ *
+ * Messages read from the connections are kept in memory until a receive
+ * asks for their type, in one list for each type. A message travels with
+ * its mtype, which the sockets would not carry otherwise.
+ *
+ * The uring transport of uring.c only changes how a thread sends and waits,
+ * over the same connections and with the same lists.
+ */
+
+/* Connections served by a single epoll_wait() */
+#define SOCK_EVENTS 64
+
+typedef struct
+{
+  int used;
+  key_t key;
+} sock_queue_t;
+
+typedef struct
+{
+  int max_queues;
+  int index_size;
+  int next_queue;
+  pid_t base; /* The addresses of a run do not collide with those of another */
+} sock_header_t;
+
+static sock_header_t *header;
+static sock_queue_t *queues;
+static int *keys; /* Hash table from keys to queues, holding qid + 1, 0 if empty */
+static sock_local_t **locals; /* Queues of this process, NULL for those of others */
+
+/* Connections of the calling thread to the queues, indexed by qid, 0 if none */
+static __thread int *connections;
+static __thread int connections_size;
+
+/* Where the calling thread receives a batch, allocated the first time: a thread */
+/* that only receives short messages never touches most of it */
+static __thread messagebuf_t *batch;
+
+/* System calls of the calling thread, but for those of its ring */
+static __thread long calls;
+
+void sock_init(int max_queues)
+{
+  struct rlimit limit;
+  size_t size;
+  int index_size;
+
+  /* The index is never more than half full */
+  for(index_size = 1; index_size < 2 * max_queues; index_size *= 2);
+  size = sizeof(sock_header_t) + max_queues * sizeof(sock_queue_t) + index_size * sizeof(int);
+
+  header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(header == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+  header->max_queues = max_queues;
+  header->index_size = index_size;
+  header->next_queue = 0;
+  header->base = getpid();
+
+  queues = (sock_queue_t *) (header + 1);
+  keys = (int *) (queues + max_queues);
+
+  if((locals = calloc(max_queues, sizeof(sock_local_t *))) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+
+  /* A switch shard keeps a connection to every user, and accepts one from each */
+  if(getrlimit(RLIMIT_NOFILE, &limit) == 0){
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+
+  /* A child must not submit to the ring of its parent, nor send what the parent kept back */
+  pthread_atfork(NULL, NULL, uring_forget);
+}
+
+static void check_queue(int qid)
+{
+  if(qid < 0 || qid >= __atomic_load_n(&header->next_queue, __ATOMIC_ACQUIRE)){
+    fprintf(stderr, "sock: invalid queue %d\n", qid);
+    exit(1);
+  }
+}
+
+/* Abstract addresses take no room in the file system and go away with the socket */
+static socklen_t queue_address(int qid, struct sockaddr_un *addr)
+{
+  int length;
+
+  memset(addr, 0, sizeof(struct sockaddr_un));
+  addr->sun_family = AF_UNIX;
+  length = snprintf(addr->sun_path + 1, sizeof(addr->sun_path) - 1, "ipc_demo.%d.%d", (int) header->base, qid);
+
+  return offsetof(struct sockaddr_un, sun_path) + 1 + length;
+}
+
+static unsigned int hash_key(key_t key)
+{
+  return ((unsigned int) key * 2654435761u) & (header->index_size - 1);
+}
+
+static int find_key(key_t key)
+{
+  unsigned int h;
+  int entry;
+
+  for(h = hash_key(key); (entry = __atomic_load_n(&keys[h], __ATOMIC_ACQUIRE)); h = (h + 1) & (header->index_size - 1)){
+    if(__atomic_load_n(&queues[entry - 1].used, __ATOMIC_ACQUIRE) && queues[entry - 1].key == key){
+      return entry - 1;
+    }
+  }
+
+  return -1;
+}
+
+static void insert_key(key_t key, int qid)
+{
+  unsigned int h;
+  int empty;
+
+  for(h = hash_key(key); ; h = (h + 1) & (header->index_size - 1)){
+    empty = 0;
+    if(__atomic_compare_exchange_n(&keys[h], &empty, qid + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)){
+      return;
+    }
+  }
+}
+
+/* Queues are never reused, so a stale qid cannot reach a new owner */
+int sock_create_queue(key_t key)
+{
+  struct sockaddr_un addr;
+  struct epoll_event event;
+  sock_local_t *l;
+  int qid;
+
+  if(key != IPC_PRIVATE && (qid = find_key(key)) >= 0){
+    return qid;
+  }
+
+  qid = __atomic_fetch_add(&header->next_queue, 1, __ATOMIC_ACQ_REL);
+  if(qid >= header->max_queues){
+    fprintf(stderr, "sock: too many queues\n");
+    exit(1);
+  }
+
+  if((l = calloc(1, sizeof(sock_local_t))) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+
+  if((l->listener = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK, 0)) == -1 ||
+     bind(l->listener, (struct sockaddr *) &addr, queue_address(qid, &addr)) == -1 ||
+     listen(l->listener, SOMAXCONN) == -1 ||
+     (l->epoll = epoll_create1(0)) == -1){
+    perror("sock");
+    exit(1);
+  }
+
+  event.events = EPOLLIN;
+  event.data.fd = l->listener;
+  if(epoll_ctl(l->epoll, EPOLL_CTL_ADD, l->listener, &event) == -1){
+    perror("epoll_ctl");
+    exit(1);
+  }
+  locals[qid] = l;
+
+  queues[qid].key = key;
+  __atomic_store_n(&queues[qid].used, 1, __ATOMIC_RELEASE);
+  if(key != IPC_PRIVATE){
+    insert_key(key, qid);
+  }
+
+  return qid;
+}
+
+int sock_remove_queue(int qid)
+{
+  sock_local_t *l;
+  sock_node_t *n, *next;
+  int i;
+
+  check_queue(qid);
+  __atomic_store_n(&queues[qid].used, 0, __ATOMIC_RELEASE);
+
+  /* The senders get EPIPE on their connection, or ECONNREFUSED on a new one */
+  if((l = locals[qid]) == NULL){
+    return 0;
+  }
+  locals[qid] = NULL;
+
+  for(i = 0; i < l->connections_number; i++){
+    close(l->connections[i]);
+  }
+  close(l->listener);
+  close(l->epoll);
+
+  for(i = 0; i < SOCK_TYPES; i++){
+    for(n = l->first[i]; n != NULL; n = next){
+      next = n->next;
+      free(n);
+    }
+  }
+  free(l->connections);
+  free(l);
+
+  return 0;
+}
+
+/* Finds the connection of the calling thread to the queue, connecting the first time */
+/* Returns -1 if the queue has been removed */
+static int get_connection(int qid)
+{
+  struct sockaddr_un addr;
+  int size = SOCK_BUFFER;
+  int fd;
+
+  if(qid >= connections_size){
+    connections = realloc(connections, (qid + 64) * sizeof(int));
+    if(connections == NULL){
+      perror("realloc");
+      exit(1);
+    }
+    memset(&connections[connections_size], 0, (qid + 64 - connections_size) * sizeof(int));
+    connections_size = qid + 64;
+  }
+
+  if(connections[qid]){
+    return connections[qid];
+  }
+
+  if((fd = socket(AF_UNIX, SOCK_SEQPACKET, 0)) == -1){
+    perror("socket");
+    exit(1);
+  }
+  setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+  if(connect(fd, (struct sockaddr *) &addr, queue_address(qid, &addr)) == -1){
+    if(errno == ECONNREFUSED || errno == ENOENT){
+      close(fd);
+      return -1;
+    }
+    perror("connect");
+    exit(1);
+  }
+
+  connections[qid] = fd;
+  return fd;
+}
+
+int sock_connect(int qid)
+{
+  check_queue(qid);
+  if(!__atomic_load_n(&queues[qid].used, __ATOMIC_ACQUIRE)){
+    return -1;
+  }
+
+  return get_connection(qid);
+}
+
+int sock_connection(int qid)
+{
+  return connections[qid];
+}
+
+void sock_drop_connection(int qid)
+{
+  close(connections[qid]);
+  connections[qid] = 0;
+}
+
+/* Like msgsnd, the sender waits while the connection is full unless nowait is set */
+/* and gets -1 if the queue is removed */
+static int sock_push(int qid, messagebuf_t *qbuf, int nowait)
+{
+  int fd;
+
+  if((fd = sock_connect(qid)) == -1){
+    return -1;
+  }
+
+  calls++;
+  while(send(fd, qbuf, sizeof(long) + message_length(qbuf), MSG_NOSIGNAL | (nowait ? MSG_DONTWAIT : 0)) == -1){
+    if(errno == EAGAIN){
+      return 0;
+    }
+    if(errno == EPIPE || errno == ECONNRESET){
+      sock_drop_connection(qid);
+      return -1;
+    }
+    if(errno != EINTR){
+      perror("send");
+      exit(1);
+    }
+  }
+
+  return 1;
+}
+
+static int sock_send_message(int qid, messagebuf_t *qbuf)
+{
+  return sock_push(qid, qbuf, 0) == -1 ? -1 : 0;
+}
+
+static int sock_try_send_message(int qid, messagebuf_t *qbuf)
+{
+  return sock_push(qid, qbuf, 1);
+}
+
+/* A batch is a single sendmmsg(), repeated for what the connection did not take yet */
+static int sock_send_messages(int qid, messagebuf_t *qbufs, int n)
+{
+  struct mmsghdr msgs[SOCK_BATCH];
+  struct iovec iov[SOCK_BATCH];
+  int fd, i, batch, sent = 0, done;
+
+  if((fd = sock_connect(qid)) == -1){
+    return -1;
+  }
+
+  while(sent < n){
+    batch = (n - sent < SOCK_BATCH) ? n - sent : SOCK_BATCH;
+    memset(msgs, 0, batch * sizeof(struct mmsghdr));
+    for(i = 0; i < batch; i++){
+      iov[i].iov_base = &qbufs[sent + i];
+      iov[i].iov_len = sizeof(long) + message_length(&qbufs[sent + i]);
+      msgs[i].msg_hdr.msg_iov = &iov[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+    }
+
+    calls++;
+    if((done = sendmmsg(fd, msgs, batch, MSG_NOSIGNAL)) == -1){
+      if(errno == EINTR){
+        continue;
+      }
+      if(errno == EPIPE || errno == ECONNRESET){
+        sock_drop_connection(qid);
+        return -1;
+      }
+      perror("sendmmsg");
+      exit(1);
+    }
+    sent += done;
+  }
+
+  return 0;
+}
+
+sock_local_t *sock_get_local(int qid)
+{
+  check_queue(qid);
+  if(locals[qid] == NULL){
+    fprintf(stderr, "sock: queue %d belongs to another process\n", qid);
+    exit(1);
+  }
+
+  return locals[qid];
+}
+
+sock_local_t *sock_find_local(int qid)
+{
+  return locals[qid];
+}
+
+/* The ring is going away, the queues it received for are armed again by the next thread that waits */
+void sock_forget_ring(void *ring)
+{
+  int i;
+
+  for(i = 0; i < header->next_queue; i++){
+    if(locals[i] != NULL && locals[i]->ring == ring){
+      locals[i]->ring = NULL;
+    }
+  }
+}
+
+void sock_add_connection(sock_local_t *l, int fd)
+{
+  if(l->connections_number == l->size){
+    l->size = l->size ? 2 * l->size : 16;
+    if((l->connections = realloc(l->connections, l->size * sizeof(int))) == NULL){
+      perror("realloc");
+      exit(1);
+    }
+  }
+  l->connections[l->connections_number++] = fd;
+}
+
+static void accept_connections(sock_local_t *l)
+{
+  struct epoll_event event;
+  int fd;
+
+  while((fd = accept4(l->listener, NULL, NULL, SOCK_NONBLOCK)) != -1){
+    event.events = EPOLLIN;
+    event.data.fd = fd;
+    if(epoll_ctl(l->epoll, EPOLL_CTL_ADD, fd, &event) == -1){
+      perror("epoll_ctl");
+      exit(1);
+    }
+    sock_add_connection(l, fd);
+  }
+}
+
+/* A closed connection leaves the list of the queue */
+void sock_close_connection(sock_local_t *l, int fd)
+{
+  int i;
+
+  for(i = 0; i < l->connections_number; i++){
+    if(l->connections[i] == fd){
+      l->connections[i] = l->connections[--l->connections_number];
+      break;
+    }
+  }
+  close(fd);
+}
+
+/* Keeps a message read from a connection, length bytes after its mtype, in the list of its type */
+void sock_stash(sock_local_t *l, messagebuf_t *qbuf, int length)
+{
+  sock_node_t *n;
+  int type = qbuf->mtype - 1;
+
+  if(type < 0 || type >= SOCK_TYPES){
+    fprintf(stderr, "sock: invalid message type %ld\n", qbuf->mtype);
+    exit(1);
+  }
+
+  if((n = malloc(offsetof(sock_node_t, message.mtext) + length)) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  n->next = NULL;
+  n->sequence = l->sequence++;
+  n->length = length;
+  memcpy(&n->message.mtext, &qbuf->mtext, length);
+
+  if(l->last[type] != NULL){
+    l->last[type]->next = n;
+  }
+  else{
+    l->first[type] = n;
+  }
+  l->last[type] = n;
+  l->bytes += length;
+  __atomic_add_fetch(&l->messages, 1, __ATOMIC_RELAXED);
+}
+
+/* Reads a batch of messages from a connection into the lists of the queue */
+static void read_connection(sock_local_t *l, int fd)
+{
+  struct mmsghdr msgs[SOCK_BATCH];
+  struct iovec iov[SOCK_BATCH];
+  int i, got;
+
+  if(batch == NULL && (batch = malloc(SOCK_BATCH * sizeof(messagebuf_t))) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+
+  memset(msgs, 0, sizeof(msgs));
+  for(i = 0; i < SOCK_BATCH; i++){
+    iov[i].iov_base = &batch[i];
+    iov[i].iov_len = sizeof(messagebuf_t);
+    msgs[i].msg_hdr.msg_iov = &iov[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  calls++;
+  if((got = recvmmsg(fd, msgs, SOCK_BATCH, MSG_DONTWAIT, NULL)) == -1){
+    if(errno == ECONNRESET){
+      sock_close_connection(l, fd);
+    }
+    else if(errno != EAGAIN && errno != EINTR){
+      perror("recvmmsg");
+      exit(1);
+    }
+    return;
+  }
+
+  /* An empty message is the end of the connection, as a message has at least its header */
+  for(i = 0; i < got; i++){
+    if(msgs[i].msg_len == 0){
+      sock_close_connection(l, fd);
+      break;
+    }
+    sock_stash(l, &batch[i], msgs[i].msg_len - sizeof(long));
+  }
+}
+
+/* Takes whatever the connections hold, waiting for something if wait is set */
+/* Returns 0 if the wait has been interrupted by a signal */
+static int fill(sock_local_t *l, int wait)
+{
+  struct epoll_event events[SOCK_EVENTS];
+  int i, n;
+
+  calls++;
+  if((n = epoll_wait(l->epoll, events, SOCK_EVENTS, wait ? -1 : 0)) == -1){
+    if(errno == EINTR){
+      return 0;
+    }
+    perror("epoll_wait");
+    exit(1);
+  }
+
+  for(i = 0; i < n; i++){
+    if(events[i].data.fd == l->listener){
+      accept_connections(l);
+    }
+    else{
+      read_connection(l, events[i].data.fd);
+    }
+  }
+
+  return 1;
+}
+
+/* A negative type asks for the lowest type up to its absolute value, as msgrcv does */
+static int pick_type(sock_local_t *l, long type)
+{
+  int t, first = -1;
+
+  if(type > 0){
+    return (type <= SOCK_TYPES && l->first[type - 1] != NULL) ? type - 1 : -1;
+  }
+
+  for(t = 0; t < SOCK_TYPES && (type == 0 || t < -type); t++){
+    if(l->first[t] == NULL){
+      continue;
+    }
+    if(type < 0){
+      return t;
+    }
+    if(first < 0 || l->first[t]->sequence < l->first[first]->sequence){
+      first = t;
+    }
+  }
+
+  return first;
+}
+
+int sock_take(sock_local_t *l, long type, messagebuf_t *qbuf)
+{
+  sock_node_t *n;
+  int t, len;
+
+  if((t = pick_type(l, type)) < 0){
+    return 0;
+  }
+
+  n = l->first[t];
+  l->first[t] = n->next;
+  if(l->first[t] == NULL){
+    l->last[t] = NULL;
+  }
+  l->bytes -= n->length;
+  __atomic_sub_fetch(&l->messages, 1, __ATOMIC_RELAXED);
+
+  len = n->length;
+  qbuf->mtype = t + 1;
+  memcpy(&qbuf->mtext, &n->message.mtext, len);
+  free(n);
+
+  return len;
+}
+
+/* The messages already read come first: the connections are only read when none matches */
+static int sock_receive_message(int qid, long type, messagebuf_t *qbuf)
+{
+  sock_local_t *l = sock_get_local(qid);
+  int len;
+
+  if((len = sock_take(l, type, qbuf))){
+    return len;
+  }
+
+  fill(l, 0);
+  return sock_take(l, type, qbuf);
+}
+
+static int sock_receive_message_wait(int qid, long type, messagebuf_t *qbuf)
+{
+  sock_local_t *l = sock_get_local(qid);
+  int len;
+
+  while(!(len = sock_take(l, type, qbuf))){
+    if(!fill(l, 1)){
+      return 0;
+    }
+  }
+
+  return len;
+}
+
+/* Any thread of the process that created the queue may receive from it */
+void sock_bind_queue(int qid)
+{
+}
+
+/* Only the messages already read from the connections are counted */
+int sock_queue_stat(int qid, int *messages, int *bytes)
+{
+  sock_local_t *l;
+
+  if(qid < 0 || qid >= __atomic_load_n(&header->next_queue, __ATOMIC_ACQUIRE) ||
+     !__atomic_load_n(&queues[qid].used, __ATOMIC_ACQUIRE) || (l = locals[qid]) == NULL){
+    return -1;
+  }
+
+  *messages = __atomic_load_n(&l->messages, __ATOMIC_RELAXED);
+  *bytes = l->bytes;
+  return 0;
+}
+
+long sock_syscalls(void)
+{
+  return calls + uring_syscalls();
+}
+
+transport_t sock_transport = {
+  sock_create_queue,
+  sock_remove_queue,
+  sock_send_message,
+  sock_try_send_message,
+  sock_receive_message,
+  sock_receive_message_wait,
+  sock_bind_queue,
+  sock_queue_stat,
+  sock_send_messages,
+  NULL
+};
+
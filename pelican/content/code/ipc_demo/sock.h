@@ -0,0 +1,94 @@
+/* Unix domain socket transport */
+
+/* Every queue is a SOCK_SEQPACKET socket listening on an abstract address */
+/* built from its qid. A thread sending to a queue connects to it the first time, */
+/* so that, as with the shared memory rings, each pair of talking queues has a */
+/* connection of its own, which ss(8) lists like any other socket. A datagram */
+/* socket would not do: Linux lets only max_dgram_qlen (10 by default) */
+/* datagrams wait in it. The receiver takes batches of messages from its */
+/* connections with recvmmsg() and sorts them by type in memory, as the */
+/* sockets know nothing of the type of the messages. */
+
+/* Bytes a connection holds before the sender waits. The kernel counts in them */
+/* about 1 KB of its own for every message: this holds about as many short */
+/* messages as a SysV queue, more than the credits of a user allow */
+#define SOCK_BUFFER 65536
+
+/* Messages moved by a single recvmmsg() or sendmmsg() */
+#define SOCK_BATCH 32
+
+extern transport_t sock_transport;
+
+/* This function maps the table of the queues shared by the processes */
+/* for max_queues queues, and raises the limit of open files to the hard one */
+/* It must be called before forking the processes that use it */
+void sock_init(int max_queues);
+
+/* System calls made by the calling thread to move messages through the sockets, */
+/* those of the uring transport included */
+long sock_syscalls(void);
+
+/* The queues and connections below are shared with the uring transport of */
+/* uring.c, which only changes how a thread sends and waits */
+
+/* Message types a queue keeps apart, from TYPE_SERVICE to TYPE_GROUP */
+#define SOCK_TYPES TYPE_GROUP
+
+typedef struct sock_node_s
+{
+  struct sock_node_s *next;
+  long sequence; /* Arrival order, to take the first message whatever its type */
+  int length;
+  messagebuf_t message; /* Only the first length bytes of mtext are allocated */
+} sock_node_t;
+
+/* A queue created by this process */
+typedef struct
+{
+  int listener;
+  int epoll;
+  int *connections; /* Accepted connections, closed with the queue */
+  int connections_number;
+  int size;
+  long sequence;
+  sock_node_t *first[SOCK_TYPES];
+  sock_node_t *last[SOCK_TYPES];
+  int messages; /* Messages read from the connections and not received yet */
+  int bytes;
+  void *ring; /* io_uring ring receiving for the queue, NULL if none */
+} sock_local_t;
+
+int sock_create_queue(key_t key);
+int sock_remove_queue(int qid);
+void sock_bind_queue(int qid);
+int sock_queue_stat(int qid, int *messages, int *bytes);
+
+/* Returns the connection of the calling thread to the queue, connecting the first time */
+/* Returns -1 if the queue has been removed */
+int sock_connect(int qid);
+
+/* Returns the connection the calling thread already has to the queue */
+int sock_connection(int qid);
+
+/* Closes the connection of the calling thread to a removed queue */
+void sock_drop_connection(int qid);
+
+/* Returns the queue, which must have been created by this process */
+sock_local_t *sock_get_local(int qid);
+
+/* Returns the queue, NULL if it has been removed or belongs to another process */
+sock_local_t *sock_find_local(int qid);
+
+/* The queues the ring received for are armed again by the next thread that waits on them */
+void sock_forget_ring(void *ring);
+
+/* Connections accepted by a queue, and closed by their sender */
+void sock_add_connection(sock_local_t *l, int fd);
+void sock_close_connection(sock_local_t *l, int fd);
+
+/* Keeps a message received, length bytes after its mtype, in the list of its type */
+void sock_stash(sock_local_t *l, messagebuf_t *qbuf, int length);
+
+/* Takes the first message kept of the type, as msgrcv chooses it */
+/* Returns its length, 0 if none */
+int sock_take(sock_local_t *l, long type, messagebuf_t *qbuf);
@@ -0,0 +1,1508 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
+#include <sched.h>
+#include "layer1.h"
+#include "layer2.h"
+#include "histogram.h"
+#include "eventlog.h"
+#include "switch.h"
+#include "pool.h"
+#include "journal.h"
+#include "mailbox.h"
+#include "trace.h"
+
+/* What happened to a text message handed to forward() */
+#define FORWARD_SENT 1
+#define FORWARD_WAITING 0
+#define FORWARD_DROPPED -1
+#define FORWARD_GONE -2 /* The queue of the recipient has been removed */
+
+int random_number(int max)
+{
+  double r,x;
+  r = (double) random();
+  x = r * (double) max / RAND_MAX;
+  return((int) x);
+}
+
+/* Same as random_number, with a generator private to the caller */
+static int random_number_r(unsigned int *seed, int max)
+{
+  double r,x;
+  r = (double) rand_r(seed);
+  x = r * (double) max / RAND_MAX;
+  return((int) x);
+}
+
+static long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/*
+ * Switch initialization.
+ * All queues are "uninitialized" (set equal to switch queue) and no user is being timed.
+ * Every user starts with a full window of credits.
+ * The first shard uses the switch queue, the others get a queue of their own.
+ */
+void switch_init(switch_t *s, int sw, int users_number, int service_probability, int shards)
+{
+  int i;
+
+  s->sw = sw;
+  s->users_number = users_number;
+  s->service_probability = service_probability;
+  s->deadproc = 0;
+  s->verbose = 1;
+
+  s->flow_control = 1;
+  s->credit_epoch = 0;
+  s->mailboxes = NULL;
+  s->trace = NULL;
+
+  s->bench = 0;
+  s->registered = 0;
+  s->done = 0;
+  s->drained = 0;
+  s->boot = 0;
+  s->first = 0;
+  s->start = 0;
+  s->end = 0;
+  memset(&s->totals, 0, sizeof(report_t));
+
+  s->routes = malloc((users_number + 1) * sizeof(route_t));
+  s->stats = calloc(users_number + 1, sizeof(route_stats_t));
+  s->credits = malloc((users_number + 1) * sizeof(int));
+  s->waiting = calloc(users_number + 1, sizeof(int));
+  s->groups = calloc(MAXGROUPS, sizeof(group_t));
+  if(s->routes == NULL || s->stats == NULL || s->credits == NULL || s->waiting == NULL || s->groups == NULL){
+    perror("malloc");
+    exit(1);
+  }
+
+  for(i = 0; i <= users_number; i++){
+    s->routes[i].qid = sw;
+    s->routes[i].unreachable = 0;
+    s->routes[i].timing = 0;
+    s->routes[i].timing_start = 0;
+    s->credits[i] = CREDIT_WINDOW;
+  }
+
+  for(i = 0; i < MAXGROUPS; i++){
+    pthread_rwlock_init(&s->groups[i].lock, NULL);
+  }
+
+  s->shards = shards;
+  for(i = 0; i < shards; i++){
+    s->shard[i].s = s;
+    s->shard[i].id = i;
+    s->shard[i].sw = i ? create_queue(IPC_PRIVATE) : sw;
+    s->shard[i].seed = random();
+    s->shard[i].routed = 0;
+    s->shard[i].dropped = 0;
+    s->shard[i].deferred = 0;
+    s->shard[i].unreachable = 0;
+    s->shard[i].held = 0;
+    s->shard[i].timings = 0;
+    s->shard[i].multicasts = 0;
+    histogram_init(&s->shard[i].timing);
+    memset(s->shard[i].services, 0, sizeof(s->shard[i].services));
+    s->shard[i].bad_services = 0;
+    s->shard[i].waiting_number = 0;
+    s->shard[i].credit_epoch = 0;
+    s->shard[i].disconnected = 0;
+    s->shard[i].journal = NULL;
+    s->shard[i].journal_number = 0;
+    s->shard[i].finished = 0;
+    s->shard[i].members = NULL;
+    s->shard[i].members_size = 0;
+    s->shard[i].blocked = calloc(users_number / 8 + 1, 1);
+    s->shard[i].resolved = malloc(MAXDEFERRED * sizeof(int));
+    if(s->shard[i].blocked == NULL || s->shard[i].resolved == NULL){
+      perror("malloc");
+      exit(1);
+    }
+  }
+}
+
+/* The queue of the switch is removed by the caller, the journals are kept and the trace is written */
+/* Messages still waiting for credits are lost with their recipients */
+void switch_free(switch_t *s)
+{
+  int i, j;
+
+  for(i = 1; i < s->shards; i++){
+    remove_queue(s->shard[i].sw);
+  }
+
+  for(i = 0; i < s->shards; i++){
+    if(s->shard[i].journal != NULL){
+      journal_commit(s->shard[i].journal);
+      journal_close(s->shard[i].journal);
+      free(s->shard[i].journal);
+      s->shard[i].journal = NULL;
+    }
+  }
+
+  for(i = 0; i < s->shards; i++){
+    for(j = 0; j < s->shard[i].waiting_number; j++){
+      free(s->shard[i].waiting[j]);
+    }
+    s->shard[i].waiting_number = 0;
+    free(s->shard[i].members);
+    s->shard[i].members = NULL;
+    s->shard[i].members_size = 0;
+    free(s->shard[i].blocked);
+    s->shard[i].blocked = NULL;
+    free(s->shard[i].resolved);
+    s->shard[i].resolved = NULL;
+  }
+
+  if(s->mailboxes != NULL){
+    mailbox_destroy(s->mailboxes);
+    s->mailboxes = NULL;
+  }
+
+  if(s->trace != NULL){
+    trace_close(s->trace);
+    s->trace = NULL;
+  }
+
+  for(i = 0; i < MAXGROUPS; i++){
+    pthread_rwlock_destroy(&s->groups[i].lock);
+    free(s->groups[i].members);
+  }
+  free(s->groups);
+  s->groups = NULL;
+
+  free(s->routes);
+  s->routes = NULL;
+  free(s->stats);
+  s->stats = NULL;
+  free(s->credits);
+  s->credits = NULL;
+  free(s->waiting);
+  s->waiting = NULL;
+}
+
+/*
+ * Termination check.
+ * Returns true when all the users have disconnected.
+ */
+int switch_done(switch_t *s)
+{
+  return __atomic_load_n(&s->deadproc, __ATOMIC_ACQUIRE) == s->users_number;
+}
+
+/*
+ * Route lookup.
+ * Returns the queue of a user, or the switch queue if the user is unknown or unreachable.
+ */
+int switch_lookup(switch_t *s, int user)
+{
+  if(user < 1 || user > s->users_number){
+    return s->sw;
+  }
+
+  /* The entry may belong to another shard, which updates it concurrently */
+  return __atomic_load_n(&s->routes[user].qid, __ATOMIC_ACQUIRE);
+}
+
+/*
+ * Switch queue of a user.
+ * Returns the queue of the shard serving the user, where it must send its messages.
+ */
+int switch_queue(switch_t *s, int user)
+{
+  return s->shard[user % s->shards].sw;
+}
+
+/* Only the shard owning the entry changes its qid */
+static void set_route(route_t *route, int qid)
+{
+  __atomic_store_n(&route->qid, qid, __ATOMIC_RELEASE);
+}
+
+static void group_add(group_t *g, int user)
+{
+  if(g->members_number == g->size){
+    g->size = g->size ? 2 * g->size : 16;
+    if((g->members = realloc(g->members, g->size * sizeof(int))) == NULL){
+      perror("realloc");
+      exit(1);
+    }
+  }
+  g->members[g->members_number++] = user;
+}
+
+/* Adds a user to a group, returns 0 if it already was a member */
+static int group_join(group_t *g, int user)
+{
+  int i, added;
+
+  pthread_rwlock_wrlock(&g->lock);
+
+  for(i = 0; i < g->members_number && g->members[i] != user; i++);
+  if((added = (i == g->members_number))){
+    group_add(g, user);
+  }
+
+  pthread_rwlock_unlock(&g->lock);
+  return added;
+}
+
+/* Removes a user from a group, the last member takes its place */
+/* Returns 0 if it was not a member */
+static int group_leave(group_t *g, int user)
+{
+  int i, found;
+
+  pthread_rwlock_wrlock(&g->lock);
+
+  for(i = 0; i < g->members_number && g->members[i] != user; i++);
+  if((found = (i < g->members_number))){
+    g->members[i] = g->members[--g->members_number];
+  }
+
+  pthread_rwlock_unlock(&g->lock);
+  return found;
+}
+
+/*
+ * Provisioning.
+ * Registers a queue the switch created for a user before starting it,
+ * in place of the messages the user would send to register itself.
+ */
+void switch_provision(switch_t *s, int user, int qid, int group)
+{
+  set_route(&s->routes[user], qid);
+  if(group > GROUP_ALL && group < MAXGROUPS){
+    group_join(&s->groups[group], user);
+  }
+}
+
+/* Tells every user to start the benchmark */
+void switch_start(switch_t *s)
+{
+  int i;
+
+  s->start = now_ns();
+  for(i = 1; i <= s->users_number; i++){
+    switch_send_start(switch_lookup(s, i));
+  }
+}
+
+/* The first text message routed after a cold start */
+static void first_routed(switch_t *s)
+{
+  long long none = 0;
+
+  __atomic_compare_exchange_n(&s->first, &none, now_ns(), 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+}
+
+/* Bytes of a waiting message in the journal, its type included */
+static int waiting_length(deferred_t *d)
+{
+  return offsetof(messagebuf_t, mtext) + message_length(&d->message);
+}
+
+/* Writes the state of the shard in a journal, a shard holds far less than a journal */
+static void shard_snapshot(shard_t *sh, journal_t *j)
+{
+  switch_t *s = sh->s;
+  group_t *g;
+  deferred_t *d;
+  int i, m;
+
+  for(i = sh->id; i <= s->users_number; i += s->shards){
+    if(i > 0 && s->routes[i].qid != s->sw){
+      journal_append(j, JOURNAL_QID, i, s->routes[i].qid, NULL, 0);
+    }
+    if(i > 0 && s->routes[i].timing){
+      journal_append(j, JOURNAL_TIMING, i, s->routes[i].timing_start, NULL, 0);
+    }
+  }
+
+  if(sh->disconnected){
+    journal_append(j, JOURNAL_DISCONNECT, 0, sh->disconnected, NULL, 0);
+  }
+
+  for(i = GROUP_ALL + 1; i < MAXGROUPS; i++){
+    g = &s->groups[i];
+    pthread_rwlock_rdlock(&g->lock);
+    for(m = 0; m < g->members_number; m++){
+      if(g->members[m] % s->shards == sh->id){
+        journal_append(j, JOURNAL_JOIN, g->members[m], i, NULL, 0);
+      }
+    }
+    pthread_rwlock_unlock(&g->lock);
+  }
+
+  for(i = 0; i < sh->waiting_number; i++){
+    d = sh->waiting[i];
+    journal_append(j, JOURNAL_WAITING, d->recipient, d->number, &d->message, waiting_length(d));
+  }
+}
+
+/*
+ * Checkpoint.
+ * A full journal is replaced by a new one holding only the current state
+ * of the shard. The old one stays valid until the new one is complete.
+ */
+static void shard_checkpoint(shard_t *sh)
+{
+  switch_t *s = sh->s;
+  journal_t next;
+
+  journal_create(&next, sh->journal->path, s->users_number, s->shards, sh->sw);
+  shard_snapshot(sh, &next);
+  journal_commit(&next);
+  journal_install(&next);
+
+  journal_close(sh->journal);
+  *sh->journal = next;
+}
+
+/*
+ * Journal record.
+ * Called once the state has been changed, so that the journal written in
+ * place of a full one already holds the change.
+ */
+static void shard_note(shard_t *sh, int type, int user, int data, void *payload, int length)
+{
+  if(sh->journal != NULL && !journal_append(sh->journal, type, user, data, payload, length)){
+    shard_checkpoint(sh);
+  }
+}
+
+/* A user of the shard is gone: the shards drop the messages waiting for it */
+static void remove_route(shard_t *sh, int user)
+{
+  switch_t *s = sh->s;
+
+  set_route(&s->routes[user], s->sw);
+  __atomic_add_fetch(&s->credit_epoch, 1, __ATOMIC_RELEASE);
+  shard_note(sh, JOURNAL_GONE, user, 0, NULL, 0);
+}
+
+/* Takes the credits for a message of the given length, if the user has enough */
+static int take_credits(int *credits, int bytes)
+{
+  int c = __atomic_load_n(credits, __ATOMIC_RELAXED);
+
+  while(c >= bytes){
+    if(__atomic_compare_exchange_n(credits, &c, c - bytes, 1, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)){
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * Credits given back.
+ * Shards sleeping in the kernel may keep text messages waiting for them:
+ * they are woken up, unless their queue is full as they are not sleeping then.
+ */
+static void return_credits(shard_t *sh, int user, int bytes)
+{
+  switch_t *s = sh->s;
+  int i;
+
+  __atomic_add_fetch(&s->credits[user], bytes, __ATOMIC_RELEASE);
+  __atomic_add_fetch(&s->credit_epoch, 1, __ATOMIC_RELEASE);
+
+  if(s->shards > 1 && __atomic_load_n(&s->waiting[user], __ATOMIC_ACQUIRE)){
+    for(i = 0; i < s->shards; i++){
+      if(i != sh->id){
+        switch_try_send_wakeup(s->shard[i].sw);
+      }
+    }
+  }
+}
+
+/* A text message, or the reference to a group message */
+static int send_text(messagebuf_t *in, int qid)
+{
+  if(get_type(in) == TYPE_GROUP){
+    return switch_send_group_reference(in, qid);
+  }
+  return switch_send_text_message(in, qid);
+}
+
+static int try_send_text(messagebuf_t *in, int qid)
+{
+  if(get_type(in) == TYPE_GROUP){
+    return switch_try_send_group_reference(in, qid);
+  }
+  return switch_try_send_text_message(in, qid);
+}
+
+/*
+ * Sending with credits.
+ * Sends a text message to a user only if it has credits for it, and gives
+ * them back if its queue is full anyway.
+ * Returns the result of try_send_message, 0 without credits.
+ */
+static int send_with_credits(switch_t *s, messagebuf_t *in, int qid, int recipient)
+{
+  int bytes = message_length(in);
+  int result;
+
+  if(!take_credits(&s->credits[recipient], bytes)){
+    return 0;
+  }
+
+  if((result = try_send_text(in, qid)) != 1){
+    __atomic_add_fetch(&s->credits[recipient], bytes, __ATOMIC_RELEASE);
+  }
+  return result;
+}
+
+/*
+ * Forwarding.
+ * Without flow control the switch waits for room in the queue of the
+ * recipient, and a single slow user stops it. Otherwise the message is
+ * sent at once if the recipient has credits for it and nothing older is
+ * waiting for it; if not, it waits in the shard until the recipient gives
+ * credits back. It is dropped if MAXWAITING messages already wait for the
+ * recipient or the shard already keeps MAXDEFERRED messages. The switch
+ * never waits for a user.
+ */
+static int forward(shard_t *sh, messagebuf_t *in, int qid, int recipient)
+{
+  switch_t *s = sh->s;
+  deferred_t *d;
+  int result;
+
+  if(!s->flow_control){
+    return send_text(in, qid) == -1 ? FORWARD_GONE : FORWARD_SENT;
+  }
+
+  /* Messages to a user keep their order */
+  if(!__atomic_load_n(&s->waiting[recipient], __ATOMIC_ACQUIRE)){
+    if((result = send_with_credits(s, in, qid, recipient)) != 0){
+      return result == 1 ? FORWARD_SENT : FORWARD_GONE;
+    }
+  }
+
+  if(sh->waiting_number == MAXDEFERRED || __atomic_load_n(&s->waiting[recipient], __ATOMIC_RELAXED) >= MAXWAITING){
+    return FORWARD_DROPPED;
+  }
+
+  if((d = malloc(offsetof(deferred_t, message.mtext) + message_length(in))) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  d->recipient = recipient;
+  d->number = ++sh->journal_number;
+  memcpy(&d->message, in, offsetof(messagebuf_t, mtext) + message_length(in));
+
+  sh->waiting[sh->waiting_number++] = d;
+  __atomic_add_fetch(&s->waiting[recipient], 1, __ATOMIC_RELEASE);
+  shard_note(sh, JOURNAL_WAITING, recipient, d->number, &d->message, waiting_length(d));
+
+  return FORWARD_WAITING;
+}
+
+/*
+ * Waiting messages.
+ * Tries again the messages waiting for credits, oldest first, whenever some
+ * user gave credits back or went away since the last time. A message that
+ * still cannot be sent holds back the later ones to the same recipient: its
+ * bit is set in the blocked map of the shard, and cleared once all the
+ * messages have been tried, so a retry costs O(waiting).
+ * The resolved messages are journaled once the list is whole again, since
+ * the journal may take a checkpoint of it.
+ */
+static void shard_retry(shard_t *sh)
+{
+  switch_t *s = sh->s;
+  deferred_t *d;
+  route_stats_t *stats;
+  unsigned char *blocked = sh->blocked;
+  int resolved_number = 0;
+  int epoch, result, qid, r, i, n = 0;
+
+  if(!sh->waiting_number){
+    return;
+  }
+
+  epoch = __atomic_load_n(&s->credit_epoch, __ATOMIC_ACQUIRE);
+  if(epoch == sh->credit_epoch){
+    return;
+  }
+  sh->credit_epoch = epoch;
+
+  for(i = 0; i < sh->waiting_number; i++){
+    d = sh->waiting[i];
+    r = d->recipient;
+
+    if(blocked[r >> 3] & (1 << (r & 7))){
+      sh->waiting[n++] = d;
+      continue;
+    }
+
+    qid = switch_lookup(s, r);
+    result = (qid == s->sw) ? -1 : send_with_credits(s, &d->message, qid, r);
+    if(!result){
+      blocked[r >> 3] |= 1 << (r & 7);
+      sh->waiting[n++] = d;
+      continue;
+    }
+
+    /* The sender may be a user of another shard, which counts for it at the same time, */
+    /* when the message has been deferred out of a mailbox */
+    stats = &s->stats[get_sender(&d->message)];
+    if(result == 1){
+      sh->routed++;
+      __atomic_add_fetch(&stats->routed, 1, __ATOMIC_RELAXED);
+    }
+    else{
+      sh->unreachable++;
+      __atomic_add_fetch(&stats->unreachable, 1, __ATOMIC_RELAXED);
+
+      /* Nobody will read the text of a group message */
+      if(get_type(&d->message) == TYPE_GROUP){
+        pool_release(get_service_data(&d->message));
+      }
+    }
+
+    __atomic_sub_fetch(&s->waiting[r], 1, __ATOMIC_RELEASE);
+    sh->resolved[resolved_number++] = d->number;
+    free(d);
+  }
+
+  sh->waiting_number = n;
+
+  /* Only the recipients of the messages kept can have their bit set */
+  for(i = 0; i < n; i++){
+    r = sh->waiting[i]->recipient;
+    blocked[r >> 3] &= ~(1 << (r & 7));
+  }
+
+  for(i = 0; i < resolved_number; i++){
+    shard_note(sh, JOURNAL_RESOLVED, 0, sh->resolved[i], NULL, 0);
+  }
+}
+
+/*
+ * Recovery.
+ * Rebuilds the state of the shards from the journals written under path
+ * by a switch with the same users and shards: the routes of the users,
+ * the groups, the users being timed and the text messages waiting for
+ * credits. A shard takes back its queue, where its users kept sending.
+ * Returns the number of records read, -1 if a journal is missing.
+ */
+int switch_recover(switch_t *s, char *path)
+{
+  shard_t *sh;
+  journal_t j;
+  journal_header_t *h;
+  journal_record_t *r;
+  deferred_t *d;
+  char name[256];
+  long pos;
+  int messages, bytes;
+  int i, k, records = 0;
+
+  for(i = 0; i < s->shards; i++){
+    sh = &s->shard[i];
+    snprintf(name, sizeof(name), "%s.%d", path, i);
+    if(journal_open(&j, name) == -1){
+      return -1;
+    }
+
+    h = journal_header(&j);
+    if(h->users_number != s->users_number || h->shards != s->shards){
+      fprintf(stderr, "%s: journal of %d users and %d shards\n", name, h->users_number, h->shards);
+      journal_close(&j);
+      return -1;
+    }
+
+    if(i && h->qid != sh->sw && queue_stat(h->qid, &messages, &bytes) != -1){
+      remove_queue(sh->sw);
+      sh->sw = h->qid;
+    }
+
+    pos = 0;
+    while((r = journal_next(&j, &pos)) != NULL){
+      records++;
+      if(r->user < 0 || r->user > s->users_number){
+        continue;
+      }
+
+      switch(r->type){
+      case JOURNAL_QID:
+        s->routes[r->user].qid = r->data;
+        break;
+
+      case JOURNAL_GONE:
+        s->routes[r->user].qid = s->sw;
+        break;
+
+      case JOURNAL_DISCONNECT:
+        sh->disconnected += r->data;
+        s->deadproc += r->data;
+        break;
+
+      case JOURNAL_JOIN:
+      case JOURNAL_LEAVE:
+        if(r->data <= GROUP_ALL || r->data >= MAXGROUPS){
+          break;
+        }
+        if(r->type == JOURNAL_JOIN){
+          group_add(&s->groups[r->data], r->user);
+        }
+        else{
+          group_leave(&s->groups[r->data], r->user);
+        }
+        break;
+
+      case JOURNAL_TIMING:
+        s->routes[r->user].timing = 1;
+        s->routes[r->user].timing_start = r->data;
+        break;
+
+      case JOURNAL_TIMED:
+        s->routes[r->user].timing = 0;
+        break;
+
+      case JOURNAL_WAITING:
+        if(sh->waiting_number == MAXDEFERRED){
+          break;
+        }
+        if((d = malloc(offsetof(deferred_t, message) + r->length)) == NULL){
+          perror("malloc");
+          exit(1);
+        }
+        d->recipient = r->user;
+        d->number = r->data;
+        memcpy(&d->message, r->payload, r->length);
+
+        sh->waiting[sh->waiting_number++] = d;
+        s->waiting[r->user]++;
+        if(r->data > sh->journal_number){
+          sh->journal_number = r->data;
+        }
+        break;
+
+      case JOURNAL_RESOLVED:
+        for(k = 0; k < sh->waiting_number && sh->waiting[k]->number != r->data; k++);
+        if(k < sh->waiting_number){
+          s->waiting[sh->waiting[k]->recipient]--;
+          free(sh->waiting[k]);
+          memmove(&sh->waiting[k], &sh->waiting[k + 1], (sh->waiting_number - k - 1) * sizeof(deferred_t *));
+          sh->waiting_number--;
+        }
+        break;
+      }
+    }
+
+    journal_close(&j);
+  }
+
+  /* The shards try the waiting messages as soon as they start */
+  s->credit_epoch++;
+
+  return records;
+}
+
+/*
+ * Journal.
+ * From now on every shard keeps a journal of its state in the file named
+ * after path and its number, starting with the state it has now.
+ */
+void switch_journal(switch_t *s, char *path)
+{
+  shard_t *sh;
+  char name[256];
+  int i;
+
+  for(i = 0; i < s->shards; i++){
+    sh = &s->shard[i];
+    if((sh->journal = malloc(sizeof(journal_t))) == NULL){
+      perror("malloc");
+      exit(1);
+    }
+
+    snprintf(name, sizeof(name), "%s.%d", path, i);
+    journal_create(sh->journal, name, s->users_number, s->shards, sh->sw);
+    shard_snapshot(sh, sh->journal);
+    journal_commit(sh->journal);
+    journal_install(sh->journal);
+  }
+}
+
+/* Group commit: the records of a batch of messages become valid at once */
+void switch_commit(shard_t *sh)
+{
+  if(sh->journal != NULL){
+    journal_commit(sh->journal);
+  }
+}
+
+/*
+ * Mailbox delivery.
+ * Forwards to a user that has a queue the text messages kept for it, oldest
+ * first, like any other text message: they may wait for credits or be dropped.
+ * Called by the shard of the user when it sends its queue, and by a shard that
+ * kept a message just as the user sent it, so that no message stays behind.
+ */
+static void deliver_mailbox(shard_t *sh, int user)
+{
+  switch_t *s = sh->s;
+  mail_t *first, *mail;
+  route_stats_t *stats;
+  int qid, result, n = 0;
+
+  if(s->mailboxes == NULL || (first = mailbox_take(s->mailboxes, user)) == NULL){
+    return;
+  }
+
+  qid = switch_lookup(s, user);
+  for(mail = first; mail != NULL; mail = mail->next, n++){
+    result = (qid == s->sw) ? FORWARD_GONE : forward(sh, &mail->message, qid, user);
+
+    /* The senders may be users of any shard */
+    stats = &s->stats[get_sender(&mail->message)];
+    if(result == FORWARD_SENT){
+      sh->routed++;
+      __atomic_add_fetch(&stats->routed, 1, __ATOMIC_RELAXED);
+    }
+    else if(result == FORWARD_WAITING){
+      sh->deferred++;
+      __atomic_add_fetch(&stats->deferred, 1, __ATOMIC_RELAXED);
+    }
+    else if(result == FORWARD_DROPPED){
+      sh->dropped++;
+      __atomic_add_fetch(&stats->dropped, 1, __ATOMIC_RELAXED);
+    }
+    else{
+      sh->unreachable++;
+      __atomic_add_fetch(&stats->unreachable, 1, __ATOMIC_RELAXED);
+    }
+  }
+  mailbox_release(s->mailboxes, first);
+
+  if(s->verbose){
+    log_event(EVENT_MAILBOX, user, n, 0, 0, NULL);
+  }
+}
+
+/*
+ * Service handlers.
+ * Each one processes a service message of its own kind sent by a user of the
+ * shard, once switch_service has checked the sender.
+ */
+
+/* A new user has connected */
+static void service_connect(shard_t *sh, messagebuf_t *in, int sender)
+{
+  if(sh->s->verbose){
+    log_event(EVENT_CONNECT, sender, 0, 0, 0, NULL);
+  }
+}
+
+/* The user is terminating, the last one wakes up the other shards, so that they can stop */
+static void service_disconnect(shard_t *sh, messagebuf_t *in, int sender)
+{
+  switch_t *s = sh->s;
+  int i;
+
+  if(s->verbose){
+    log_event(EVENT_DISCONNECT, sender, 0, 0, 0, NULL);
+  }
+  sh->disconnected++;
+  shard_note(sh, JOURNAL_DISCONNECT, sender, 1, NULL, 0);
+
+  if(__atomic_add_fetch(&s->deadproc, 1, __ATOMIC_ACQ_REL) == s->users_number){
+    for(i = 0; i < s->shards; i++){
+      if(i != sh->id){
+        switch_send_terminate(s->shard[i].sw);
+      }
+    }
+  }
+}
+
+/* The user is sending us its queue id */
+static void service_qid(shard_t *sh, messagebuf_t *in, int sender)
+{
+  switch_t *s = sh->s;
+  int qid = get_service_data(in);
+
+  if(s->verbose){
+    log_event(EVENT_QID, sender, qid, 0, 0, NULL);
+  }
+  set_route(&s->routes[sender], qid);
+  shard_note(sh, JOURNAL_QID, sender, qid, NULL, 0);
+
+  /* Messages sent to the user while it had no queue */
+  deliver_mailbox(sh, sender);
+
+  /* In a benchmark, the last user to register starts everybody */
+  if(s->bench && __atomic_add_fetch(&s->registered, 1, __ATOMIC_ACQ_REL) == s->users_number){
+    switch_start(s);
+  }
+}
+
+/* The user stopped sending, the last one wakes up the other shards to end the benchmark */
+static void service_done(shard_t *sh, messagebuf_t *in, int sender)
+{
+  switch_t *s = sh->s;
+  int i;
+
+  if(__atomic_add_fetch(&s->done, 1, __ATOMIC_ACQ_REL) == s->users_number){
+    s->end = now_ns();
+    for(i = 0; i < s->shards; i++){
+      if(i != sh->id){
+        switch_send_terminate(s->shard[i].sw);
+      }
+    }
+  }
+}
+
+static void service_report(shard_t *sh, messagebuf_t *in, int sender)
+{
+  switch_t *s = sh->s;
+  report_t report;
+
+  /* A report of another size is not one of ours, reading it would overflow report */
+  if(get_text_length(in) != sizeof(report_t)){
+    sh->bad_services++;
+    return;
+  }
+  get_payload(in, (char *) &report, sizeof(report_t));
+  __atomic_add_fetch(&s->totals.sent, report.sent, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->totals.rejected, report.rejected, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->totals.received, report.received, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&s->totals.late, report.late, __ATOMIC_RELAXED);
+}
+
+/* The user read some text messages and had nothing to send */
+static void service_credit(shard_t *sh, messagebuf_t *in, int sender)
+{
+  return_credits(sh, sender, get_service_data(in));
+}
+
+/*
+ * Every user is a member of group 0, the others are joined and left.
+ * Only actual changes are journaled, so that recovery needs not look for duplicates.
+ */
+static void service_join(shard_t *sh, messagebuf_t *in, int sender)
+{
+  switch_t *s = sh->s;
+  int group = get_service_data(in);
+
+  if(group <= GROUP_ALL || group >= MAXGROUPS){
+    return;
+  }
+  if(group_join(&s->groups[group], sender)){
+    shard_note(sh, JOURNAL_JOIN, sender, group, NULL, 0);
+  }
+  if(s->verbose){
+    log_event(EVENT_JOIN, sender, group, 0, 0, NULL);
+  }
+}
+
+static void service_leave(shard_t *sh, messagebuf_t *in, int sender)
+{
+  switch_t *s = sh->s;
+  int group = get_service_data(in);
+
+  if(group <= GROUP_ALL || group >= MAXGROUPS){
+    return;
+  }
+  if(group_leave(&s->groups[group], sender)){
+    shard_note(sh, JOURNAL_LEAVE, sender, group, NULL, 0);
+  }
+  if(s->verbose){
+    log_event(EVENT_LEAVE, sender, group, 0, 0, NULL);
+  }
+}
+
+/* The answer to a time request */
+static void service_time(shard_t *sh, messagebuf_t *in, int sender)
+{
+  switch_t *s = sh->s;
+  route_t *route = &s->routes[sender];
+
+  /* The answer carries back the stamp of the request */
+  set_stamp(in, STAMP_SWITCH_IN);
+  if(get_stamp(in, STAMP_SWITCH_OUT)){
+    histogram_add(&sh->timing, get_stamp(in, STAMP_SWITCH_IN) - get_stamp(in, STAMP_SWITCH_OUT));
+  }
+
+  /* Timing informations */
+  route->timing_start = get_service_data(in) - route->timing_start;
+
+  if(s->verbose){
+    log_event(EVENT_TIMING, sender, route->timing_start, 0, 0, NULL);
+  }
+
+  /* The user is no more blocked by a timing operation */
+  route->timing = 0;
+  shard_note(sh, JOURNAL_TIMED, sender, 0, NULL, 0);
+}
+
+/* The services a user can request, the others are only sent by the switch */
+static void (*const service_handlers[SERVICES])(shard_t *sh, messagebuf_t *in, int sender) = {
+  [SERVICE_TIME] = service_time,
+  [SERVICE_CONNECT] = service_connect,
+  [SERVICE_DISCONNECT] = service_disconnect,
+  [SERVICE_QID] = service_qid,
+  [SERVICE_DONE] = service_done,
+  [SERVICE_REPORT] = service_report,
+  [SERVICE_CREDIT] = service_credit,
+  [SERVICE_JOIN] = service_join,
+  [SERVICE_LEAVE] = service_leave
+};
+
+/*
+ * Service message.
+ * Processes a service message sent by a user of the shard, through the
+ * handler of its service.
+ */
+void switch_service(shard_t *sh, messagebuf_t *in)
+{
+  switch_t *s = sh->s;
+  int msg_sender;
+  int msg_service;
+
+  msg_service = get_service(in);
+  msg_sender = get_sender(in);
+
+  /* Messages of the switch itself only wake the shard up */
+  if(msg_sender < 1 || msg_sender > s->users_number){
+    return;
+  }
+
+  if(msg_service < 0 || msg_service >= SERVICES){
+    sh->bad_services++;
+    return;
+  }
+
+  sh->services[msg_service]++;
+  if(service_handlers[msg_service] != NULL){
+    service_handlers[msg_service](sh, in, msg_sender);
+  }
+}
+
+/*
+ * Text message.
+ * Forwards a text message sent by a user of the shard to its recipient,
+ * whatever shard serves it, and randomly requests a service to the sender.
+ */
+void switch_route(shard_t *sh, messagebuf_t *in)
+{
+  switch_t *s = sh->s;
+  int msg_sender;
+  int msg_recipient;
+  int qid;
+  char msg_text[MAX_TEXT_LENGTH + 1];
+  route_t *sender;
+  route_stats_t *stats;
+  int result;
+
+  set_stamp(in, STAMP_SWITCH_IN);
+  msg_recipient = get_recipient(in);
+  msg_sender = get_sender(in);
+
+  /* The text is only needed by the log */
+  if(s->verbose){
+    get_text(in, msg_text);
+  }
+
+  if(msg_sender < 1 || msg_sender > s->users_number){
+    return;
+  }
+  sender = &s->routes[msg_sender];
+  stats = &s->stats[msg_sender];
+
+  if(s->trace != NULL){
+    trace_add(s->trace, sh->id, get_stamp(in, STAMP_SEND), msg_sender, msg_recipient);
+  }
+
+  /* The message may carry credits of the sender */
+  if(get_service_data(in) > 0){
+    return_credits(sh, msg_sender, get_service_data(in));
+  }
+
+  /* If the destination is connected */
+  if((qid = switch_lookup(s, msg_recipient)) != s->sw){
+    /* Send the message (forward it) */
+    result = forward(sh, in, qid, msg_recipient);
+    if(result == FORWARD_DROPPED){
+      sh->dropped++;
+      __atomic_add_fetch(&stats->dropped, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    else if(result == FORWARD_GONE){
+      /* The recipient has just been terminated by another shard */
+      sh->unreachable++;
+      __atomic_add_fetch(&stats->unreachable, 1, __ATOMIC_RELAXED);
+      return;
+    }
+    else if(result == FORWARD_WAITING){
+      sh->deferred++;
+      __atomic_add_fetch(&stats->deferred, 1, __ATOMIC_RELAXED);
+    }
+    else{
+      sh->routed++;
+      __atomic_add_fetch(&stats->routed, 1, __ATOMIC_RELAXED);
+      if(!__atomic_load_n(&s->first, __ATOMIC_RELAXED)){
+        first_routed(s);
+      }
+    }
+
+    if(s->verbose){
+      log_event(EVENT_ROUTE, msg_sender, msg_recipient, 0, 0, msg_text);
+    }
+  }
+  else if(s->mailboxes != NULL && msg_recipient >= 1 && msg_recipient <= s->users_number &&
+          mailbox_put(s->mailboxes, msg_recipient, in)){
+    /* The recipient may get a queue later: its mailbox is delivered then */
+    sh->held++;
+    stats->held++;
+
+    if(s->verbose){
+      log_event(EVENT_HELD, msg_sender, msg_recipient, 0, 0, msg_text);
+    }
+
+    /* It may have sent its queue after the lookup, and its shard found the mailbox empty */
+    if(switch_lookup(s, msg_recipient) != s->sw){
+      deliver_mailbox(sh, msg_recipient);
+    }
+  }
+  else{
+    sh->unreachable++;
+    __atomic_add_fetch(&stats->unreachable, 1, __ATOMIC_RELAXED);
+    sender->unreachable += 1;
+
+    if (s->bench || sender->unreachable > MAXFAILS) {
+      return;
+    }
+
+    if(s->verbose){
+      log_event(EVENT_UNREACHABLE, msg_sender, msg_recipient, sender->unreachable, MAXFAILS, msg_text);
+    }
+
+    if (sender->unreachable == MAXFAILS) {
+      if(s->verbose){
+        log_event(EVENT_MAXFAILS, msg_sender, 0, 0, 0, NULL);
+      }
+
+      switch_send_terminate(sender->qid);
+      stats->terminations++;
+
+      /* Remove its queue from the list */
+      remove_route(sh, msg_sender);
+    }
+  }
+
+  /* Randomly request a service to the sender of the last message */
+  if((random_number_r(&sh->seed, 100) < s->service_probability) && (sender->qid != s->sw)){
+    if (!s->bench && random_number_r(&sh->seed, 100) < 40){
+      /* The user must terminate */
+      if(s->verbose){
+        log_event(EVENT_TERMINATE, msg_sender, 0, 0, 0, NULL);
+      }
+
+      switch_send_terminate(sender->qid);
+      stats->terminations++;
+
+      /* Remove its queue from the list */
+      remove_route(sh, msg_sender);
+    }
+    else {
+      /* Check if we are already timing that user */
+      if(!sender->timing){
+        sender->timing = 1;
+        sender->timing_start = (int) time(NULL);
+        if(s->verbose){
+          log_event(EVENT_TIME, msg_sender, 0, 0, 0, NULL);
+        }
+
+        /* The switch does not wait for a slow user to time it */
+        if(switch_try_send_time(sender->qid) != 1){
+          /* Try again with a later message */
+          sender->timing = 0;
+          return;
+        }
+        sh->timings++;
+        stats->timings++;
+        shard_note(sh, JOURNAL_TIMING, msg_sender, sender->timing_start, NULL, 0);
+      }
+    }
+  }
+}
+
+/* Delivers a group message to a member, returns the result of forward() */
+static int deliver(shard_t *sh, messagebuf_t *ref, int member)
+{
+  switch_t *s = sh->s;
+  int qid, result;
+
+  if((qid = switch_lookup(s, member)) == s->sw){
+    result = FORWARD_GONE;
+  }
+  else{
+    result = forward(sh, ref, qid, member);
+  }
+
+  /* The reference of the member is gone unless it has been sent or is waiting */
+  if(result == FORWARD_DROPPED || result == FORWARD_GONE){
+    pool_release(get_service_data(ref));
+  }
+  return result;
+}
+
+/*
+ * Group message.
+ * Stores the text of a group message sent by a user of the shard in the
+ * payload pool, then sends a reference to it to every other member of the
+ * group. Each delivery is counted as a text message routed to the member,
+ * a member without a queue is unreachable and, with flow control, the
+ * message is dropped for everybody if the pool of the shard is full.
+ * The members are copied with the group locked and served once it is
+ * unlocked, so that a member slow to take its message does not hold up
+ * the joins and leaves of the group in every shard.
+ */
+void switch_multicast(shard_t *sh, messagebuf_t *in)
+{
+  switch_t *s = sh->s;
+  group_t *g = NULL;
+  int *members = NULL;
+  messagebuf_t ref;
+  route_stats_t *stats;
+  char msg_text[MAX_TEXT_LENGTH + 1];
+  int msg_sender, msg_group;
+  int members_number, member, slot, result, i;
+
+  set_stamp(in, STAMP_SWITCH_IN);
+  msg_sender = get_sender(in);
+  msg_group = get_service(in);
+
+  if(msg_sender < 1 || msg_sender > s->users_number || msg_group < 0 || msg_group >= MAXGROUPS){
+    return;
+  }
+  stats = &s->stats[msg_sender];
+  sh->multicasts++;
+
+  if(s->trace != NULL){
+    trace_add(s->trace, sh->id, get_stamp(in, STAMP_SEND), msg_sender, -msg_group);
+  }
+
+  /* The message may carry credits of the sender, like a text message */
+  if(get_service_data(in) > 0){
+    return_credits(sh, msg_sender, get_service_data(in));
+  }
+
+  if(msg_group == GROUP_ALL){
+    members_number = s->users_number;
+  }
+  else{
+    g = &s->groups[msg_group];
+    pthread_rwlock_rdlock(&g->lock);
+    members_number = g->members_number;
+    if(members_number > sh->members_size){
+      sh->members_size = g->size;
+      if((sh->members = realloc(sh->members, sh->members_size * sizeof(int))) == NULL){
+        perror("realloc");
+        exit(1);
+      }
+    }
+    memcpy(sh->members, g->members, members_number * sizeof(int));
+    members = sh->members;
+    pthread_rwlock_unlock(&g->lock);
+  }
+
+  /* One reference for each member, and one held until every member has been served */
+  /* Without flow control the switch waits for the members to free a slot */
+  while((slot = pool_store(sh->id, in->mtext.text, get_text_length(in), members_number + 1)) < 0 && !s->flow_control){
+    sched_yield();
+  }
+  switch_group_reference(&ref, in, slot);
+
+  for(i = 0; i < members_number; i++){
+    member = members ? members[i] : i + 1;
+
+    if(member == msg_sender){
+      if(slot >= 0){
+        pool_release(slot);
+      }
+      continue;
+    }
+
+    if(slot < 0){
+      result = FORWARD_DROPPED;
+    }
+    else{
+      result = deliver(sh, &ref, member);
+    }
+
+    if(result == FORWARD_DROPPED){
+      sh->dropped++;
+      __atomic_add_fetch(&stats->dropped, 1, __ATOMIC_RELAXED);
+    }
+    else if(result == FORWARD_GONE){
+      sh->unreachable++;
+      __atomic_add_fetch(&stats->unreachable, 1, __ATOMIC_RELAXED);
+    }
+    else if(result == FORWARD_WAITING){
+      sh->deferred++;
+      __atomic_add_fetch(&stats->deferred, 1, __ATOMIC_RELAXED);
+    }
+    else{
+      sh->routed++;
+      __atomic_add_fetch(&stats->routed, 1, __ATOMIC_RELAXED);
+    }
+  }
+
+  if(slot >= 0){
+    pool_release(slot);
+  }
+
+  if(s->verbose){
+    get_text(in, msg_text);
+    log_event(EVENT_MULTICAST, msg_sender, msg_group, members_number, 0, msg_text);
+  }
+}
+
+/* Processes a message of any type */
+static void shard_dispatch(shard_t *sh, messagebuf_t *in)
+{
+  if(get_type(in) == TYPE_SERVICE){
+    switch_service(sh, in);
+  }
+  else if(get_type(in) == TYPE_GROUP){
+    switch_multicast(sh, in);
+  }
+  else{
+    switch_route(sh, in);
+  }
+}
+
+/*
+ * End of a benchmark.
+ * Once every user stopped sending, all their text messages are in the
+ * queues of the shards. Each shard routes what is left in its own queue
+ * and the messages waiting for credits, waits for the others to do the
+ * same and only then terminates its users, so that no message is forwarded
+ * to a queue that has been removed. Meanwhile it keeps serving its users,
+ * whose credits the other shards may be waiting for.
+ */
+static void shard_finish(shard_t *sh)
+{
+  switch_t *s = sh->s;
+  messagebuf_t in;
+  int i;
+
+  if(!s->bench || sh->finished || __atomic_load_n(&s->done, __ATOMIC_ACQUIRE) < s->users_number){
+    return;
+  }
+  sh->finished = 1;
+
+  while(1){
+    if(receive_next_message(sh->sw, &in)){
+      shard_dispatch(sh, &in);
+    }
+    else if(!sh->waiting_number){
+      break;
+    }
+    else{
+      sched_yield();
+    }
+    shard_retry(sh);
+    switch_commit(sh);
+  }
+
+  __atomic_add_fetch(&s->drained, 1, __ATOMIC_ACQ_REL);
+  while(__atomic_load_n(&s->drained, __ATOMIC_ACQUIRE) < s->shards){
+    if(receive_next_message(sh->sw, &in)){
+      shard_dispatch(sh, &in);
+      switch_commit(sh);
+    }
+    else{
+      sched_yield();
+    }
+  }
+
+  for(i = sh->id; i <= s->users_number; i += s->shards){
+    if(i > 0){
+      switch_send_terminate(switch_lookup(s, i));
+    }
+  }
+}
+
+/* Ring of the event log of a shard, after those of the users */
+static int shard_ring(shard_t *sh)
+{
+  return sh->id ? sh->s->users_number + sh->id : 0;
+}
+
+/*
+ * Polling loop.
+ * Reads a batch of messages without ever blocking, so it keeps a core busy
+ * even when no user is talking. Every read takes a service message if there
+ * is one, so they do not wait behind the text messages in the queue.
+ */
+static void *shard_polling(void *arg)
+{
+  shard_t *sh = arg;
+  messagebuf_t in[SWITCH_BATCH];
+  int i, n;
+
+  bind_queue(sh->sw);
+  log_bind(shard_ring(sh));
+
+  while(1){
+    n = receive_next_messages(sh->sw, in, SWITCH_BATCH);
+    for(i = 0; i < n; i++){
+      shard_dispatch(sh, &in[i]);
+    }
+
+    if(!n && switch_done(sh->s)){
+      flush_messages();
+      return NULL;
+    }
+
+    shard_retry(sh);
+    switch_commit(sh);
+    shard_finish(sh);
+  }
+}
+
+/*
+ * Event-driven loop.
+ * Sleeps in the kernel until a message of any type arrives. Service messages
+ * are processed first, text messages in arrival order.
+ */
+static void *shard_event(void *arg)
+{
+  shard_t *sh = arg;
+  messagebuf_t in;
+
+  bind_queue(sh->sw);
+  log_bind(shard_ring(sh));
+
+  while(!switch_done(sh->s)){
+    if(!receive_next_message_wait(sh->sw, &in)){
+      continue;
+    }
+
+    shard_dispatch(sh, &in);
+    shard_retry(sh);
+    switch_commit(sh);
+    shard_finish(sh);
+  }
+
+  flush_messages();
+  return NULL;
+}
+
+/*
+ * Shards.
+ * A single shard runs in the calling thread, otherwise each one gets a
+ * thread and the function returns when all of them are done.
+ */
+static void run_shards(switch_t *s, void *(*loop)(void *))
+{
+  int i;
+
+  if(s->shards == 1){
+    loop(&s->shard[0]);
+    return;
+  }
+
+  for(i = 0; i < s->shards; i++){
+    if(pthread_create(&s->shard[i].thread, NULL, loop, &s->shard[i])){
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  for(i = 0; i < s->shards; i++){
+    pthread_join(s->shard[i].thread, NULL);
+  }
+}
+
+void switch_run_polling(switch_t *s)
+{
+  run_shards(s, shard_polling);
+}
+
+void switch_run_event(switch_t *s)
+{
+  run_shards(s, shard_event);
+}
+
+/*
+ * Benchmark report.
+ * Rates are computed on the time between the start signal and the last user stopping.
+ */
+void switch_print_report(switch_t *s)
+{
+  long routed = 0, dropped = 0, deferred = 0, unreachable = 0, timings = 0, multicasts = 0;
+  double seconds;
+  int i;
+
+  for(i = 0; i < s->shards; i++){
+    routed += s->shard[i].routed;
+    dropped += s->shard[i].dropped;
+    deferred += s->shard[i].deferred;
+    unreachable += s->shard[i].unreachable;
+    timings += s->shard[i].timings;
+    multicasts += s->shard[i].multicasts;
+  }
+
+  seconds = (s->end - s->start) / 1e9;
+
+  if(s->boot){
+    printf("Cold start: users started after %.1f ms, first text message routed after %.1f ms\n",
+           (s->start - s->boot) / 1e6, (s->first - s->boot) / 1e6);
+  }
+  printf("Measured time: %.3f s\n", seconds);
+  printf("Text messages sent: %ld (%.0f msgs/s)\n", s->totals.sent, s->totals.sent / seconds);
+  printf("Rejected by a full switch queue: %ld\n", s->totals.rejected);
+  printf("Sent late: %ld\n", s->totals.late);
+  if(multicasts){
+    printf("Group messages: %ld, each routed to every member\n", multicasts);
+  }
+  printf("Routed: %ld (%.0f msgs/s)\n", routed, routed / seconds);
+  printf("Waited for credits: %ld\n", deferred);
+  printf("Dropped by the switch: %ld\n", dropped);
+  printf("Unreachable: %ld\n", unreachable);
+  switch_print_mailboxes(s);
+  printf("Received: %ld\n", s->totals.received);
+  printf("Timing requests: %ld\n", timings);
+}
+
+/* Messages to users without a queue, if the switch keeps them */
+void switch_print_mailboxes(switch_t *s)
+{
+  mailboxes_t *m = s->mailboxes;
+
+  if(m != NULL){
+    printf("Held in mailboxes: %ld, delivered %ld, evicted %ld, refused %ld, %ld KB of slabs\n", m->held,
+           m->delivered, m->evicted, m->refused, m->bytes / 1024);
+  }
+}
+
+/* Round trip of the timing requests of all the shards */
+void switch_print_latency(switch_t *s)
+{
+  histogram_t timing;
+  int i;
+
+  histogram_init(&timing);
+  for(i = 0; i < s->shards; i++){
+    histogram_merge(&timing, &s->shard[i].timing);
+  }
+
+  histogram_print("timing request", &timing);
+}
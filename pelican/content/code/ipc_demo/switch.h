@@ -0,0 +1,165 @@
+#include <pthread.h>
+
+#define MINCHILDS 1
+#define MAXCHILDS 100000
+
+#define MAXFAILS 10
+
+#define MAXSHARDS 64
+
+/* Messages a polling shard reads at once, a service message waits at most for this many */
+#define SWITCH_BATCH 8
+
+/* Text messages a shard keeps while their recipients have no credits */
+#define MAXDEFERRED 1024
+
+/* Text messages to a single user kept by all the shards, so that a slow user */
+/* does not take the room of the others */
+#define MAXWAITING 64
+
+/* Routing table entry, one per user, indexed by the user number */
+/* Entries are packed in 16 bytes, so that a cache line holds four of them */
+
+typedef struct
+{
+  int qid; /* Queue of the user, the qid of the switch if it is unreachable */
+  int unreachable; /* Messages sent by the user to unreachable destinations */
+  int timing; /* Set while the switch is timing the user */
+  int timing_start; /* Time of the timing request */
+} route_t;
+
+/* Counters of a user, changed by the shard serving it */
+/* Another shard may count the messages that waited for credits or in a mailbox, */
+/* so routed, dropped, deferred and unreachable are only changed atomically */
+
+typedef struct
+{
+  long routed; /* Text messages of the user forwarded */
+  long dropped; /* Text messages of the user not forwarded because the recipient queue was full */
+  long deferred; /* Text messages of the user that waited for credits of the recipient */
+  long unreachable; /* Text messages of the user to users without a queue */
+  long held; /* Text messages of the user kept in the mailbox of a user without a queue */
+  long terminations; /* Times the switch asked the user to terminate */
+  long timings; /* Timing requests sent to the user */
+} route_stats_t;
+
+/* A text message waiting for credits, allocated for its actual length */
+
+typedef struct
+{
+  int recipient;
+  int number; /* Number of the message in the journal */
+  messagebuf_t message;
+} deferred_t;
+
+/* Members of a group, changed by the shards of the members and read by all of them */
+
+typedef struct
+{
+  pthread_rwlock_t lock;
+  int *members;
+  int members_number;
+  int size; /* Room in members */
+} group_t;
+
+struct switch_s;
+struct journal_s;
+struct mailboxes_s;
+struct trace_s;
+
+/* A shard serves the users whose number modulo the number of shards is its own */
+/* It owns their routing entries: only the qid is read by the other shards */
+
+typedef struct
+{
+  struct switch_s *s;
+  int id;
+  int sw; /* Qid of the shard, where its users send their messages */
+  unsigned int seed;
+  long routed; /* Text messages forwarded */
+  long dropped; /* Text messages not forwarded because the recipient queue was full */
+  long deferred; /* Text messages that waited for credits of the recipient */
+  long unreachable; /* Text messages to users without a queue */
+  long held; /* Text messages kept in the mailbox of a user without a queue */
+  long timings; /* Timing requests sent */
+  long multicasts; /* Group messages received, each delivery counts as a routed text message */
+  deferred_t *waiting[MAXDEFERRED]; /* Text messages waiting for credits, oldest first */
+  int waiting_number;
+  int credit_epoch; /* Value of the switch counter when the waiting messages were last tried */
+  unsigned char *blocked; /* Bitmap of the recipients a retry holds back, clear between retries */
+  int *resolved; /* Journal numbers of the MAXDEFERRED messages at most a retry resolves */
+  int disconnected; /* Users of the shard that disconnected */
+  struct journal_s *journal; /* Journal of the shard, NULL if the switch keeps none */
+  int journal_number; /* Number of the last text message journaled as waiting */
+  histogram_t timing; /* Round trip in ns of the timing requests */
+  long services[SERVICES]; /* Service messages received, by service */
+  long bad_services; /* Service messages dropped because their service or payload is invalid */
+  int finished; /* The shard has done its part of the end of the benchmark */
+  int *members; /* Copy of the members of the group a group message goes to */
+  int members_size; /* Room in members */
+  pthread_t thread;
+} shard_t;
+
+/* State of the switch */
+
+typedef struct switch_s
+{
+  int sw; /* Qid of the switch */
+  int users_number;
+  int service_probability;
+  int deadproc; /* A counter of the already terminated user processes */
+  int verbose; /* Print every event on the standard output */
+
+  route_t *routes; /* Users are numbered from 1, entry 0 is the switch */
+  route_stats_t *stats; /* Kept apart from the routes, which are read by every shard */
+  group_t *groups; /* MAXGROUPS groups, group 0 is everybody and has no member list */
+
+  /* Flow control: a text message to a user without credits waits in the shard, */
+  /* and is dropped if the shard has no room for it. The switch never waits for a user */
+  int flow_control; /* If not set, the switch waits for room in the queue of the recipient */
+  int *credits; /* Bytes each user can still receive, taken by any shard */
+  int *waiting; /* Text messages to each user waiting in the shards */
+  int credit_epoch; /* Incremented every time a user gives credits back */
+
+  struct mailboxes_s *mailboxes; /* Text messages to users without a queue, NULL to drop them */
+  struct trace_s *trace; /* Records the text and group messages received, NULL not to */
+
+  /* Benchmark mode: nobody is terminated until every user stopped sending */
+  int bench;
+  int registered; /* Users that sent their qid */
+  int done; /* Users that stopped sending */
+  int drained; /* Shards that routed everything sent before the end */
+  long long boot; /* Monotonic time in ns when the switch process started, 0 if not known */
+  long long first; /* Monotonic time in ns when the first text message has been routed */
+  long long start; /* Monotonic time in ns when the users have been told to start */
+  long long end; /* Monotonic time in ns when the last user stopped */
+  report_t totals; /* Sum of the reports of the users */
+
+  int shards;
+  shard_t shard[MAXSHARDS];
+} switch_t;
+
+int random_number(int max);
+
+void switch_init(switch_t *s, int sw, int users_number, int service_probability, int shards);
+void switch_free(switch_t *s);
+int switch_done(switch_t *s);
+int switch_lookup(switch_t *s, int user);
+int switch_queue(switch_t *s, int user);
+void switch_provision(switch_t *s, int user, int qid, int group);
+void switch_start(switch_t *s);
+
+int switch_recover(switch_t *s, char *path);
+void switch_journal(switch_t *s, char *path);
+void switch_commit(shard_t *sh);
+
+void switch_service(shard_t *sh, messagebuf_t *in);
+void switch_route(shard_t *sh, messagebuf_t *in);
+void switch_multicast(shard_t *sh, messagebuf_t *in);
+
+void switch_run_polling(switch_t *s);
+void switch_run_event(switch_t *s);
+
+void switch_print_report(switch_t *s);
+void switch_print_mailboxes(switch_t *s);
+void switch_print_latency(switch_t *s);
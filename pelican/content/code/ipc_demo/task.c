@@ -0,0 +1,591 @@
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "layer1.h"
+#include "layer2.h"
+#include "task.h"
+
+/*
+ * Tasks.
+ *
+ * Each scheduler runs its tasks in a single thread. A task waits in two
+ * places at once: in the timers of its scheduler, a binary heap ordered by
+ * wake time, and on its queue. The flag armed decides who resumes it: the
+ * first one to clear it, the scheduler when the timer expires or the sender
+ * of a message, which pushes the task on the woken stack of the scheduler.
+ *
+ * A timer entry is never removed from the heap: an entry whose time is no
+ * longer the one the task waits for is thrown away when it comes out.
+ */
+
+/* Expired timers a scheduler serves before looking at the tasks woken by a message again */
+#define TASK_BATCH 64
+
+/* Message types a queue keeps apart, from TYPE_SERVICE to TYPE_GROUP */
+#define TASK_TYPES TYPE_GROUP
+
+typedef struct task_node_s
+{
+  struct task_node_s *next;
+  long sequence; /* Arrival order, to take the first message whatever its type */
+  int length;
+  messagebuf_t message; /* Only the first length bytes of mtext are allocated */
+} task_node_t;
+
+typedef struct
+{
+  int lock;
+  int used;
+  int messages;
+  int bytes;
+  long sequence;
+  task_node_t *first[TASK_TYPES];
+  task_node_t *last[TASK_TYPES];
+  task_t *owner; /* Task woken by every message, NULL for a thread */
+  unsigned int doorbell; /* Incremented for every message when there is no owner */
+  int waiters;
+} task_queue_t;
+
+typedef struct
+{
+  long long wake;
+  task_t *t;
+} task_timer_t;
+
+typedef struct
+{
+  pthread_t thread;
+  task_t *woken; /* Stack of the tasks woken by a message */
+  unsigned int doorbell;
+  int sleeping;
+  task_timer_t *timers; /* Binary heap, the earliest first */
+  int timers_number;
+  int size;
+  int tasks; /* Tasks not over yet */
+  long resumes;
+} scheduler_t;
+
+static task_queue_t *queues;
+static int max_queues;
+static int next_queue;
+
+static scheduler_t *schedulers;
+static int schedulers_number;
+static void (*stop_hook)(void);
+
+static long futex(unsigned int *addr, int op, unsigned int val, struct timespec *timeout)
+{
+  return syscall(SYS_futex, addr, op, val, timeout, NULL, 0);
+}
+
+static long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void task_init(int queues_number)
+{
+  int i;
+
+  schedulers_number = sysconf(_SC_NPROCESSORS_ONLN);
+  if(schedulers_number < 1){
+    schedulers_number = 1;
+  }
+
+  if((queues = calloc(queues_number, sizeof(task_queue_t))) == NULL ||
+     (schedulers = calloc(schedulers_number, sizeof(scheduler_t))) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  max_queues = queues_number;
+  next_queue = 0;
+
+  for(i = 0; i < schedulers_number; i++){
+    schedulers[i].size = 1024;
+    if((schedulers[i].timers = malloc(schedulers[i].size * sizeof(task_timer_t))) == NULL){
+      perror("malloc");
+      exit(1);
+    }
+  }
+}
+
+int task_schedulers(void)
+{
+  return schedulers_number;
+}
+
+/* Timers */
+
+static void timer_push(scheduler_t *sc, task_t *t)
+{
+  task_timer_t entry = {t->wake, t};
+  int i, parent;
+
+  if(sc->timers_number == sc->size){
+    sc->size *= 2;
+    if((sc->timers = realloc(sc->timers, sc->size * sizeof(task_timer_t))) == NULL){
+      perror("realloc");
+      exit(1);
+    }
+  }
+
+  for(i = sc->timers_number++; i > 0; i = parent){
+    parent = (i - 1) / 2;
+    if(sc->timers[parent].wake <= entry.wake){
+      break;
+    }
+    sc->timers[i] = sc->timers[parent];
+  }
+  sc->timers[i] = entry;
+  t->timer = t->wake;
+}
+
+static task_timer_t timer_pop(scheduler_t *sc)
+{
+  task_timer_t first = sc->timers[0], last = sc->timers[--sc->timers_number];
+  int i, child;
+
+  for(i = 0; (child = 2 * i + 1) < sc->timers_number; i = child){
+    if(child + 1 < sc->timers_number && sc->timers[child + 1].wake < sc->timers[child].wake){
+      child++;
+    }
+    if(last.wake <= sc->timers[child].wake){
+      break;
+    }
+    sc->timers[i] = sc->timers[child];
+  }
+  sc->timers[i] = last;
+
+  return first;
+}
+
+/* The task is woken at most once per wait: only the one that clears armed pushes it */
+static int disarm(task_t *t)
+{
+  int armed = 1;
+
+  return __atomic_compare_exchange_n(&t->armed, &armed, 0, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static void schedule(task_t *t)
+{
+  scheduler_t *sc = &schedulers[t->scheduler];
+
+  t->next = __atomic_load_n(&sc->woken, __ATOMIC_RELAXED);
+  while(!__atomic_compare_exchange_n(&sc->woken, &t->next, t, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED));
+
+  /* Ring the doorbell, waking the scheduler only if it sleeps */
+  __atomic_add_fetch(&sc->doorbell, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&sc->sleeping, __ATOMIC_SEQ_CST)){
+    futex(&sc->doorbell, FUTEX_WAKE, INT_MAX, NULL);
+  }
+}
+
+static void task_wake(task_t *t)
+{
+  if(__atomic_load_n(&t->armed, __ATOMIC_SEQ_CST) && disarm(t)){
+    schedule(t);
+  }
+}
+
+/* A message sent while the step ran did not wake the task, it is still in the queue */
+static void resume(scheduler_t *sc, task_t *t)
+{
+  sc->resumes++;
+  if(t->step(t) == TASK_DONE){
+    sc->tasks--;
+    return;
+  }
+
+  if(t->wake != TASK_NEVER && t->wake != t->timer){
+    timer_push(sc, t);
+  }
+
+  __atomic_store_n(&t->armed, 1, __ATOMIC_SEQ_CST);
+  if(t->qid >= 0 && __atomic_load_n(&queues[t->qid].messages, __ATOMIC_SEQ_CST) && disarm(t)){
+    schedule(t);
+  }
+}
+
+/*
+ * Scheduler.
+ * Runs the tasks woken by a message, then a batch of those whose time has
+ * come, so that a late scheduler does not keep messages waiting behind
+ * its timers, and sleeps until the next timer when there is nothing to run.
+ */
+static void *scheduler_run(void *arg)
+{
+  scheduler_t *sc = arg;
+  task_timer_t entry;
+  task_t *t, *next;
+  struct timespec timeout;
+  unsigned int doorbell;
+  long long now, left;
+  int ran, timers;
+
+  while(sc->tasks > 0){
+    ran = 0;
+
+    for(t = __atomic_exchange_n(&sc->woken, NULL, __ATOMIC_SEQ_CST); t != NULL; t = next){
+      next = t->next;
+      resume(sc, t);
+      ran++;
+    }
+
+    now = now_ns();
+    for(timers = 0; timers < TASK_BATCH && sc->timers_number && sc->timers[0].wake <= now; timers++){
+      entry = timer_pop(sc);
+      if(entry.wake != entry.t->timer){
+        continue;
+      }
+      entry.t->timer = TASK_NEVER;
+      if(disarm(entry.t)){
+        resume(sc, entry.t);
+        ran++;
+      }
+    }
+
+    if(ran || sc->tasks == 0){
+      continue;
+    }
+
+    /* Announce the sleep before checking again, so a waker cannot miss us */
+    __atomic_store_n(&sc->sleeping, 1, __ATOMIC_SEQ_CST);
+    doorbell = __atomic_load_n(&sc->doorbell, __ATOMIC_SEQ_CST);
+
+    if(__atomic_load_n(&sc->woken, __ATOMIC_SEQ_CST) == NULL){
+      left = sc->timers_number ? sc->timers[0].wake - now_ns() : 1000000000LL;
+      if(left > 0){
+        timeout.tv_sec = left / 1000000000LL;
+        timeout.tv_nsec = left % 1000000000LL;
+        futex(&sc->doorbell, FUTEX_WAIT, doorbell, &timeout);
+      }
+    }
+    __atomic_store_n(&sc->sleeping, 0, __ATOMIC_SEQ_CST);
+  }
+
+  if(stop_hook != NULL){
+    stop_hook();
+  }
+
+  return NULL;
+}
+
+void task_spawn(task_t *t, int (*step)(task_t *t), void *arg, int qid, int scheduler)
+{
+  scheduler_t *sc = &schedulers[scheduler % schedulers_number];
+
+  t->step = step;
+  t->arg = arg;
+  t->qid = qid;
+  t->scheduler = scheduler % schedulers_number;
+  t->timer = TASK_NEVER;
+  t->armed = 1;
+  sc->tasks++;
+
+  if(qid >= 0){
+    queues[qid].owner = t;
+  }
+
+  if(t->wake != TASK_NEVER){
+    timer_push(sc, t);
+  }
+}
+
+void task_start(void (*stop)(void))
+{
+  int i;
+
+  stop_hook = stop;
+
+  for(i = 0; i < schedulers_number; i++){
+    if(pthread_create(&schedulers[i].thread, NULL, scheduler_run, &schedulers[i])){
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+}
+
+long task_wait(void)
+{
+  long resumes = 0;
+  int i;
+
+  for(i = 0; i < schedulers_number; i++){
+    pthread_join(schedulers[i].thread, NULL);
+    resumes += schedulers[i].resumes;
+  }
+
+  return resumes;
+}
+
+/*
+ * In-memory transport.
+ *
+ * A queue keeps a list of messages for each type behind a spin lock, held
+ * only to link or unlink a message. Queues are indexed by their qid and
+ * never reused. Keys are not looked up, every queue is a new one: the users
+ * of the tasks never look for a queue, the switch creates theirs.
+ */
+
+static void lock(task_queue_t *q)
+{
+  while(__atomic_exchange_n(&q->lock, 1, __ATOMIC_ACQUIRE)){
+    sched_yield();
+  }
+}
+
+static void unlock(task_queue_t *q)
+{
+  __atomic_store_n(&q->lock, 0, __ATOMIC_RELEASE);
+}
+
+static void check_queue(int qid)
+{
+  if(qid < 0 || qid >= __atomic_load_n(&next_queue, __ATOMIC_ACQUIRE)){
+    fprintf(stderr, "task: invalid queue %d\n", qid);
+    exit(1);
+  }
+}
+
+static int task_create_queue(key_t key)
+{
+  int qid;
+
+  qid = __atomic_fetch_add(&next_queue, 1, __ATOMIC_ACQ_REL);
+  if(qid >= max_queues){
+    fprintf(stderr, "task: too many queues\n");
+    exit(1);
+  }
+
+  queues[qid].used = 1;
+  return qid;
+}
+
+static int task_remove_queue(int qid)
+{
+  task_queue_t *q;
+  task_node_t *n, *next;
+  int type;
+
+  check_queue(qid);
+  q = &queues[qid];
+
+  lock(q);
+  q->used = 0;
+  for(type = 0; type < TASK_TYPES; type++){
+    for(n = q->first[type]; n != NULL; n = next){
+      next = n->next;
+      free(n);
+    }
+    q->first[type] = q->last[type] = NULL;
+  }
+  q->messages = 0;
+  q->bytes = 0;
+  unlock(q);
+
+  return 0;
+}
+
+/* Without nowait the message is queued even if the queue is full: a task cannot wait for room */
+static int push(int qid, messagebuf_t *qbuf, int nowait)
+{
+  task_queue_t *q;
+  task_node_t *n;
+  task_t *owner;
+  int type = qbuf->mtype - 1, len = message_length(qbuf);
+
+  check_queue(qid);
+  if(type < 0 || type >= TASK_TYPES){
+    fprintf(stderr, "task: invalid message type %ld\n", qbuf->mtype);
+    exit(1);
+  }
+  q = &queues[qid];
+
+  lock(q);
+  if(!q->used){
+    unlock(q);
+    return -1;
+  }
+  if(nowait && q->messages && q->bytes + len > TASK_QUEUE_BYTES){
+    unlock(q);
+    return 0;
+  }
+
+  if((n = malloc(offsetof(task_node_t, message.mtext) + len)) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  n->next = NULL;
+  n->sequence = q->sequence++;
+  n->length = len;
+  memcpy(&n->message.mtext, &qbuf->mtext, len);
+
+  if(q->last[type] != NULL){
+    q->last[type]->next = n;
+  }
+  else{
+    q->first[type] = n;
+  }
+  q->last[type] = n;
+  q->bytes += len;
+  __atomic_add_fetch(&q->messages, 1, __ATOMIC_SEQ_CST);
+  owner = q->owner;
+  unlock(q);
+
+  if(owner != NULL){
+    task_wake(owner);
+  }
+  else{
+    __atomic_add_fetch(&q->doorbell, 1, __ATOMIC_SEQ_CST);
+    if(__atomic_load_n(&q->waiters, __ATOMIC_SEQ_CST)){
+      futex(&q->doorbell, FUTEX_WAKE, INT_MAX, NULL);
+    }
+  }
+
+  return 1;
+}
+
+static int task_send_message(int qid, messagebuf_t *qbuf)
+{
+  return push(qid, qbuf, 0) == -1 ? -1 : 0;
+}
+
+static int task_try_send_message(int qid, messagebuf_t *qbuf)
+{
+  return push(qid, qbuf, 1);
+}
+
+/* A negative type asks for the lowest type up to its absolute value, as msgrcv does */
+/* The caller holds the lock */
+static int pick_type(task_queue_t *q, long type)
+{
+  int t, first = -1;
+
+  if(type > 0){
+    return (type <= TASK_TYPES && q->first[type - 1] != NULL) ? type - 1 : -1;
+  }
+
+  for(t = 0; t < TASK_TYPES && (type == 0 || t < -type); t++){
+    if(q->first[t] == NULL){
+      continue;
+    }
+    if(type < 0){
+      return t;
+    }
+    if(first < 0 || q->first[t]->sequence < q->first[first]->sequence){
+      first = t;
+    }
+  }
+
+  return first;
+}
+
+static int task_receive_message(int qid, long type, messagebuf_t *qbuf)
+{
+  task_queue_t *q;
+  task_node_t *n;
+  int t, len;
+
+  check_queue(qid);
+  q = &queues[qid];
+
+  if(!__atomic_load_n(&q->messages, __ATOMIC_SEQ_CST)){
+    return 0;
+  }
+
+  lock(q);
+  if((t = pick_type(q, type)) < 0){
+    unlock(q);
+    return 0;
+  }
+  n = q->first[t];
+  q->first[t] = n->next;
+  if(q->first[t] == NULL){
+    q->last[t] = NULL;
+  }
+  q->bytes -= n->length;
+  __atomic_sub_fetch(&q->messages, 1, __ATOMIC_SEQ_CST);
+  unlock(q);
+
+  len = n->length;
+  qbuf->mtype = t + 1;
+  memcpy(&qbuf->mtext, &n->message.mtext, len);
+  free(n);
+
+  return len;
+}
+
+/* Only threads wait, the switch: a task is resumed when a message arrives instead */
+static int task_receive_message_wait(int qid, long type, messagebuf_t *qbuf)
+{
+  task_queue_t *q;
+  unsigned int doorbell;
+  int len;
+
+  check_queue(qid);
+  q = &queues[qid];
+
+  while(1){
+    if((len = task_receive_message(qid, type, qbuf))){
+      return len;
+    }
+
+    /* Announce the wait before checking again, so a sender cannot miss us */
+    __atomic_add_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+    doorbell = __atomic_load_n(&q->doorbell, __ATOMIC_SEQ_CST);
+
+    if((len = task_receive_message(qid, type, qbuf))){
+      __atomic_sub_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+      return len;
+    }
+
+    if(futex(&q->doorbell, FUTEX_WAIT, doorbell, NULL) == -1 && errno == EINTR){
+      __atomic_sub_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+      return 0;
+    }
+    __atomic_sub_fetch(&q->waiters, 1, __ATOMIC_SEQ_CST);
+  }
+}
+
+/* Any thread may receive from any queue */
+static void task_bind_queue(int qid)
+{
+}
+
+static int task_queue_stat(int qid, int *messages, int *bytes)
+{
+  task_queue_t *q;
+
+  if(qid < 0 || qid >= __atomic_load_n(&next_queue, __ATOMIC_ACQUIRE) || !queues[qid].used){
+    return -1;
+  }
+  q = &queues[qid];
+
+  lock(q);
+  *messages = q->messages;
+  *bytes = q->bytes;
+  unlock(q);
+
+  return 0;
+}
+
+transport_t task_transport = {
+  task_create_queue,
+  task_remove_queue,
+  task_send_message,
+  task_try_send_message,
+  task_receive_message,
+  task_receive_message_wait,
+  task_bind_queue,
+  task_queue_stat,
+  NULL,
+  NULL
+};
@@ -0,0 +1,59 @@
+/* Users as tasks */
+
+/* A process or even a thread for each user costs tens of KB and a context switch */
+/* for every message. Here a user is a task: a structure and a function, the step, */
+/* that runs until the user would wait and returns. The user keeps in its structure */
+/* everything it needs to go on, so a task has no stack of its own. A scheduler */
+/* thread for each core resumes its tasks when their timer expires or a message */
+/* arrives in their queue, whichever comes first. */
+
+/* The queues live in the memory of the process, and a message sent to the queue */
+/* of a task wakes it up. Sending never waits, as a task cannot wait inside a call: */
+/* try_send_message gives up on a full queue, send_message ignores the limit. */
+
+/* Most users the tasks can simulate */
+#define MAXTASKS 1000000
+
+/* Bytes of text messages a queue accepts, the default of a SysV queue */
+#define TASK_QUEUE_BYTES 16384
+
+/* A step returns one of these */
+#define TASK_WAIT 0 /* Resume at the time in wake, or when a message arrives */
+#define TASK_DONE 1 /* The task is over */
+
+/* Wake time of a task that only waits for messages */
+#define TASK_NEVER 0x7fffffffffffffffLL
+
+typedef struct task_s
+{
+  struct task_s *next; /* In a list of tasks to run */
+  int (*step)(struct task_s *t);
+  void *arg;
+  long long wake; /* Monotonic time in ns to resume the task at, set by the step */
+  long long timer; /* Time of the entry of the task in the timers of its scheduler */
+  int qid; /* Queue whose messages wake the task up, -1 for none */
+  int scheduler;
+  int armed; /* Set while the task waits, whoever clears it resumes the task */
+} task_t;
+
+extern transport_t task_transport;
+
+/* This function allocates max_queues queues and prepares a scheduler for each core */
+/* It must be called before any queue is created */
+void task_init(int max_queues);
+
+/* This function returns the number of schedulers */
+int task_schedulers(void);
+
+/* This function adds a task to a scheduler, to be first resumed at t->wake */
+/* Messages sent to the queue qid will wake it up: the step must empty the queue before waiting */
+/* It must be called before the schedulers start */
+void task_spawn(task_t *t, int (*step)(task_t *t), void *arg, int qid, int scheduler);
+
+/* This function starts the schedulers, each one stops when its tasks are over */
+/* and calls stop before, if not NULL */
+void task_start(void (*stop)(void));
+
+/* This function waits for every scheduler to stop */
+/* Returns the number of times a task has been resumed */
+long task_wait(void);
@@ -0,0 +1,141 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "trace.h"
+
+static void trace_write(trace_t *t, int shard)
+{
+  size_t bytes = t->batched[shard] * sizeof(trace_record_t);
+
+  pthread_mutex_lock(&t->lock);
+
+  if(write(t->fd, &t->batches[shard * TRACE_BATCH], bytes) != (ssize_t) bytes){
+    perror("write");
+    exit(1);
+  }
+  t->header.records += t->batched[shard];
+
+  pthread_mutex_unlock(&t->lock);
+  t->batched[shard] = 0;
+}
+
+trace_t *trace_create(char *path, int users_number, int groups, int shards)
+{
+  trace_t *t;
+
+  if((t = calloc(1, sizeof(trace_t))) == NULL ||
+     (t->batches = malloc(shards * TRACE_BATCH * sizeof(trace_record_t))) == NULL ||
+     (t->batched = calloc(shards, sizeof(int))) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+
+  if((t->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1){
+    perror(path);
+    exit(1);
+  }
+
+  pthread_mutex_init(&t->lock, NULL);
+  t->header.magic = TRACE_MAGIC;
+  t->header.users_number = users_number;
+  t->header.groups = groups;
+  t->header.shards = shards;
+  t->header.records = 0;
+
+  /* Written again with the number of records when the trace is closed */
+  if(write(t->fd, &t->header, sizeof(trace_header_t)) != sizeof(trace_header_t)){
+    perror("write");
+    exit(1);
+  }
+
+  return t;
+}
+
+void trace_add(trace_t *t, int shard, long long time, int sender, int recipient)
+{
+  trace_record_t *r = &t->batches[shard * TRACE_BATCH + t->batched[shard]++];
+
+  r->time = time;
+  r->sender = sender;
+  r->recipient = recipient;
+
+  if(t->batched[shard] == TRACE_BATCH){
+    trace_write(t, shard);
+  }
+}
+
+void trace_close(trace_t *t)
+{
+  int i;
+
+  for(i = 0; i < t->header.shards; i++){
+    trace_write(t, i);
+  }
+
+  if(pwrite(t->fd, &t->header, sizeof(trace_header_t), 0) != sizeof(trace_header_t) || close(t->fd) == -1){
+    perror("trace");
+    exit(1);
+  }
+
+  pthread_mutex_destroy(&t->lock);
+  free(t->batches);
+  free(t->batched);
+  free(t);
+}
+
+static int compare_records(const void *a, const void *b)
+{
+  const trace_record_t *x = a, *y = b;
+
+  if(x->sender != y->sender){
+    return x->sender - y->sender;
+  }
+  return (x->time > y->time) - (x->time < y->time);
+}
+
+/* A trace whose switch died has the records of its full batches, but not their number */
+trace_record_t *trace_load(char *path, trace_header_t *header)
+{
+  trace_record_t *records;
+  struct stat st;
+  FILE *f;
+  long i, n;
+  long long first;
+
+  if((f = fopen(path, "r")) == NULL){
+    return NULL;
+  }
+
+  if(fread(header, sizeof(trace_header_t), 1, f) != 1 || header->magic != TRACE_MAGIC || fstat(fileno(f), &st) == -1){
+    fclose(f);
+    return NULL;
+  }
+
+  n = (st.st_size - sizeof(trace_header_t)) / sizeof(trace_record_t);
+  if((records = malloc((n ? n : 1) * sizeof(trace_record_t))) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  if(fread(records, sizeof(trace_record_t), n, f) != (size_t) n){
+    perror("fread");
+    exit(1);
+  }
+  fclose(f);
+  header->records = n;
+
+  for(i = 0, first = n ? records[0].time : 0; i < n; i++){
+    if(records[i].time < first){
+      first = records[i].time;
+    }
+  }
+  for(i = 0; i < n; i++){
+    records[i].time -= first;
+  }
+
+  qsort(records, n, sizeof(trace_record_t), compare_records);
+  return records;
+}
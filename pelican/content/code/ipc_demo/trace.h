@@ -0,0 +1,53 @@
+/* Traffic traces */
+
+/* The switch records every text and group message it receives: when it left */
+/* its sender and where it goes, in 16 bytes. The texts are not kept, those of */
+/* the simulator only depend on the sender and the recipient. Played back, the */
+/* trace makes every user send the same messages again, at the same pace or as */
+/* fast as possible, so that transports and versions of the switch can be */
+/* compared on the same traffic. */
+
+#define TRACE_MAGIC 0x54524331
+
+/* Records each shard keeps before writing them to the file */
+#define TRACE_BATCH 4096
+
+typedef struct
+{
+  int magic;
+  int users_number;
+  int groups; /* The users were spread among this many groups */
+  int shards; /* Records of different shards are not in order */
+  long records;
+} trace_header_t;
+
+typedef struct
+{
+  long long time; /* Monotonic time in ns when the sender sent the message */
+  int sender;
+  int recipient; /* 0 or less for a group message, minus the group */
+} trace_record_t;
+
+typedef struct trace_s
+{
+  int fd; /* Not a stream, whose buffer the forked users would write again */
+  pthread_mutex_t lock; /* Taken to write a batch of records */
+  trace_header_t header;
+  trace_record_t *batches; /* TRACE_BATCH records for each shard */
+  int *batched; /* Records in the batch of each shard */
+} trace_t;
+
+/* This function creates a trace file for the traffic of users spread among groups */
+/* Each shard records the messages it receives in a batch of its own */
+trace_t *trace_create(char *path, int users_number, int groups, int shards);
+
+/* This function records a message received by a shard */
+void trace_add(trace_t *t, int shard, long long time, int sender, int recipient);
+
+/* This function writes the records left and closes the file */
+void trace_close(trace_t *t);
+
+/* This function reads a trace, its header in *header, and returns its records */
+/* sorted by sender and then by time, the first message of the trace being sent at 0 */
+/* Returns NULL if the file is not a trace */
+trace_record_t *trace_load(char *path, trace_header_t *header);
@@ -0,0 +1,776 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+#include "layer1.h"
+#include "layer2.h"
+#include "sock.h"
+#include "uring.h"
+
+int uring_init(uring_t *r, unsigned entries)
+{
+  struct io_uring_params p;
+  size_t sq_size, cq_size;
+  char *rings;
+
+  memset(&p, 0, sizeof(p));
+  p.flags = IORING_SETUP_CQSIZE;
+  p.cq_entries = 4 * entries;
+  if((r->fd = syscall(__NR_io_uring_setup, entries, &p)) == -1){
+    return -1;
+  }
+
+  /* Kernels since 5.4 map both rings at once */
+  if(!(p.features & IORING_FEAT_SINGLE_MMAP)){
+    close(r->fd);
+    errno = ENOSYS;
+    return -1;
+  }
+
+  sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+  cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+  r->rings_size = (sq_size > cq_size) ? sq_size : cq_size;
+  r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+
+  r->rings = mmap(NULL, r->rings_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+  r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+  if(r->rings == MAP_FAILED || r->sqes == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+
+  rings = r->rings;
+  r->sq_head = (unsigned *) (rings + p.sq_off.head);
+  r->sq_tail = (unsigned *) (rings + p.sq_off.tail);
+  r->sq_mask = (unsigned *) (rings + p.sq_off.ring_mask);
+  r->sq_array = (unsigned *) (rings + p.sq_off.array);
+  r->cq_head = (unsigned *) (rings + p.cq_off.head);
+  r->cq_tail = (unsigned *) (rings + p.cq_off.tail);
+  r->cq_mask = (unsigned *) (rings + p.cq_off.ring_mask);
+  r->cqes = (struct io_uring_cqe *) (rings + p.cq_off.cqes);
+  r->sq_entries = p.sq_entries;
+  r->sq_local = 0;
+  r->enters = 0;
+  r->buffer_ring = NULL;
+
+  return 0;
+}
+
+void uring_exit(uring_t *r)
+{
+  if(r->buffer_ring != NULL){
+    munmap(r->buffer_ring, r->buffers_number * sizeof(struct io_uring_buf));
+    free(r->buffers);
+  }
+  munmap(r->sqes, r->sqes_size);
+  munmap(r->rings, r->rings_size);
+  close(r->fd);
+}
+
+/*
+ * Provided buffers.
+ * The buffers are listed in a ring of their own, shared with the kernel,
+ * which takes them from its head as messages arrive while the process puts
+ * them back at its tail.
+ */
+void uring_buffers(uring_t *r, unsigned number, size_t size)
+{
+  struct io_uring_buf_reg reg;
+  unsigned i;
+
+  r->buffer_ring = mmap(NULL, number * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(r->buffer_ring == MAP_FAILED || (r->buffers = malloc(number * size)) == NULL){
+    perror("uring_buffers");
+    exit(1);
+  }
+  r->buffers_number = number;
+  r->buffer_size = size;
+
+  for(i = 0; i < number; i++){
+    r->buffer_ring->bufs[i].addr = (unsigned long) (r->buffers + i * size);
+    r->buffer_ring->bufs[i].len = size;
+    r->buffer_ring->bufs[i].bid = i;
+  }
+  __atomic_store_n(&r->buffer_ring->tail, number, __ATOMIC_RELEASE);
+
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (unsigned long) r->buffer_ring;
+  reg.ring_entries = number;
+  reg.bgid = 0;
+  if(syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1){
+    perror("io_uring_register");
+    exit(1);
+  }
+}
+
+void *uring_buffer(uring_t *r, unsigned bid)
+{
+  return r->buffers + bid * r->buffer_size;
+}
+
+void uring_recycle(uring_t *r, unsigned bid)
+{
+  unsigned short tail = r->buffer_ring->tail;
+  struct io_uring_buf *b = &r->buffer_ring->bufs[tail & (r->buffers_number - 1)];
+
+  b->addr = (unsigned long) (r->buffers + bid * r->buffer_size);
+  b->len = r->buffer_size;
+  b->bid = bid;
+  __atomic_store_n(&r->buffer_ring->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+unsigned uring_space(uring_t *r)
+{
+  unsigned head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+  return r->sq_entries - (*r->sq_tail + r->sq_local - head);
+}
+
+struct io_uring_sqe *uring_get_sqe(uring_t *r)
+{
+  unsigned index;
+
+  if(uring_space(r) == 0){
+    return NULL;
+  }
+
+  index = (*r->sq_tail + r->sq_local++) & *r->sq_mask;
+  r->sq_array[index] = index;
+  memset(&r->sqes[index], 0, sizeof(struct io_uring_sqe));
+
+  return &r->sqes[index];
+}
+
+/*
+ * Submission and wait.
+ * The prepared entries are published by moving the tail of the submission
+ * ring, and the kernel is asked for everything between its head and the
+ * tail: entries it did not take because a previous call was interrupted
+ * go with the new ones. Nothing to submit and nothing to wait for costs
+ * no system call.
+ */
+int uring_enter(uring_t *r, unsigned wait)
+{
+  unsigned tail, submit;
+  int ret;
+
+  tail = *r->sq_tail + r->sq_local;
+  __atomic_store_n(r->sq_tail, tail, __ATOMIC_RELEASE);
+  r->sq_local = 0;
+
+  submit = tail - __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+  if(submit == 0 && wait == 0){
+    return 0;
+  }
+
+  r->enters++;
+  if((ret = syscall(__NR_io_uring_enter, r->fd, submit, wait, wait ? IORING_ENTER_GETEVENTS : 0, NULL, 0)) == -1){
+    if(errno == EINTR){
+      return -1;
+    }
+    /* The completion ring overflowed: the kernel keeps the completions until there is room */
+    if(errno == EBUSY || errno == EAGAIN){
+      return 0;
+    }
+    perror("io_uring_enter");
+    exit(1);
+  }
+
+  return ret;
+}
+
+struct io_uring_cqe *uring_peek(uring_t *r)
+{
+  unsigned head = *r->cq_head;
+
+  if(head == __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)){
+    return NULL;
+  }
+
+  return &r->cqes[head & *r->cq_mask];
+}
+
+void uring_seen(uring_t *r)
+{
+  __atomic_store_n(r->cq_head, *r->cq_head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+ * io_uring transport.
+ *
+ * A thread copies the messages it sends into a list for each connection
+ * and goes on. When it receives, the lists are turned into send entries
+ * of its ring, linked for each connection so that the kernel sends them
+ * in order, and a single io_uring_enter() submits them all and sleeps
+ * until a completion comes. The completions are then read from the ring
+ * all at once, without any system call.
+ *
+ * The receives stay in the ring of the first thread that receives from a
+ * queue: an accept armed once on the listener completes for every new
+ * connection, and a receive armed once on each connection completes for
+ * every message, into a buffer the kernel picks among URING_BUFFERS of
+ * the ring. Neither epoll nor recvmmsg() is used.
+ *
+ * A connection has a single chain of sends in the kernel at a time: sends
+ * queued meanwhile wait for the next submission, as a new chain could
+ * overtake the sends of the old one that wait for room.
+ *
+ * The queues, their connections and the lists of the messages received are
+ * those of the socket transport, through the helpers of sock.h.
+ */
+
+/* What a completion is about, in the two highest bits of its user data */
+/* A send has its uring_send_t, an accept its qid, a receive its qid and fd */
+#define URING_KIND (3ULL << 62)
+#define URING_SEND 0ULL
+#define URING_ACCEPT (1ULL << 62)
+#define URING_RECEIVE (2ULL << 62)
+
+typedef struct uring_send_s
+{
+  struct uring_send_s *next;
+  int qid;
+  int length; /* Bytes sent, mtype included */
+  messagebuf_t message; /* Only the first length bytes are allocated */
+} uring_send_t;
+
+/* Sends of the calling thread to a queue */
+typedef struct
+{
+  uring_send_t *first; /* Waiting for the next submission */
+  uring_send_t *last;
+  int flying; /* Sends of the chain in the kernel */
+  int gone; /* A send of the chain found the queue removed */
+  int listed; /* In the list of the connections with sends waiting */
+} uring_output_t;
+
+static __thread uring_t *ring;
+static __thread uring_output_t *outputs; /* Indexed by qid, as connections */
+static __thread int outputs_size;
+static __thread int *listed; /* Queues with sends waiting */
+static __thread int listed_number;
+static __thread int listed_size;
+static __thread int pending; /* Sends queued and not completed */
+static __thread int unsubmitted; /* Sends queued and not prepared yet */
+static __thread long enters; /* Calls to io_uring_enter() of the rings released by the thread */
+static __thread unsigned short held[URING_BUFFERS]; /* Buffers kept from the kernel */
+static __thread int held_number;
+static __thread unsigned long *starved; /* Receives without buffers, as qid and fd */
+static __thread int starved_number;
+static __thread int starved_size;
+
+long uring_syscalls(void)
+{
+  return enters + (ring != NULL ? ring->enters : 0);
+}
+
+static uring_t *get_ring(void)
+{
+  if(ring == NULL){
+    if((ring = malloc(sizeof(uring_t))) == NULL){
+      perror("malloc");
+      exit(1);
+    }
+    if(uring_init(ring, URING_DEPTH) == -1){
+      perror("io_uring_setup");
+      exit(1);
+    }
+  }
+
+  return ring;
+}
+
+/* Returns a submission entry, submitting those prepared if the ring is full */
+static struct io_uring_sqe *next_sqe(void)
+{
+  struct io_uring_sqe *sqe;
+
+  while((sqe = uring_get_sqe(ring)) == NULL){
+    uring_enter(ring, 0);
+  }
+
+  return sqe;
+}
+
+static void free_sends(uring_send_t *n)
+{
+  uring_send_t *next;
+
+  for(; n != NULL; n = next){
+    next = n->next;
+    free(n);
+  }
+}
+
+/* Closing the ring cancels whatever it has in the kernel */
+void uring_forget(void)
+{
+  int i;
+
+  if(ring != NULL){
+    sock_forget_ring(ring);
+    uring_exit(ring);
+    free(ring);
+    ring = NULL;
+  }
+  for(i = 0; i < outputs_size; i++){
+    free_sends(outputs[i].first);
+  }
+  free(outputs);
+  free(listed);
+  free(starved);
+  outputs = NULL;
+  listed = NULL;
+  starved = NULL;
+  outputs_size = listed_number = listed_size = pending = unsubmitted = 0;
+  held_number = starved_number = starved_size = 0;
+}
+
+static uring_output_t *get_output(int qid)
+{
+  if(qid >= outputs_size){
+    if((outputs = realloc(outputs, (qid + 64) * sizeof(uring_output_t))) == NULL){
+      perror("realloc");
+      exit(1);
+    }
+    memset(&outputs[outputs_size], 0, (qid + 64 - outputs_size) * sizeof(uring_output_t));
+    outputs_size = qid + 64;
+  }
+
+  return &outputs[qid];
+}
+
+static void queue_send(int qid, messagebuf_t *qbuf)
+{
+  uring_output_t *o = get_output(qid);
+  uring_send_t *n;
+  int length = sizeof(long) + message_length(qbuf);
+
+  if((n = malloc(offsetof(uring_send_t, message) + length)) == NULL){
+    perror("malloc");
+    exit(1);
+  }
+  n->next = NULL;
+  n->qid = qid;
+  n->length = length;
+  memcpy(&n->message, qbuf, length);
+
+  if(o->last != NULL){
+    o->last->next = n;
+  }
+  else{
+    o->first = n;
+  }
+  o->last = n;
+  pending++;
+  unsubmitted++;
+
+  if(!o->listed){
+    if(listed_number == listed_size){
+      listed_size = listed_size ? 2 * listed_size : 64;
+      if((listed = realloc(listed, listed_size * sizeof(int))) == NULL){
+        perror("realloc");
+        exit(1);
+      }
+    }
+    listed[listed_number++] = qid;
+    o->listed = 1;
+  }
+}
+
+/* Turns the waiting sends into chains of linked entries, as many as the ring takes */
+static void prepare_sends(void)
+{
+  struct io_uring_sqe *sqe;
+  uring_output_t *o;
+  uring_send_t *n;
+  unsigned space;
+  int i, qid;
+
+  for(i = 0; i < listed_number; ){
+    qid = listed[i];
+    o = &outputs[qid];
+    if(o->flying){
+      i++;
+      continue;
+    }
+    if(o->first == NULL){
+      o->listed = 0;
+      listed[i] = listed[--listed_number];
+      continue;
+    }
+    if((space = uring_space(ring)) == 0){
+      return;
+    }
+
+    for(n = o->first; n != NULL && o->flying < space; n = n->next){
+      sqe = uring_get_sqe(ring);
+      sqe->opcode = IORING_OP_SEND;
+      sqe->fd = sock_connection(qid);
+      sqe->addr = (unsigned long) &n->message;
+      sqe->len = n->length;
+      sqe->msg_flags = MSG_NOSIGNAL;
+      sqe->user_data = URING_SEND | (unsigned long) n;
+      if(n->next != NULL && o->flying + 1 < space){
+        sqe->flags = IOSQE_IO_LINK;
+      }
+      o->flying++;
+      unsubmitted--;
+    }
+    o->first = n;
+    if(n == NULL){
+      o->last = NULL;
+    }
+  }
+}
+
+/* A removed queue fails the send that finds it gone, and cancels the rest of the chain */
+static void complete_send(uring_send_t *n, int res)
+{
+  uring_output_t *o = &outputs[n->qid];
+  uring_send_t *m;
+  int qid = n->qid;
+
+  if(res < 0){
+    if(res != -EPIPE && res != -ECONNRESET && res != -ECANCELED){
+      fprintf(stderr, "uring: send: %s\n", strerror(-res));
+      exit(1);
+    }
+    o->gone = 1;
+  }
+  free(n);
+  pending--;
+
+  if(--o->flying == 0 && o->gone){
+    for(m = o->first; m != NULL; m = m->next){
+      pending--;
+      unsubmitted--;
+    }
+    free_sends(o->first);
+    o->first = o->last = NULL;
+    o->gone = 0;
+    sock_drop_connection(qid);
+  }
+}
+
+static void arm_accept(sock_local_t *l, int qid)
+{
+  struct io_uring_sqe *sqe = next_sqe();
+
+  sqe->opcode = IORING_OP_ACCEPT;
+  sqe->fd = l->listener;
+  sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+  sqe->user_data = URING_ACCEPT | qid;
+}
+
+static void arm_receive(int qid, int fd)
+{
+  struct io_uring_sqe *sqe = next_sqe();
+
+  sqe->opcode = IORING_OP_RECV;
+  sqe->fd = fd;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->flags = IOSQE_BUFFER_SELECT;
+  sqe->buf_group = 0;
+  sqe->user_data = URING_RECEIVE | ((unsigned long) qid << 32) | fd;
+}
+
+/* The first thread that waits on a queue receives for it from then on */
+static void arm_queue(sock_local_t *l, int qid)
+{
+  if(l->ring == get_ring()){
+    return;
+  }
+
+  if(ring->buffer_ring == NULL){
+    uring_buffers(ring, URING_BUFFERS, sizeof(messagebuf_t));
+  }
+  arm_accept(l, qid);
+  l->ring = ring;
+}
+
+static void complete_accept(struct io_uring_cqe *cqe, int qid)
+{
+  sock_local_t *l = sock_find_local(qid);
+
+  /* The queue may have been removed meanwhile */
+  if(l == NULL || l->ring != ring){
+    if(cqe->res >= 0){
+      close(cqe->res);
+    }
+    return;
+  }
+
+  if(cqe->res >= 0){
+    sock_add_connection(l, cqe->res);
+    arm_receive(qid, cqe->res);
+  }
+  else if(cqe->res != -EAGAIN && cqe->res != -EINTR && cqe->res != -ECONNABORTED){
+    fprintf(stderr, "uring: accept: %s\n", strerror(-cqe->res));
+    exit(1);
+  }
+
+  if(!(cqe->flags & IORING_CQE_F_MORE)){
+    arm_accept(l, qid);
+  }
+}
+
+/*
+ * Backpressure.
+ * The receives would move everything the senders send into the memory of
+ * the process, and a sender would never find the queue full. So once a
+ * queue keeps URING_BUFFERS messages, the buffers of the messages read
+ * are not given back to the kernel until it has fewer. The receives that
+ * find no buffer end, and are only armed again with the buffers: meanwhile
+ * the messages wait in the connections, which fill up as a SysV queue does.
+ */
+static void release_buffers(void)
+{
+  int i;
+
+  for(i = 0; i < held_number; i++){
+    uring_recycle(ring, held[i]);
+  }
+  held_number = 0;
+
+  for(i = 0; i < starved_number; i++){
+    arm_receive(starved[i] >> 32, starved[i] & 0xffffffff);
+  }
+  starved_number = 0;
+}
+
+static void starve(int qid, int fd)
+{
+  if(starved_number == starved_size){
+    starved_size = starved_size ? 2 * starved_size : 64;
+    if((starved = realloc(starved, starved_size * sizeof(unsigned long))) == NULL){
+      perror("realloc");
+      exit(1);
+    }
+  }
+  starved[starved_number++] = ((unsigned long) qid << 32) | fd;
+}
+
+static void complete_receive(struct io_uring_cqe *cqe, int qid, int fd)
+{
+  sock_local_t *l = sock_find_local(qid);
+  int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+
+  if(cqe->flags & IORING_CQE_F_BUFFER){
+    if(l != NULL && cqe->res > 0){
+      sock_stash(l, uring_buffer(ring, bid), cqe->res - sizeof(long));
+    }
+    if(l != NULL && l->messages >= URING_BUFFERS){
+      held[held_number++] = bid;
+    }
+    else{
+      uring_recycle(ring, bid);
+    }
+  }
+
+  if(l == NULL || l->ring != ring){
+    return;
+  }
+
+  /* The sender closed the connection */
+  if(cqe->res == 0 || cqe->res == -ECONNRESET){
+    sock_close_connection(l, fd);
+    return;
+  }
+  if(cqe->res < 0 && cqe->res != -ENOBUFS && cqe->res != -EINTR){
+    fprintf(stderr, "uring: receive: %s\n", strerror(-cqe->res));
+    exit(1);
+  }
+
+  if(cqe->res == -ENOBUFS && held_number){
+    starve(qid, fd);
+  }
+  else if(!(cqe->flags & IORING_CQE_F_MORE)){
+    arm_receive(qid, fd);
+  }
+}
+
+/* Returns the number of completions other than sends */
+static int reap(void)
+{
+  struct io_uring_cqe *cqe;
+  unsigned long data;
+  int others = 0;
+
+  while((cqe = uring_peek(ring)) != NULL){
+    data = cqe->user_data;
+
+    switch(data & URING_KIND){
+    case URING_SEND:
+      complete_send((uring_send_t *) data, cqe->res);
+      break;
+    case URING_ACCEPT:
+      complete_accept(cqe, data & 0xffffffff);
+      others++;
+      break;
+    default:
+      complete_receive(cqe, (data & ~URING_KIND) >> 32, data & 0xffffffff);
+      others++;
+    }
+    uring_seen(ring);
+  }
+
+  return others;
+}
+
+/* Submits the waiting sends and waits for wait completions */
+/* Returns -1 if the wait has been interrupted by a signal */
+static int uring_submit(unsigned wait)
+{
+  int ret;
+
+  get_ring();
+  prepare_sends();
+  ret = uring_enter(ring, wait);
+  reap();
+
+  return ret;
+}
+
+/* A send still in the kernel once the completions are read waits for room in the connection: */
+/* the queue is full, unless the thread may wait */
+static int uring_push(int qid, messagebuf_t *qbuf, int nowait)
+{
+  uring_output_t *o;
+
+  if(sock_connect(qid) == -1){
+    return -1;
+  }
+
+  o = get_output(qid);
+  if(nowait && o->flying){
+    reap();
+    if(o->flying){
+      return 0;
+    }
+  }
+
+  /* A batch of forwards leaves before the thread is done with all it received */
+  queue_send(qid, qbuf);
+  if(unsubmitted >= SOCK_BATCH){
+    uring_submit(0);
+  }
+  while(pending >= URING_DEPTH){
+    uring_submit(1);
+  }
+
+  return 1;
+}
+
+static int uring_send_message(int qid, messagebuf_t *qbuf)
+{
+  return uring_push(qid, qbuf, 0) == -1 ? -1 : 0;
+}
+
+static int uring_try_send_message(int qid, messagebuf_t *qbuf)
+{
+  return uring_push(qid, qbuf, 1);
+}
+
+static int uring_send_messages(int qid, messagebuf_t *qbufs, int n)
+{
+  int i;
+
+  for(i = 0; i < n; i++){
+    if(uring_push(qid, &qbufs[i], 0) == -1){
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void uring_flush_messages(void)
+{
+  if(pending){
+    uring_submit(0);
+  }
+}
+
+/* The thread waits for its sends, as it may be leaving, then gives up its ring */
+static int uring_remove_queue(int qid)
+{
+  while(pending){
+    uring_submit(1);
+  }
+  if(ring != NULL){
+    enters += ring->enters;
+    uring_forget();
+  }
+
+  return sock_remove_queue(qid);
+}
+
+/* The buffers go back as soon as the queue has room, or when no message it keeps matches */
+static int uring_take(sock_local_t *l, long type, messagebuf_t *qbuf)
+{
+  int len = sock_take(l, type, qbuf);
+
+  if(held_number && l->messages < URING_BUFFERS){
+    release_buffers();
+  }
+
+  return len;
+}
+
+/* The messages already received come first, the ring is only looked at when none matches */
+static int uring_receive_message(int qid, long type, messagebuf_t *qbuf)
+{
+  sock_local_t *l = sock_get_local(qid);
+  int len;
+
+  if((len = uring_take(l, type, qbuf))){
+    return len;
+  }
+
+  arm_queue(l, qid);
+  release_buffers();
+  uring_submit(0);
+  return sock_take(l, type, qbuf);
+}
+
+/* Completions of sends alone do not end the wait */
+static int uring_receive_message_wait(int qid, long type, messagebuf_t *qbuf)
+{
+  sock_local_t *l = sock_get_local(qid);
+  int len;
+
+  while(!(len = uring_take(l, type, qbuf))){
+    arm_queue(l, qid);
+    if(reap()){
+      continue;
+    }
+    release_buffers();
+    prepare_sends();
+    if(uring_enter(ring, 1) == -1){
+      reap();
+      return 0;
+    }
+    reap();
+  }
+
+  return len;
+}
+
+transport_t uring_transport = {
+  sock_create_queue,
+  uring_remove_queue,
+  uring_send_message,
+  uring_try_send_message,
+  uring_receive_message,
+  uring_receive_message_wait,
+  sock_bind_queue,
+  sock_queue_stat,
+  uring_send_messages,
+  uring_flush_messages
+};
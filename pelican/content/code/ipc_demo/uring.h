@@ -0,0 +1,94 @@
+/* io_uring rings */
+
+/* The rings are set up with the bare system calls, as liburing is not */
+/* everywhere: io_uring_setup() creates them, mmap() maps the submission */
+/* and completion rings into the process, io_uring_enter() hands the */
+/* prepared entries to the kernel and waits for completions. Completions */
+/* are read from the mapped ring without any system call. */
+
+/* Receives can be armed once and complete for every message that arrives: */
+/* the kernel then picks the memory of each message among buffers the ring */
+/* was given, and the completion tells which. */
+
+typedef struct
+{
+  int fd;
+  unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+  unsigned *cq_head, *cq_tail, *cq_mask;
+  unsigned sq_entries;
+  unsigned sq_local; /* Entries prepared and not handed to the kernel yet */
+  struct io_uring_sqe *sqes;
+  struct io_uring_cqe *cqes;
+  void *rings;
+  size_t rings_size;
+  size_t sqes_size;
+  long enters; /* Calls to io_uring_enter() */
+  struct io_uring_buf_ring *buffer_ring; /* Buffers the kernel may pick, NULL if none */
+  char *buffers;
+  unsigned buffers_number;
+  size_t buffer_size;
+} uring_t;
+
+/* This function creates a ring of entries submission entries, with room */
+/* for four times as many completions */
+/* Returns -1 if the kernel does not allow io_uring */
+int uring_init(uring_t *r, unsigned entries);
+
+/* This function gives the ring number buffers of size bytes, as group 0 */
+/* number must be a power of 2 */
+void uring_buffers(uring_t *r, unsigned number, size_t size);
+
+/* Returns the buffer of index bid, picked by a completion with IORING_CQE_F_BUFFER */
+/* The index is in the flags of the completion, above IORING_CQE_BUFFER_SHIFT */
+void *uring_buffer(uring_t *r, unsigned bid);
+
+/* Gives the buffer of index bid back to the kernel */
+void uring_recycle(uring_t *r, unsigned bid);
+
+void uring_exit(uring_t *r);
+
+/* Returns a cleared submission entry, NULL if the submission ring is full */
+struct io_uring_sqe *uring_get_sqe(uring_t *r);
+
+/* Submission entries that can still be prepared */
+unsigned uring_space(uring_t *r);
+
+/* Submits the prepared entries, then waits until wait completions are there */
+/* Returns the entries submitted, -1 if the wait has been interrupted by a signal */
+int uring_enter(uring_t *r, unsigned wait);
+
+/* Returns the oldest completion not seen yet, NULL if none */
+struct io_uring_cqe *uring_peek(uring_t *r);
+
+/* Gives the completion back to the kernel */
+void uring_seen(uring_t *r);
+
+/* io_uring transport */
+
+/* The uring transport moves the messages over the connections of the socket */
+/* transport (sock.h), but a thread queues its sends in an io_uring ring */
+/* instead of making a send() for each: they are all handed to the kernel at */
+/* once when the thread receives. */
+/* The receives of its queue stay armed in the ring, so that a single */
+/* io_uring_enter() submits the forwards of a whole batch and waits for the */
+/* next messages. The sends to a connection are linked so that they arrive in */
+/* order. A full connection holds a send in the kernel instead of failing it: */
+/* try_send_message finds the queue full while a previous send to it is held, */
+/* and a thread waits once URING_DEPTH of its sends are not done yet. A send */
+/* to a removed queue is dropped when it completes */
+
+/* Submission entries of the ring of a thread, and most sends it keeps pending */
+#define URING_DEPTH 256
+
+/* Buffers a thread receiving through its ring gives the kernel, of a whole */
+/* messagebuf_t each: messages wait in the connections while none is free */
+#define URING_BUFFERS 64
+
+extern transport_t uring_transport;
+
+/* This function drops the ring and the sends of the calling thread, without sending anything */
+/* A child calls it after fork(), not to submit to the ring of its parent */
+void uring_forget(void);
+
+/* Calls to io_uring_enter() made by the calling thread for the transport */
+long uring_syscalls(void);
@@ -0,0 +1,546 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <limits.h>
+#include "layer1.h"
+#include "layer2.h"
+#include "histogram.h"
+#include "eventlog.h"
+#include "trace.h"
+#include "task.h"
+#include "user.h"
+#include "pool.h"
+
+char *hop_names[HOPS] = {"user -> switch", "switch", "switch -> user", "end to end"};
+
+/* Hops timed by the tasks of a scheduler, merged once when it stops instead of by every user */
+static __thread histogram_t task_hops[HOPS];
+static histogram_t *task_latency;
+
+/* Same as random_number, with the generator of the user */
+static int user_random(user_t *u, int max)
+{
+  double r,x;
+  r = (double) rand_r(&u->seed);
+  x = r * (double) max / RAND_MAX;
+  return((int) x);
+}
+
+void user_init(user_t *u, int id, int users_number, int text_message_probability, int sw)
+{
+  u->id = id;
+  u->users_number = users_number;
+  u->text_message_probability = text_message_probability;
+  u->sw = sw;
+  u->qid = -1;
+  u->threaded = 0;
+  u->verbose = 1;
+  u->flow_control = 1;
+  u->credits = 0;
+  u->seed = time(NULL) + 1000*id;
+  u->duration = 0;
+  u->period = 0;
+  u->delay = 0;
+  u->group = 0;
+  u->trace = NULL;
+  u->trace_number = 0;
+  u->speed = 1;
+  u->latency = NULL;
+}
+
+static long long now_ns(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+static void wait_until(long long t)
+{
+  struct timespec ts;
+
+  flush_messages();
+  ts.tv_sec = t / 1000000000LL;
+  ts.tv_nsec = t % 1000000000LL;
+  clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL);
+}
+
+/* Picks a random user other than the switch, the user itself and the previous recipient */
+/* (unless it is the only other user) */
+static int user_destination(user_t *u, int *olddest)
+{
+  int dest;
+
+  dest = user_random(u, u->users_number + 1);
+  while((dest == 0) || (dest == u->id) || (dest == *olddest && u->users_number > 2)){
+    dest = user_random(u, u->users_number + 1);
+  }
+  *olddest = dest;
+
+  return dest;
+}
+
+/* Times the hops of a text message that has just been received */
+static void time_hops(histogram_t *hops, messagebuf_t *in)
+{
+  set_stamp(in, STAMP_RECEIVE);
+
+  histogram_add(&hops[HOP_TO_SWITCH], get_stamp(in, STAMP_SWITCH_IN) - get_stamp(in, STAMP_SEND));
+  histogram_add(&hops[HOP_SWITCH], get_stamp(in, STAMP_SWITCH_OUT) - get_stamp(in, STAMP_SWITCH_IN));
+  histogram_add(&hops[HOP_FROM_SWITCH], get_stamp(in, STAMP_RECEIVE) - get_stamp(in, STAMP_SWITCH_OUT));
+  histogram_add(&hops[HOP_END_TO_END], get_stamp(in, STAMP_RECEIVE) - get_stamp(in, STAMP_SEND));
+}
+
+/* Adds the hops timed by the user to the shared histograms */
+static void merge_hops(user_t *u, histogram_t *hops)
+{
+  int h;
+
+  if(u->latency == NULL){
+    return;
+  }
+
+  for(h = 0; h < HOPS; h++){
+    histogram_merge(&u->latency[h], &hops[h]);
+  }
+}
+
+/* Gives back to the switch the room taken in the queue by a text message just read */
+/* Credits travel with the next text message, unless a batch of them is waiting */
+static void give_credits(user_t *u, messagebuf_t *in)
+{
+  if(!u->flow_control){
+    return;
+  }
+
+  u->credits += message_length(in);
+  if(u->credits >= CREDIT_BATCH){
+    user_send_credit(u->id, u->credits, u->sw);
+    u->credits = 0;
+  }
+}
+
+static void log_message(user_t *u, messagebuf_t *in)
+{
+  char msg_text[MAX_TEXT_LENGTH + 1];
+
+  if(u->verbose){
+    if(get_type(in) == TYPE_GROUP){
+      pool_text(get_service_data(in), msg_text);
+    }
+    else{
+      get_text(in, msg_text);
+    }
+    log_event(EVENT_RECEIVED, u->id, get_sender(in), 0, 0, msg_text);
+  }
+}
+
+/*
+ * Text message.
+ * Reads a text message just received, or the text of a group message,
+ * whose reference to the payload pool is dropped then.
+ */
+static void read_message(user_t *u, messagebuf_t *in, histogram_t *hops)
+{
+  time_hops(hops, in);
+  log_message(u, in);
+
+  if(get_type(in) == TYPE_GROUP){
+    pool_release(get_service_data(in));
+  }
+}
+
+/*
+ * Queue removal.
+ * Group messages the switch sent since the last ones were read would keep
+ * their slots of the payload pool forever once the queue is gone: their
+ * references are dropped before removing it.
+ */
+static void drop_queue(int qid)
+{
+  messagebuf_t in;
+
+  while(receive_message(qid, TYPE_GROUP, &in)){
+    pool_release(get_service_data(&in));
+  }
+  close_queue(qid);
+}
+
+/* Takes a text message or a group message from the queue, without waiting */
+static int receive_text(int qid, messagebuf_t *in)
+{
+  return receive_message(qid, TYPE_TEXT, in) || receive_message(qid, TYPE_GROUP, in);
+}
+
+/* One text message in ten goes to the group of the user, if it has one */
+static int to_group(user_t *u)
+{
+  return u->group && !user_random(u, 10);
+}
+
+/* Picks the recipient of the next message of a benchmark, 0 or less for a group */
+/* Played back, the messages of the trace are sent again */
+static int next_destination(user_t *u, int *olddest, int replayed)
+{
+  if(u->trace != NULL){
+    return u->trace[replayed].recipient;
+  }
+  return to_group(u) ? -u->group : user_destination(u, olddest);
+}
+
+/* Time of the next message of a replay, from the start */
+static long long replay_time(user_t *u, int replayed)
+{
+  return u->speed > 0 ? u->trace[replayed].time / u->speed : 0;
+}
+
+/* Sends a text message without waiting, returns 1 if the switch queue had room for it */
+/* A destination of 0 or less is minus a group */
+static int send_text(user_t *u, int dest, char *text)
+{
+  if(dest <= 0){
+    if(!user_try_send_group_message(u->id, -dest, text, u->credits, u->sw)){
+      return 0;
+    }
+    if(u->verbose){
+      log_event(EVENT_SEND_GROUP, u->id, -dest, 0, 0, NULL);
+    }
+  }
+  else{
+    if(!user_try_send_text_message(u->id, dest, text, u->credits, u->sw)){
+      return 0;
+    }
+    if(u->verbose){
+      log_event(EVENT_SEND, u->id, dest, 0, 0, NULL);
+    }
+  }
+
+  u->credits = 0;
+  return 1;
+}
+
+/* Leaves the group of the user, the switch may still deliver messages of the group until then */
+static void leave_group(user_t *u)
+{
+  if(u->group){
+    user_send_leave(u->id, u->group, u->sw);
+  }
+}
+
+/* Writes the text of a message to dest, minus a group if 0 or less */
+static void user_text(user_t *u, int dest, char *text)
+{
+  if(dest > 0){
+    sprintf(text, "A message from me (%d) to you (%d)", u->id, dest);
+  }
+  else{
+    sprintf(text, "A message from me (%d) to my group (%d)", u->id, -dest);
+  }
+}
+
+/*
+ * Step.
+ * One turn of the main loop of a user: reads the whole queue, answering the
+ * service requests and, once the sleep is over, randomly sends a text message
+ * to another user or to its group. *wake gets the end of the next sleep: a
+ * random time up to MAX_SLEEP seconds, or TEXT_RETRY if the switch queue had
+ * no room for the text. user_run sleeps until then, a task runs again then
+ * or as soon as a message arrives.
+ * Returns 0 once the switch terminated the user.
+ */
+static int user_step(user_t *u, histogram_t *hops, long long *wake)
+{
+  int dest;
+  char text[MAX_TEXT_LENGTH + 1];
+  messagebuf_t in;
+  long long now;
+
+  while(receive_next_message(u->qid, &in)){
+    if(get_type(&in) != TYPE_SERVICE){
+      read_message(u, &in, hops);
+      give_credits(u, &in);
+      continue;
+    }
+
+    switch(get_service(&in)){
+
+    case SERVICE_TERMINATE:
+      /* Read the last messages we have in the queue */
+      while(receive_text(u->qid, &in)){
+        read_message(u, &in, hops);
+      }
+      leave_group(u);
+
+      /* The switch stops when every user is gone, the hops must be in before */
+      /* Tasks merge theirs once, when their scheduler stops */
+      if(hops != task_hops){
+        merge_hops(u, hops);
+      }
+
+      /* Send an acknowledgement to the switch and remove the queue */
+      user_send_disconnect(u->id, getpid(), u->sw);
+      drop_queue(u->qid);
+      if(u->verbose){
+        log_event(EVENT_TERMINATION, u->id, 0, 0, 0, NULL);
+      }
+      return 0;
+
+    case SERVICE_TIME:
+      user_send_time(u->id, &in, u->sw);
+      if(u->verbose){
+        log_event(EVENT_TIMING_ANSWER, u->id, 0, 0, 0, NULL);
+      }
+      break;
+    }
+  }
+
+  now = now_ns();
+  if(now < *wake){
+    return 1;
+  }
+
+  if(u->users_number > 1 && user_random(u, 100) < u->text_message_probability){
+    dest = to_group(u) ? -u->group : user_destination(u, &u->olddest);
+    user_text(u, dest, text);
+
+    if(!send_text(u, dest, text)){
+      *wake = now + TEXT_RETRY;
+      return 1;
+    }
+  }
+
+  /* In ms, so that the users do not all wake up on the same second */
+  *wake = now + user_random(u, MAX_SLEEP * 1000) * 1000000LL;
+  return 1;
+}
+
+/*
+ * Benchmark.
+ * Waits for the start signal, then sends a text message every period
+ * until the end of the benchmark whatever happens to the previous ones,
+ * counting those the switch queue had no room for. Then keeps receiving
+ * until the switch terminates it and sends its counters.
+ * A slow user waits after every text message it reads.
+ * A replay sends the messages of the trace instead, each one at its time
+ * in the trace (divided by the speed) or at once, and ends with the last one.
+ */
+static void user_bench(user_t *u, int qid, histogram_t *hops)
+{
+  report_t report;
+  messagebuf_t in;
+  char text[MAX_TEXT_LENGTH + 1];
+  long long now, next, deadline, start;
+  int dest = 0, pending = 0;
+  int olddest = 0;
+  int replayed = 0;
+
+  memset(&report, 0, sizeof(report));
+
+  /* Wait until every user is connected */
+  while(!receive_message_wait(qid, TYPE_SERVICE, &in) || get_service(&in) != SERVICE_START);
+
+  /* Users are spread over the period, so that they do not all send at once */
+  now = start = now_ns();
+  deadline = now + u->duration;
+  next = now + u->period * u->id / u->users_number;
+  if(u->trace != NULL){
+    deadline = LLONG_MAX;
+    next = u->trace_number ? start + replay_time(u, 0) : start;
+  }
+
+  while((now = now_ns()) < deadline && (u->trace == NULL || replayed < u->trace_number)){
+    /* Empty the incoming box, answering the timing requests first */
+    while(receive_next_message(qid, &in)){
+      if(get_type(&in) == TYPE_SERVICE){
+        if(get_service(&in) == SERVICE_TIME){
+          user_send_time(u->id, &in, u->sw);
+        }
+        continue;
+      }
+
+      read_message(u, &in, hops);
+      report.received++;
+      if(u->delay){
+        usleep(u->delay);
+      }
+      give_credits(u, &in);
+    }
+
+    if(u->users_number < 2 && u->trace == NULL){
+      wait_until(deadline);
+      continue;
+    }
+
+    if(now < next){
+      wait_until(next < deadline ? next : deadline);
+      continue;
+    }
+
+    /* Without a period the message is sent again until the switch takes it */
+    /* so is every message of a trace, late if need be */
+    if(!pending){
+      dest = next_destination(u, &olddest, replayed);
+      user_text(u, dest, text);
+      pending = 1;
+    }
+
+    if(send_text(u, dest, text)){
+      report.sent++;
+    }
+    else if(!u->period || u->trace != NULL){
+      sched_yield();
+      continue;
+    }
+    else{
+      report.rejected++;
+    }
+    pending = 0;
+
+    if(u->trace != NULL){
+      if(u->speed > 0 && now - next > REPLAY_LATE){
+        report.late++;
+      }
+      if(++replayed < u->trace_number){
+        next = start + replay_time(u, replayed);
+      }
+      continue;
+    }
+
+    if(u->period && now - next > u->period){
+      report.late++;
+    }
+    next += u->period;
+  }
+
+  user_send_done(u->id, u->sw);
+
+  /* Keep receiving until the switch terminates us */
+  while(1){
+    if(!receive_next_message_wait(qid, &in)){
+      continue;
+    }
+
+    if(get_type(&in) != TYPE_SERVICE){
+      read_message(u, &in, hops);
+      report.received++;
+      if(u->delay){
+        usleep(u->delay);
+      }
+      give_credits(u, &in);
+    }
+    else if(get_service(&in) == SERVICE_TIME){
+      user_send_time(u->id, &in, u->sw);
+    }
+    else if(get_service(&in) == SERVICE_TERMINATE){
+      break;
+    }
+  }
+
+  /* The switch terminates users once it routed every message */
+  while(receive_text(qid, &in)){
+    read_message(u, &in, hops);
+    report.received++;
+  }
+
+  leave_group(u);
+  merge_hops(u, hops);
+  user_send_report(u->id, &report, u->sw);
+  user_send_disconnect(u->id, getpid(), u->sw);
+  drop_queue(qid);
+}
+
+/*
+ * User.
+ * Registers with the switch, unless the switch created its queue, then sleeps and
+ * runs a step, until the switch asks it to terminate.
+ */
+void *user_run(void *arg)
+{
+  user_t *u = arg;
+  int i = u->id;
+  int qid;
+  int stale;
+  long long wake;
+  histogram_t hops[HOPS];
+  int h;
+
+  for(h = 0; h < HOPS; h++){
+    histogram_init(&hops[h]);
+  }
+
+  log_bind(i);
+
+  /* The switch already knows a queue it created for us, and our group */
+  if(u->qid != -1){
+    qid = u->qid;
+    bind_queue(qid);
+  }
+  else{
+    /* Messages left by a previous run are thrown away with its queue */
+    /* Group messages among them would refer to a pool that is gone */
+    qid = init_fresh_queue(i, &stale);
+    if(stale && u->verbose){
+      log_event(EVENT_OLD_MESSAGES, i, stale, 0, 0, NULL);
+    }
+
+    /* Let the switch know we are alive */
+    user_send_connect(i, u->sw);
+
+    /* Join our group first: once every user sent its queue, every group is complete */
+    if(u->group){
+      user_send_join(i, u->group, u->sw);
+    }
+
+    /* Let the switch know how to reach us */
+    user_send_qid(i, qid, u->sw);
+    u->qid = qid;
+  }
+
+  if(u->duration || u->trace != NULL){
+    user_bench(u, qid, hops);
+
+    if(u->threaded){
+      return NULL;
+    }
+    exit(0);
+  }
+
+  /* Enter the main loop, sleeping between the steps */
+  u->olddest = 0;
+  wake = now_ns() + user_random(u, MAX_SLEEP * 1000) * 1000000LL;
+  do{
+    wait_until(wake);
+  } while(user_step(u, hops, &wake));
+
+  if(u->threaded){
+    return NULL;
+  }
+  exit(0);
+}
+
+/* A user as a task: the scheduler runs the step when it wakes up or when a message arrives */
+static int user_task(task_t *t)
+{
+  return user_step(t->arg, task_hops, &t->wake) ? TASK_WAIT : TASK_DONE;
+}
+
+void user_spawn(user_t *u, int scheduler)
+{
+  task_latency = u->latency;
+  u->olddest = 0;
+  u->task.wake = now_ns() + user_random(u, MAX_SLEEP * 1000) * 1000000LL;
+  task_spawn(&u->task, user_task, u, u->qid, scheduler);
+}
+
+void user_tasks_stop(void)
+{
+  int h;
+
+  for(h = 0; h < HOPS && task_latency != NULL; h++){
+    histogram_merge(&task_latency[h], &task_hops[h]);
+  }
+}
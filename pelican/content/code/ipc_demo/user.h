@@ -0,0 +1,56 @@
+#include <pthread.h>
+
+/* Hops of a text message, timed by its recipient with the stamps of the message */
+
+#define HOP_TO_SWITCH 0 /* From the sender to the switch */
+#define HOP_SWITCH 1 /* Inside the switch */
+#define HOP_FROM_SWITCH 2 /* From the switch to the recipient */
+#define HOP_END_TO_END 3 /* From the sender to the recipient */
+#define HOPS 4
+
+extern char *hop_names[HOPS];
+
+/* A replayed message sent this long in ns after its time is late */
+#define REPLAY_LATE 1000000
+
+/* A user sends again after this long in ns a text the switch queue had no room for */
+#define TEXT_RETRY 1000000
+
+/* State of a user */
+
+typedef struct
+{
+  int id;
+  int users_number;
+  int text_message_probability;
+  int sw; /* Qid of the switch (or of the shard serving the user) */
+  int qid; /* Queue the switch created and registered for the user, -1 if the user creates its own */
+  int threaded; /* The user is a thread, it must return instead of exiting */
+  int verbose; /* Print every event on the standard output */
+  int flow_control; /* Give credits back to the switch as text messages are read */
+  int credits; /* Bytes of text messages read and not given back yet */
+  unsigned int seed;
+  long long duration; /* Length in ns of a benchmark, 0 for the usual random behaviour */
+  long long period; /* Time in ns between two text messages in a benchmark, 0 for no pause */
+  int delay; /* Time in us a user waits after every text message it reads in a benchmark */
+  int group; /* Group the user joins and sends one message in ten to, 0 for none */
+  trace_record_t *trace; /* Messages the user sends again in a benchmark, NULL for random ones */
+  int trace_number;
+  double speed; /* Pace of a replay, 1 as recorded, 2 twice as fast, 0 as fast as possible */
+  histogram_t *latency; /* Histograms of the hops, shared by all the users, NULL not to time them */
+  pthread_t thread;
+  task_t task; /* The user as a task, resumed by a scheduler instead of running on its own */
+  int olddest; /* Recipient of the previous random text message */
+} user_t;
+
+void user_init(user_t *u, int id, int users_number, int text_message_probability, int sw);
+
+/* The body of a user, it takes a user_t and returns when the switch terminates it */
+void *user_run(void *arg);
+
+/* This function hands the user to a scheduler as a task, the switch must have created its queue */
+void user_spawn(user_t *u, int scheduler);
+
+/* This function adds the hops timed by the tasks of the calling scheduler to the shared histograms */
+/* Each scheduler calls it when its users are over */
+void user_tasks_stop(void);
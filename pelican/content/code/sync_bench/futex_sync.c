@@ -0,0 +1,207 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include "sync.h"
+
+/*
+ * Futexes.
+ *
+ * A lock is an integer: 0 free, 1 taken, 2 taken with somebody sleeping
+ * (or about to), the mutex of Ulrich Drepper's "Futexes Are Tricky". It is
+ * taken and released with an atomic operation, and the kernel is entered
+ * only to sleep while it is 2 or to wake a sleeper up on release.
+ *
+ * A semaphore is a counter decremented with a compare and swap while it
+ * is positive, and a count of the processes that sleep on it, so that a
+ * post makes FUTEX_WAKE only if somebody might be sleeping. A waiter
+ * registers before checking the counter the last time and a poster
+ * increments the counter before checking the sleepers: one of them always
+ * sees the other.
+ *
+ * The spinning variant retries the atomic operation a number of times
+ * before sleeping, betting that the holder releases the lock (or that a
+ * post arrives) within a system call worth of time. The futexes are not
+ * FUTEX_PRIVATE_FLAG, which is only for threads of the same process.
+ */
+
+/* Attempts before sleeping in the spinning variant */
+#define SPIN 100
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __builtin_ia32_pause()
+#else
+#define cpu_relax() __atomic_signal_fence(__ATOMIC_SEQ_CST)
+#endif
+
+typedef struct
+{
+  int count;
+  int sleepers;
+} futex_sem_t;
+
+typedef struct
+{
+  int lock;
+  char pad1[64 - sizeof(int)];
+  futex_sem_t sem;
+  char pad2[64 - sizeof(futex_sem_t)];
+} futex_object_t;
+
+static futex_object_t *objs;
+static size_t objs_size;
+static int spin;
+
+static void futex_wait(int *addr, int val)
+{
+  if(syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0) == -1 && errno != EAGAIN && errno != EINTR){
+    perror("futex");
+    exit(1);
+  }
+}
+
+static void futex_wake(int *addr)
+{
+  syscall(SYS_futex, addr, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+static void objects_init(int objects)
+{
+  int i;
+
+  objs_size = objects * sizeof(futex_object_t);
+  objs = mmap(NULL, objs_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(objs == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+
+  for(i = 0; i < objects; i++){
+    objs[i].lock = 0;
+    objs[i].sem.count = 0;
+    objs[i].sem.sleepers = 0;
+  }
+}
+
+static void futex_init(int objects)
+{
+  spin = 0;
+  objects_init(objects);
+}
+
+static void spin_init(int objects)
+{
+  spin = SPIN;
+  objects_init(objects);
+}
+
+static void futex_lock(int object)
+{
+  int *l = &objs[object].lock;
+  int c, i;
+
+  /* Spin reading, so that the line stays shared until the lock looks free */
+  for(i = 0; i < spin; i++){
+    c = 0;
+    if(__atomic_load_n(l, __ATOMIC_RELAXED) == 0 &&
+       __atomic_compare_exchange_n(l, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+      return;
+    }
+    cpu_relax();
+  }
+
+  c = 0;
+  if(__atomic_compare_exchange_n(l, &c, 1, 0, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)){
+    return;
+  }
+
+  /* Mark the lock as wanted, and sleep until it is released */
+  if(c != 2){
+    c = __atomic_exchange_n(l, 2, __ATOMIC_ACQUIRE);
+  }
+  while(c != 0){
+    futex_wait(l, 2);
+    c = __atomic_exchange_n(l, 2, __ATOMIC_ACQUIRE);
+  }
+}
+
+static void futex_unlock(int object)
+{
+  int *l = &objs[object].lock;
+
+  if(__atomic_fetch_sub(l, 1, __ATOMIC_RELEASE) != 1){
+    __atomic_store_n(l, 0, __ATOMIC_RELEASE);
+    futex_wake(l);
+  }
+}
+
+/* Returns 1 if the counter has been decremented */
+static int try_down(futex_sem_t *s)
+{
+  int c = __atomic_load_n(&s->count, __ATOMIC_SEQ_CST);
+
+  while(c > 0){
+    if(__atomic_compare_exchange_n(&s->count, &c, c - 1, 0, __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)){
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+static void futex_sem_wait(int object)
+{
+  futex_sem_t *s = &objs[object].sem;
+  int i;
+
+  for(i = 0; i <= spin; i++){
+    if(try_down(s)){
+      return;
+    }
+    cpu_relax();
+  }
+
+  __atomic_add_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+  while(!try_down(s)){
+    futex_wait(&s->count, 0);
+  }
+  __atomic_sub_fetch(&s->sleepers, 1, __ATOMIC_SEQ_CST);
+}
+
+static void futex_sem_post(int object)
+{
+  futex_sem_t *s = &objs[object].sem;
+
+  __atomic_add_fetch(&s->count, 1, __ATOMIC_SEQ_CST);
+  if(__atomic_load_n(&s->sleepers, __ATOMIC_SEQ_CST) > 0){
+    futex_wake(&s->count);
+  }
+}
+
+static void futex_destroy(void)
+{
+  munmap(objs, objs_size);
+}
+
+sync_t futex_sync = {
+  "futex",
+  futex_init,
+  futex_lock,
+  futex_unlock,
+  futex_sem_wait,
+  futex_sem_post,
+  futex_destroy
+};
+
+sync_t spin_sync = {
+  "spin",
+  spin_init,
+  futex_lock,
+  futex_unlock,
+  futex_sem_wait,
+  futex_sem_post,
+  futex_destroy
+};
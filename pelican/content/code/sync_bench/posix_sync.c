@@ -0,0 +1,84 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <semaphore.h>
+#include <sys/mman.h>
+#include "sync.h"
+
+/*
+ * POSIX semaphores.
+ *
+ * Unnamed sem_t in shared memory, created with pshared set so that they
+ * work across fork(). glibc implements them with atomic operations and a
+ * futex: only a process that has to wait, or that wakes one up, enters the
+ * kernel.
+ */
+
+static sem_t *sems;
+static size_t sems_size;
+static int count;
+
+static void posix_init(int objects)
+{
+  int i;
+
+  count = objects;
+  sems_size = 2 * objects * sizeof(sem_t);
+  sems = mmap(NULL, sems_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(sems == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+
+  for(i = 0; i < 2 * objects; i++){
+    if(sem_init(&sems[i], 1, (i < objects) ? 1 : 0) == -1){
+      perror("sem_init");
+      exit(1);
+    }
+  }
+}
+
+/* sem_wait() returns early when a signal arrives */
+static void posix_down(sem_t *sem)
+{
+  while(sem_wait(sem) == -1);
+}
+
+static void posix_lock(int object)
+{
+  posix_down(&sems[object]);
+}
+
+static void posix_unlock(int object)
+{
+  sem_post(&sems[object]);
+}
+
+static void posix_wait(int object)
+{
+  posix_down(&sems[count + object]);
+}
+
+static void posix_post(int object)
+{
+  sem_post(&sems[count + object]);
+}
+
+static void posix_destroy(void)
+{
+  int i;
+
+  for(i = 0; i < 2 * count; i++){
+    sem_destroy(&sems[i]);
+  }
+  munmap(sems, sems_size);
+}
+
+sync_t posix_sync = {
+  "posix",
+  posix_init,
+  posix_lock,
+  posix_unlock,
+  posix_wait,
+  posix_post,
+  posix_destroy
+};
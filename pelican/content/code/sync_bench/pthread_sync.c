@@ -0,0 +1,117 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "sync.h"
+
+/*
+ * pthread mutexes and condition variables.
+ *
+ * Both are created with PTHREAD_PROCESS_SHARED in shared memory. A lock is
+ * a mutex; a semaphore is a counter protected by its own mutex, with a
+ * condition variable signaled when the counter is incremented.
+ */
+
+typedef struct
+{
+  pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int count;
+} pt_sem_t;
+
+typedef struct
+{
+  pthread_mutex_t *locks;
+  pt_sem_t *sems;
+} pt_objects_t;
+
+static pt_objects_t objs;
+static void *area;
+static size_t area_size;
+static int count;
+
+static void pt_init(int objects)
+{
+  pthread_mutexattr_t mattr;
+  pthread_condattr_t cattr;
+  int i;
+
+  count = objects;
+  area_size = objects * (sizeof(pthread_mutex_t) + sizeof(pt_sem_t));
+  area = mmap(NULL, area_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(area == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+  objs.sems = area;
+  objs.locks = (pthread_mutex_t *) (objs.sems + objects);
+
+  pthread_mutexattr_init(&mattr);
+  pthread_mutexattr_setpshared(&mattr, PTHREAD_PROCESS_SHARED);
+  pthread_condattr_init(&cattr);
+  pthread_condattr_setpshared(&cattr, PTHREAD_PROCESS_SHARED);
+
+  for(i = 0; i < objects; i++){
+    pthread_mutex_init(&objs.locks[i], &mattr);
+    pthread_mutex_init(&objs.sems[i].mutex, &mattr);
+    pthread_cond_init(&objs.sems[i].cond, &cattr);
+    objs.sems[i].count = 0;
+  }
+
+  pthread_mutexattr_destroy(&mattr);
+  pthread_condattr_destroy(&cattr);
+}
+
+static void pt_lock(int object)
+{
+  pthread_mutex_lock(&objs.locks[object]);
+}
+
+static void pt_unlock(int object)
+{
+  pthread_mutex_unlock(&objs.locks[object]);
+}
+
+static void pt_wait(int object)
+{
+  pt_sem_t *s = &objs.sems[object];
+
+  pthread_mutex_lock(&s->mutex);
+  while(s->count == 0){
+    pthread_cond_wait(&s->cond, &s->mutex);
+  }
+  s->count--;
+  pthread_mutex_unlock(&s->mutex);
+}
+
+static void pt_post(int object)
+{
+  pt_sem_t *s = &objs.sems[object];
+
+  pthread_mutex_lock(&s->mutex);
+  s->count++;
+  pthread_cond_signal(&s->cond);
+  pthread_mutex_unlock(&s->mutex);
+}
+
+static void pt_destroy(void)
+{
+  int i;
+
+  for(i = 0; i < count; i++){
+    pthread_mutex_destroy(&objs.locks[i]);
+    pthread_mutex_destroy(&objs.sems[i].mutex);
+    pthread_cond_destroy(&objs.sems[i].cond);
+  }
+  munmap(area, area_size);
+}
+
+sync_t pthread_sync = {
+  "pthread",
+  pt_init,
+  pt_lock,
+  pt_unlock,
+  pt_wait,
+  pt_post,
+  pt_destroy
+};
@@ -0,0 +1,32 @@
+/* Synchronization primitives shared by processes */
+
+/* Every primitive is created before forking, in memory mapped as shared */
+/* or in the kernel, and offers objects numbered from 0: a lock and a */
+/* semaphore for each of them. The locks start free, the semaphores at 0. */
+typedef struct
+{
+  char *name;
+  void (*init)(int objects);
+  void (*lock)(int object);
+  void (*unlock)(int object);
+  void (*wait)(int object); /* Waits until the semaphore is positive and decrements it */
+  void (*post)(int object); /* Increments the semaphore, waking a waiter */
+  void (*destroy)(void);
+} sync_t;
+
+/* A SysV set with two semaphores for each object, as in semaphores3.c */
+extern sync_t sysv_sync;
+
+/* POSIX sem_t created with pshared set, both for the locks and the semaphores */
+extern sync_t posix_sync;
+
+/* pthread mutexes with PTHREAD_PROCESS_SHARED, and semaphores made of a */
+/* mutex, a condition variable and a counter */
+extern sync_t pthread_sync;
+
+/* Atomic operations on integers, with FUTEX_WAIT and FUTEX_WAKE only when */
+/* somebody has to sleep or to be woken up */
+extern sync_t futex_sync;
+
+/* The same, spinning for a while before sleeping in the kernel */
+extern sync_t spin_sync;
@@ -0,0 +1,240 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <time.h>
+#include <sched.h>
+#include <wait.h>
+#include <sys/mman.h>
+#include "sync.h"
+
+/* Most processes of a run */
+#define MAXPROCESSES 1024
+
+static sync_t *primitives[] = {&sysv_sync, &posix_sync, &pthread_sync, &futex_sync, &spin_sync, NULL};
+
+static char *cases[] = {"uncontended", "contended", "pingpong", NULL};
+
+/* Shared by the processes of a run */
+typedef struct
+{
+  int go; /* Set by the parent once every process has been forked */
+  long counter; /* Incremented with lock 0 held */
+  long long latencies[]; /* iterations for each process */
+} shared_t;
+
+typedef struct
+{
+  long operations;
+  double seconds;
+  double mean; /* ns */
+  long long p50;
+  long long p90;
+  long long p99;
+  long long max;
+  long errors; /* Increments of the counter lost by the lock */
+} result_t;
+
+long long now_ns()
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (long long) ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void usage(char *argv[])
+{
+  int i;
+
+  printf("Synchronization primitives shared by processes, results as CSV\n");
+  printf("%s [-p <primitive>] [-c <case>] [-n <processes>] [-i <iterations>]\n", argv[0]);
+  printf("\n");
+  printf("     -p <primitive> - One of");
+  for(i = 0; primitives[i] != NULL; i++){
+    printf(" %s", primitives[i]->name);
+  }
+  printf(" (default all)\n");
+  printf("     -c <case> - uncontended (each process locks its own lock), contended (all lock the same),\n");
+  printf("                 pingpong (a token passed around a ring of semaphores) (default all)\n");
+  printf("     -n <processes> - Runs with 1, 2, 4... up to this many processes (1 - %d, default 4)\n", MAXPROCESSES);
+  printf("     -i <iterations> - Operations of each process, or laps of the token (default 20000)\n");
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+  long long x = *(const long long *) a, y = *(const long long *) b;
+
+  return (x > y) - (x < y);
+}
+
+/*
+ * The work of a process.
+ * uncontended and contended time a lock and an unlock, of the lock of the
+ * process or of lock 0, which guards the shared counter. In pingpong the
+ * processes form a ring: each one waits on its semaphore and posts the
+ * next, and process 0 times the laps of the token, each one a handoff for
+ * each process.
+ */
+static void work(sync_t *s, char *c, int process, int processes, int iterations, shared_t *shared)
+{
+  long long *latencies = shared->latencies + (long) process * iterations;
+  long long start;
+  int i, next = (process + 1) % processes;
+
+  while(!__atomic_load_n(&shared->go, __ATOMIC_ACQUIRE)){
+    sched_yield();
+  }
+
+  for(i = 0; i < iterations; i++){
+    if(!strcmp(c, "uncontended")){
+      start = now_ns();
+      s->lock(process);
+      s->unlock(process);
+      latencies[i] = now_ns() - start;
+    }
+    else if(!strcmp(c, "contended")){
+      start = now_ns();
+      s->lock(0);
+      shared->counter++;
+      s->unlock(0);
+      latencies[i] = now_ns() - start;
+    }
+    else if(process == 0){
+      start = now_ns();
+      s->post(next);
+      s->wait(0);
+      latencies[i] = (now_ns() - start) / processes;
+    }
+    else{
+      s->wait(process);
+      s->post(next);
+    }
+  }
+}
+
+/*
+ * A run.
+ * Forks the processes, lets them go at once and waits for all of them: the
+ * throughput is over the whole run, the latencies are those of the single
+ * operations, collected in shared memory and sorted by the parent.
+ */
+void run(sync_t *s, char *c, int processes, int iterations, result_t *r)
+{
+  shared_t *shared;
+  size_t shared_size;
+  long long start, sum = 0;
+  long samples, i;
+  int p, status;
+
+  shared_size = sizeof(shared_t) + (long) processes * iterations * sizeof(long long);
+  shared = mmap(NULL, shared_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+  if(shared == MAP_FAILED){
+    perror("mmap");
+    exit(1);
+  }
+  shared->go = 0;
+  shared->counter = 0;
+  s->init(processes);
+  fflush(stdout);
+
+  for(p = 0; p < processes; p++){
+    if(fork() == 0){
+      work(s, c, p, processes, iterations, shared);
+      exit(0);
+    }
+  }
+
+  start = now_ns();
+  __atomic_store_n(&shared->go, 1, __ATOMIC_RELEASE);
+  while(wait(&status) > 0);
+  r->seconds = (now_ns() - start) / 1e9;
+
+  if(!strcmp(c, "pingpong")){
+    samples = iterations;
+    r->operations = (long) iterations * processes;
+    r->errors = 0;
+  }
+  else{
+    samples = (long) processes * iterations;
+    r->operations = samples;
+    r->errors = !strcmp(c, "contended") ? samples - shared->counter : 0;
+  }
+
+  qsort(shared->latencies, samples, sizeof(long long), compare_latency);
+  for(i = 0; i < samples; i++){
+    sum += shared->latencies[i];
+  }
+  r->mean = (double) sum / samples;
+  r->p50 = shared->latencies[samples / 2];
+  r->p90 = shared->latencies[samples * 90 / 100];
+  r->p99 = shared->latencies[samples * 99 / 100];
+  r->max = shared->latencies[samples - 1];
+
+  s->destroy();
+  munmap(shared, shared_size);
+}
+
+int main(int argc, char *argv[])
+{
+  result_t r;
+  char *primitive = NULL, *c = NULL;
+  int processes = 4, iterations = 20000;
+  int i, j, n, opt;
+
+  while((opt = getopt(argc, argv, "p:c:n:i:")) != -1){
+    switch(opt){
+    case 'p':
+      primitive = optarg;
+      break;
+    case 'c':
+      c = optarg;
+      break;
+    case 'n':
+      processes = strtol(optarg, NULL, 10);
+      break;
+    case 'i':
+      iterations = strtol(optarg, NULL, 10);
+      break;
+    default:
+      usage(argv);
+      exit(0);
+    }
+  }
+
+  if(processes < 1 || processes > MAXPROCESSES || iterations < 1){
+    usage(argv);
+    exit(0);
+  }
+  for(i = 0; primitives[i] != NULL && primitive != NULL && strcmp(primitives[i]->name, primitive); i++);
+  for(j = 0; cases[j] != NULL && c != NULL && strcmp(cases[j], c); j++);
+  if(primitives[i] == NULL || cases[j] == NULL){
+    usage(argv);
+    exit(0);
+  }
+
+  printf("primitive,case,processes,operations,seconds,ops_per_sec,mean_ns,p50_ns,p90_ns,p99_ns,max_ns\n");
+
+  for(i = 0; primitives[i] != NULL; i++){
+    if(primitive != NULL && strcmp(primitives[i]->name, primitive)){
+      continue;
+    }
+    for(j = 0; cases[j] != NULL; j++){
+      if(c != NULL && strcmp(cases[j], c)){
+        continue;
+      }
+      for(n = 1; n <= processes; n = (n < processes && n * 2 > processes) ? processes : n * 2){
+        run(primitives[i], cases[j], n, iterations, &r);
+        if(r.errors){
+          fprintf(stderr, "%s: %ld increments lost\n", primitives[i]->name, r.errors);
+        }
+
+        printf("%s,%s,%d,%ld,%.3f,%.0f,%.0f,%lld,%lld,%lld,%lld\n", primitives[i]->name, cases[j], n,
+               r.operations, r.seconds, r.operations / r.seconds, r.mean, r.p50, r.p90, r.p99, r.max);
+        fflush(stdout);
+      }
+    }
+  }
+
+  return 0;
+}
@@ -0,0 +1,87 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/types.h>
+#include <sys/ipc.h>
+#include <sys/sem.h>
+#include "sync.h"
+
+/*
+ * SysV semaphores.
+ *
+ * One set holds the locks, semaphores 0 to objects - 1 starting at 1, and
+ * the semaphores, objects to 2 * objects - 1 starting at 0. Every operation
+ * is a semop(), even when nobody waits.
+ */
+
+/* glibc leaves the definition to the program */
+union semun
+{
+  int val;
+  struct semid_ds *buf;
+  unsigned short *array;
+};
+
+static int semid;
+static int count;
+
+static void sysv_init(int objects)
+{
+  union semun arg;
+  int i;
+
+  if((semid = semget(IPC_PRIVATE, 2 * objects, 0666 | IPC_CREAT)) == -1){
+    perror("semget");
+    exit(1);
+  }
+
+  count = objects;
+  for(i = 0; i < 2 * objects; i++){
+    arg.val = (i < objects) ? 1 : 0;
+    semctl(semid, i, SETVAL, arg);
+  }
+}
+
+static void sysv_op(int sem, int op)
+{
+  struct sembuf sb = {sem, op, 0};
+
+  if(semop(semid, &sb, 1) == -1){
+    perror("semop");
+    exit(1);
+  }
+}
+
+static void sysv_lock(int object)
+{
+  sysv_op(object, -1);
+}
+
+static void sysv_unlock(int object)
+{
+  sysv_op(object, 1);
+}
+
+static void sysv_wait(int object)
+{
+  sysv_op(count + object, -1);
+}
+
+static void sysv_post(int object)
+{
+  sysv_op(count + object, 1);
+}
+
+static void sysv_destroy(void)
+{
+  semctl(semid, 0, IPC_RMID);
+}
+
+sync_t sysv_sync = {
+  "sysv",
+  sysv_init,
+  sysv_lock,
+  sysv_unlock,
+  sysv_wait,
+  sysv_post,
+  sysv_destroy
+};